@@ -129,10 +129,36 @@ To use a numeric sort use:
 
   addrutil -f3 -s Name/n DATA
 
-Both flags may also be combined.  Currently sorting is only possible
-on one field; future versions of this tool may allow to add more than
-one field.  Sorting works only on a regular file and requires that the
-file does not change during an addrutil run.
+Both flags may also be combined.  To sort on more than one field,
+use several -s options; the flags are given for each field:
+
+  addrutil -f3 -s City -s Num/nr DATA
+
+For sorting the entire file is kept in memory; this works
+also with stdin.  A regular file is mapped and must not change during
+an addrutil run.  The sort keys are also kept in memory unless the
+option --sort-buffer is used:
+
+  addrutil -f3 -s Name --sort-buffer 64 DATA
+
+sorts runs of up to 64 MB of keys, writes them to temporary files and
+merges them for the output.
+
+To speed up selections on large files an index may be created for a
+field:
+
+  addrutil --build-index Email DATA
+
+writes the sorted values of the field Email along with the locations
+of the records to DATA.email.idx.  A selection like
+
+  addrutil -f3 -S Email=alyssa@foo.net DATA
+
+then reads only the matching records from DATA.  This is done if the
+-S options are combined only with AND and one of them tests for
+equality on a field with an index.  The output is the same as without
+the index.  An index is rebuilt when DATA has been changed; it is not
+used if DATA has been modified within the last second.
 
  */
 
@@ -142,10 +168,22 @@ file does not change during an addrutil run.
 #include <stdarg.h>
 #include <errno.h>
 #include <ctype.h>
+#include <limits.h>
+#include <time.h>
+#ifndef _WIN32
+# include <sys/types.h>
+# include <sys/stat.h>
+# include <sys/mman.h>
+# include <unistd.h>
+# include <pthread.h>
+# define USE_MMAP 1
+# define USE_THREADS 1
+#endif
 
 #define PGMNAME "addrutil"
 #define VERSION "0.72"
 #define FIELDNAMELEN 40		/* max. length of a fieldname */
+#define DIM(v) (sizeof(v)/sizeof((v)[0]))
 
 #ifdef __GNUC__
 #define INLINE __inline__
@@ -166,7 +204,12 @@ typedef enum {
   SELECT_LE,
   SELECT_GE,
   SELECT_LT,
-  SELECT_GT
+  SELECT_GT,
+  /* Pseudo ops used only in the compiled program.  */
+  SELECT_NOT,    /* Invert the result.  */
+  SELECT_JTRUE,  /* Jump if the result is true.  */
+  SELECT_JFALSE, /* Jump if the result is false.  */
+  SELECT_END
 } select_op_t;
 
 
@@ -177,6 +220,7 @@ typedef struct outfield_struct
 {
   struct outfield_struct *next;
   int flags;
+  struct field_struct *field;  /* The interned field.  */
   char name[1];
 } *OUTFIELD;
 
@@ -187,10 +231,24 @@ typedef struct selectexpr_struct
   select_op_t op;
   const char *value;  /* Points into NAME.  */
   long numvalue;
+  struct field_struct *field;  /* The interned field.  */
   char name[1];
 } *SELECTEXPR;
 
 
+/* An instruction of a compiled selection.  The program works on a
+   single result which is initially true.  */
+typedef struct
+{
+  select_op_t op;
+  int target;                  /* For SELECT_JTRUE and SELECT_JFALSE.  */
+  struct field_struct *field;
+  const char *value;
+  size_t valuelen;
+  long numvalue;
+} SELECTINSN;
+
+
 static struct
 {
   int verbose;
@@ -204,7 +262,12 @@ static struct
   int uniqmode;
   OUTFIELD outfields;
   SELECTEXPR selectexpr;
+  const char **selecttokens;  /* The args of all -S options.  */
+  int nselecttokens;
+  SELECTINSN *selectprog;     /* The compiled selection or NULL.  */
   OUTFIELD sortfields;
+  size_t sortbuffer;   /* Max. size of a sort run or 0 for unlimited. */
+  OUTFIELD indexfields;  /* Fields given with --build-index.  */
 } opt;
 
 
@@ -223,7 +286,10 @@ static DATA unused_data;	/* LL of unused data blocks. */
 typedef struct field_struct
 {
   struct field_struct *nextfield;
+  int id;			/* Index into FIELDTAB.  */
+  int linked;			/* Seen in the data and linked to FIELDLIST. */
   int valid;			/* In current record.  */
+  long firstoff;		/* Offset of the record where it was linked.  */
   DATA data;			/* Data storage for this field.  */
   char name[1];			/* Extended to the correct length.  */
 } *FIELD;
@@ -233,28 +299,93 @@ typedef struct sort_struct
 {
   struct sort_struct *next;
   long offset;			/* of the record.  */
-  char d[1];			/* Concatenated data used for sort.  */
+  size_t length;		/* of the record.  */
+  size_t keylen;		/* Length of D.  */
+  unsigned char d[1];		/* The binary sort key; see make_sort_key. */
 } *SORT;
 
 
-typedef struct namebucket_struct
+/* The input is read in blocks instead of using getc.  The reader
+   also works on a buffer already in memory; FP is then NULL.  */
+#define READER_BLOCKSIZE 65536
+typedef struct
 {
-  struct namebucket_struct *next;
-  FIELD ptr;
-} *NAMEBUCKET;
+  FILE *fp;
+  const unsigned char *buf;
+  size_t pos;			/* Next byte in BUF.  */
+  size_t end;			/* Number of valid bytes in BUF.  */
+  long base;			/* File offset of BUF[0].  */
+  unsigned char *block;		/* Allocated buffer used with FP.  */
+} READER;
+
+#define reader_getc(rd) ((rd)->pos < (rd)->end? (rd)->buf[(rd)->pos++] \
+                                              : reader_fill (rd))
+#define reader_offset(rd) ((rd)->base + (long)(rd)->pos)
 
-#define NO_NAMEBUCKETS 51
-static NAMEBUCKET namebuckets[NO_NAMEBUCKETS];
+
+/* All field names are interned: FIELDTAB maps the id of a field to
+   the field and NAMEHASH maps a name to the id plus one.  The names
+   in the option -S, -s, -u and -F are interned while parsing the
+   options so that the records need no lookups by name.  */
+static FIELD *fieldtab;
+static int nfields;
+static int *namehash;
+static unsigned int namehash_size;  /* A power of 2.  */
+
+/* The ids of the fields of the current record.  */
+static int *valid_ids;
+static int nvalid_ids;
 
 
 static FIELD fieldlist;		/* Description of the record. */
         			/* The first field ist the record marker.  */
+static FIELD fieldlist_tail;	/* The last field of FIELDLIST.  */
 static FIELD next_field;	/* Used by GetFirst/NextField(). */
 static OUTFIELD next_outfield;
 static SORT sortlist;		/* Used when sortmode or uniqmode is activ.*/
+static size_t sortlist_size;	/* Memory used by SORTLIST.  */
+static SORT sort_cursor;	/* Next item of SORTLIST to output.  */
+
+/* The runs of an external sort.  */
+#define MAX_RUNS 64
+static struct
+{
+  int n;
+  FILE *fp[MAX_RUNS];
+  SORT item[MAX_RUNS];    /* The current item from each run.  */
+  size_t itemsize[MAX_RUNS];  /* Allocated length of ITEM->d.  */
+  int heap[MAX_RUNS];     /* Indices into ITEM ordered as a heap.  */
+  int nheap;
+  int returned;           /* The first item of the heap has been returned. */
+} runs;
 static ulong output_count;
 static long start_of_record;	/* Fileoffset of the current record.  */
-static int new_record_flag;
+static long end_of_record;	/* Fileoffset after the current record.  */
+
+/* With an index only the matching records are parsed.  The fields of
+   the database are then taken from the index and linked when a scan
+   of the entire file would have seen them.  */
+static struct
+{
+  int n;
+  int size;
+  int next;			/* The next item to link.  */
+  struct
+  {
+    FIELD field;
+    long offset;		/* Offset of the record where it appears.  */
+    char name[FIELDNAMELEN + 1];  /* Spelling in the data.  */
+  } *item;
+} idxfields;
+
+/* In sort mode the entire input is kept in memory so that the
+   records can be parsed again in sorted order.  */
+static struct
+{
+  const char *buffer;
+  size_t length;
+  int mapped;
+} image;
 static struct
 {
   FILE *fp;
@@ -310,9 +441,18 @@ static void dump_hash_infos (void);
 static void log_error (int rc, const char *s, ...);
 static void process (const char *filename);
 static void read_and_print_csv (const char *filename);
+static FIELD intern_field_name (const char *fname);
+static FIELD lookup_field_name (const char *fname);
 static FIELD store_field_name (const char *fname, long offset);
+static void link_field (FIELD fdes, const char *fname);
+static void link_index_fields (long offset);
 static DATA expand_data_slot (FIELD field, DATA data);
 static void new_record (long);
+static void load_image (FILE *fp, const char *filename);
+#ifdef USE_MMAP
+static int build_index (const char *filename, const char *fieldname);
+static int use_index (const char *filename);
+#endif
 static FIELD get_first_field (void);
 static FIELD get_next_field (void);
 static void finish_record (void);
@@ -322,6 +462,9 @@ static int process_template_op (const char *op);
 static void do_sort (void);
 static int do_sort_fnc (const void *arg_a, const void *arg_b);
 static void do_uniq (void);
+static void flush_run (void);
+static void rewind_sorted (void);
+static SORT next_sorted (void);
 
 static const char *get_usage_str (int level);
 
@@ -448,27 +591,25 @@ strip_trailing_ws (char *str)
 }
 
 
-/* Find string SUB in (BUFFER,BUFLEN).  */
+/* Find string (SUB,SUBLEN) in (BUFFER,BUFLEN).  SUBLEN must not be
+   0.  memchr is usually vectorized and thus we use it to skip to the
+   candidates.  */
 static const char *
-memstr (const void *buffer, size_t buflen, const char *sub)
+memstr (const void *buffer, size_t buflen, const char *sub, size_t sublen)
 {
   const char *buf = buffer;
-  const char *t = buf;
-  const char *s = sub;
-  size_t n = buflen;
+  const char *end = buf + buflen;
+  const char *t;
 
-  for (; n; t++, n--)
+  while (buflen >= sublen)
     {
-      if (*t == *s)
-        {
-          for (buf = t++, buflen = n--, s++; n && *t == *s; t++, s++, n--)
-            ;
-          if (!*s)
-            return buf;
-          t = buf;
-          s = sub ;
-          n = buflen;
-	}
+      t = memchr (buf, *sub, buflen - sublen + 1);
+      if (!t)
+        break;
+      if (!memcmp (t + 1, sub + 1, sublen - 1))
+        return t;
+      buf = t + 1;
+      buflen = end - buf;
     }
   return NULL;
 }
@@ -849,7 +990,23 @@ show_version ()
       -n  True if value is not empty.
       -z  True if valie is empty.
 
-      Numerical values are computed as long int.  */
+      Numerical values are computed as long int.
+
+   All -S options are combined with AND.  Several -S options may be
+   grouped using these pseudo expressions:
+
+      (       Begin a group.
+      )       End a group.
+      ! not   Negate the next expression or group.
+      && and  AND; this is the default.
+      || or   OR; this has a lower precedence than AND.
+
+   For example:
+
+      -S ( -S Name=~Smith -S or -S Name=~Jones -S ) -S not -S City=Bonn
+
+   The expressions are compiled into a small program which evaluates
+   only what is needed.  */
 
 
 static SELECTEXPR
@@ -965,11 +1122,182 @@ parse_selectexpr (const char *expr)
     log_error (1, "%s: no value given for select\n", PGMNAME);
 
   se->numvalue = strtol (se->value, NULL, 10);
+  se->field = intern_field_name (se->name);
 
   return se;
 }
 
 
+/* State of compile_select.  */
+static struct
+{
+  int pos;        /* Index of the next token.  */
+  int nprog;      /* Number of used instructions.  */
+  int size;       /* Allocated instructions.  */
+} selcomp;
+
+
+/* Append an instruction to the selection program.  Returns its
+   index.  */
+static int
+emit_select (select_op_t op, SELECTEXPR se)
+{
+  SELECTINSN *insn;
+
+  if (selcomp.nprog == selcomp.size)
+    {
+      selcomp.size += 32;
+      opt.selectprog = realloc (opt.selectprog,
+                                selcomp.size * sizeof *opt.selectprog);
+      if (!opt.selectprog)
+        {
+          fprintf (stderr, PGMNAME ": out of memory\n");
+          exit (2);
+        }
+    }
+  insn = opt.selectprog + selcomp.nprog;
+  memset (insn, 0, sizeof *insn);
+  insn->op = op;
+  if (se)
+    {
+      insn->field = se->field;
+      insn->value = se->value;
+      insn->valuelen = strlen (se->value);
+      insn->numvalue = se->numvalue;
+    }
+  return selcomp.nprog++;
+}
+
+
+/* Return true if the current token is one of the strings A or B.  */
+static int
+select_token_p (const char *a, const char *b)
+{
+  const char *t;
+  size_t n;
+
+  if (selcomp.pos >= opt.nselecttokens)
+    return 0;
+  t = opt.selecttokens[selcomp.pos];
+  while (*t == ' ' || *t == '\t')
+    t++;
+  for (n = strlen (t); n && (t[n-1] == ' ' || t[n-1] == '\t'); n--)
+    ;
+  return ((strlen (a) == n && !strncmp (t, a, n))
+          || (b && strlen (b) == n && !strncmp (t, b, n)));
+}
+
+static void select_or (void);
+
+/* unary := "!" unary | "(" or ")" | expression  */
+static void
+select_unary (void)
+{
+  SELECTEXPR se;
+
+  if (selcomp.pos >= opt.nselecttokens)
+    log_error (1, "%s: select expression expected", PGMNAME);
+  if (select_token_p ("!", "not"))
+    {
+      selcomp.pos++;
+      select_unary ();
+      emit_select (SELECT_NOT, NULL);
+    }
+  else if (select_token_p ("(", NULL))
+    {
+      selcomp.pos++;
+      select_or ();
+      if (!select_token_p (")", NULL))
+        log_error (1, "%s: missing ')' in select expression", PGMNAME);
+      selcomp.pos++;
+    }
+  else if (select_token_p (")", NULL) || select_token_p ("&&", "and")
+           || select_token_p ("||", "or"))
+    log_error (1, "%s: unexpected '%s' in select expression",
+               PGMNAME, opt.selecttokens[selcomp.pos]);
+  else
+    {
+      se = parse_selectexpr (opt.selecttokens[selcomp.pos++]);
+      se->next = opt.selectexpr;
+      opt.selectexpr = se;
+      emit_select (se->op, se);
+    }
+}
+
+/* Emit a jump OP and add it to the list of jumps which have no
+   target yet.  The list is threaded through the TARGET fields; *LIST
+   is the index of its last jump or -1.  */
+static void
+emit_select_jump (select_op_t op, int *list)
+{
+  int idx = emit_select (op, NULL);
+
+  opt.selectprog[idx].target = *list;
+  *list = idx;
+}
+
+/* Set the target of all jumps on LIST to the next instruction.  */
+static void
+patch_select_jumps (int list)
+{
+  int next;
+
+  for (; list != -1; list = next)
+    {
+      next = opt.selectprog[list].target;
+      opt.selectprog[list].target = selcomp.nprog;
+    }
+}
+
+/* and := unary { ["&&"] unary }  */
+static void
+select_and (void)
+{
+  int jumps = -1;
+
+  select_unary ();
+  while (selcomp.pos < opt.nselecttokens
+         && !select_token_p (")", NULL) && !select_token_p ("||", "or"))
+    {
+      if (select_token_p ("&&", "and"))
+        selcomp.pos++;
+      emit_select_jump (SELECT_JFALSE, &jumps);
+      select_unary ();
+    }
+  patch_select_jumps (jumps);
+}
+
+/* or := and { "||" and }  */
+static void
+select_or (void)
+{
+  int jumps = -1;
+
+  select_and ();
+  while (select_token_p ("||", "or"))
+    {
+      selcomp.pos++;
+      emit_select_jump (SELECT_JTRUE, &jumps);
+      select_and ();
+    }
+  patch_select_jumps (jumps);
+}
+
+
+/* Compile the arguments of all -S options into OPT.SELECTPROG.  */
+static void
+compile_select (void)
+{
+  if (!opt.nselecttokens)
+    return;
+  select_or ();
+  if (selcomp.pos < opt.nselecttokens)
+    log_error (1, "%s: unexpected '%s' in select expression",
+               PGMNAME, opt.selecttokens[selcomp.pos]);
+  emit_select (SELECT_END, NULL);
+}
+
+
 static void
 add_sortfield (ARGPARSE_ARGS *pargs)
 {
@@ -1000,6 +1328,7 @@ add_sortfield (ARGPARSE_ARGS *pargs)
                 }
             }
         }
+      of->field = intern_field_name (of->name);
 
       if (!(of2 = opt.sortfields))
         opt.sortfields = of;
@@ -1026,6 +1355,8 @@ main (int argc, char **argv)
     {'T', "tex-file", 2, "use TeX file as template"},
     {'c', "check-only", 0, "do only a syntax check"},
     { 501, "readcsv",   0, "read CSV data" },
+    { 502, "sort-buffer", 1, "sort in runs of N MB using temporary files" },
+    { 503, "build-index", 2, "write an index for field NAME" },
     {'v', "verbose", 0, "verbose"},
     {'d', "debug", 0, "increase the debug level"},
     {0}
@@ -1036,6 +1367,7 @@ main (int argc, char **argv)
   OUTFIELD of, of2;
   SELECTEXPR se;
   FIELD f;
+  int used_index = 0;
 
   while (arg_parse (&pargs, opts))
     {
@@ -1070,6 +1402,7 @@ main (int argc, char **argv)
 	  of = xmalloc (sizeof *of + strlen (pargs.r.ret_str));
 	  of->next = NULL;
 	  strcpy (of->name, pargs.r.ret_str);
+	  of->field = intern_field_name (of->name);
 	  if (!(of2 = opt.outfields))
 	    opt.outfields = of;
 	  else
@@ -1082,13 +1415,25 @@ main (int argc, char **argv)
         case 501:
           opt.readcsv = 1;
           break;
+        case 502:
+          opt.sortbuffer = (size_t)pargs.r.ret_int * 1024 * 1024;
+          break;
+        case 503:
+	  of = xmalloc (sizeof *of + strlen (pargs.r.ret_str));
+	  strcpy (of->name, pargs.r.ret_str);
+	  of->next = opt.indexfields;
+	  opt.indexfields = of;
+          break;
 	case 'S':
-          se = parse_selectexpr (pargs.r.ret_str);
-          if (se)
+          opt.selecttokens = realloc (opt.selecttokens,
+                                      (opt.nselecttokens + 1)
+                                      * sizeof *opt.selecttokens);
+          if (!opt.selecttokens)
             {
-              se->next = opt.selectexpr;
-              opt.selectexpr = se;
+              fprintf (stderr, PGMNAME ": out of memory\n");
+              exit (2);
             }
+          opt.selecttokens[opt.nselecttokens++] = pargs.r.ret_str;
 	  break;
 	default:
 	  pargs.err = 2;
@@ -1096,27 +1441,39 @@ main (int argc, char **argv)
 	}
     }
 
-  if (opt.selectexpr && opt.debug)
+  compile_select ();
+  if (opt.selectprog && opt.debug)
     {
       FILE *fp = stderr;
+      SELECTINSN *insn;
 
       fputs ("--- Begin selectors ---\n", fp);
-      for (se=opt.selectexpr; se; se = se->next)
-        fprintf (fp, "*(%s) %s '%s'\n",
-                 se->name,
-                 se->op == SELECT_SAME?    "= ":
-                 se->op == SELECT_NOTSAME? "<>":
-                 se->op == SELECT_SUB?     "=~":
-                 se->op == SELECT_NOTSUB?  "!~":
-                 se->op == SELECT_EMPTY?   "-z":
-                 se->op == SELECT_NOTEMPTY?"-n":
-                 se->op == SELECT_EQ?      "==":
-                 se->op == SELECT_NE?      "!=":
-                 se->op == SELECT_LT?      "< ":
-                 se->op == SELECT_LE?      "<=":
-                 se->op == SELECT_GT?      "> ":
-                 se->op == SELECT_GE?      ">=":"[oops]",
-                 se->value);
+      for (insn = opt.selectprog; insn->op != SELECT_END; insn++)
+        {
+          fprintf (fp, "%3d ", (int)(insn - opt.selectprog));
+          if (insn->op == SELECT_NOT)
+            fputs ("not\n", fp);
+          else if (insn->op == SELECT_JTRUE)
+            fprintf (fp, "jtrue  %d\n", insn->target);
+          else if (insn->op == SELECT_JFALSE)
+            fprintf (fp, "jfalse %d\n", insn->target);
+          else
+            fprintf (fp, "*(%s) %s '%s'\n",
+                     insn->field->name,
+                     insn->op == SELECT_SAME?    "= ":
+                     insn->op == SELECT_NOTSAME? "<>":
+                     insn->op == SELECT_SUB?     "=~":
+                     insn->op == SELECT_NOTSUB?  "!~":
+                     insn->op == SELECT_EMPTY?   "-z":
+                     insn->op == SELECT_NOTEMPTY?"-n":
+                     insn->op == SELECT_EQ?      "==":
+                     insn->op == SELECT_NE?      "!=":
+                     insn->op == SELECT_LT?      "< ":
+                     insn->op == SELECT_LE?      "<=":
+                     insn->op == SELECT_GT?      "> ":
+                     insn->op == SELECT_GE?      ">=":"[oops]",
+                     insn->value);
+        }
       fputs ("--- End selectors ---\n", fp);
     }
 
@@ -1132,6 +1489,27 @@ main (int argc, char **argv)
       exit (0);
     }
 
+  if (opt.indexfields)
+    {
+      int rc = 0;
+
+      if (!argc)
+        {
+          fprintf (stderr, PGMNAME ": --build-index requires a file\n");
+          exit (1);
+        }
+#ifdef USE_MMAP
+      for (; argc; argc--, argv++)
+        for (of = opt.indexfields; of; of = of->next)
+          if (build_index (*argv, of->name))
+            rc = 1;
+#else
+      fprintf (stderr, PGMNAME ": indices are not supported\n");
+      rc = 1;
+#endif
+      exit (rc);
+    }
+
   if (opt.template)
     {
       tex.fp = fopen (opt.template, "r");
@@ -1149,7 +1527,7 @@ main (int argc, char **argv)
 	       PGMNAME ": --sort and --uniq may not be used together\n");
       exit (1);
     }
-  if ((opt.sortmode||opt.uniqmode) && argc != 1)
+  if ((opt.sortmode||opt.uniqmode) && argc > 1)
     {
       fprintf (stderr,
 	       PGMNAME ": sorry,"
@@ -1157,16 +1535,20 @@ main (int argc, char **argv)
       exit (1);
     }
 
-  /* Print a warning if more than one sort field is given.  FIXME: We
-     should eventually lift that limit. */
-  if (opt.sortfields && opt.sortfields->next)
+  if (opt.uniqmode && opt.sortbuffer)
     fprintf (stderr,
-             PGMNAME ": warning: only the first sort field is used\n");
+             PGMNAME ": warning: --sort-buffer is ignored with --uniq\n");
 
   /* For internal purposes we set the sortmode flag with uniqmode.  */
   if (opt.uniqmode)
     opt.sortmode = 1;
 
+#ifdef USE_MMAP
+  /* An index may replace the scan of the entire file.  */
+  if (argc == 1 && opt.selectprog && !opt.sortmode && !opt.checkonly)
+    used_index = use_index (*argv);
+#endif
+
   org_argc = argc;
   org_argv = argv;
 
@@ -1205,7 +1587,7 @@ main (int argc, char **argv)
   else if (opt.format == 2 && opt.sortmode != 1)
     print_format2 (1);		/* flush */
 
-  if (opt.sortmode == 1 && sortlist)
+  if (opt.sortmode == 1 && (sortlist || runs.n))
     {
       if (opt.uniqmode)
         do_uniq ();
@@ -1222,12 +1604,9 @@ main (int argc, char **argv)
     }
 
 
-  for (se=opt.selectexpr; se; se = se->next)
+  for (se=opt.selectexpr; se && !used_index; se = se->next)
     {
-      for (f = fieldlist; f; f = f->nextfield)
-        if (!strcmp (f->name, se->name))
-          break;
-      if (!f)
+      if (!se->field->linked)
         fprintf (stderr, PGMNAME ": warning: "
                  "select field '%s' not found in data\n", se->name);
     }
@@ -1285,28 +1664,27 @@ hash_name (const char *s_arg)
 	  }
       }
 
-  return hashVal % NO_NAMEBUCKETS;
+  return hashVal;
 }
 
 
 static void
 dump_hash_infos ()
 {
-  int i, sum, perBucket, n;
-  NAMEBUCKET r;
+  unsigned int i, j, n, maxprobe;
 
-  perBucket = sum = 0;
-  for (i = 0; i < NO_NAMEBUCKETS; i++)
-    {
-      for (n = 0, r = namebuckets[i]; r; r = r->next)
-	n++;
-      sum += n;
-      if (n > perBucket)
-	perBucket = n;
-    }
+  maxprobe = 0;
+  for (i = 0; i < namehash_size; i++)
+    if (namehash[i])
+      {
+        j = hash_name (fieldtab[namehash[i]-1]->name) & (namehash_size - 1);
+        n = ((i - j) & (namehash_size - 1)) + 1;
+        if (n > maxprobe)
+          maxprobe = n;
+      }
   fprintf (stderr,
-	   "%d entries in %d hash buckets; max. %d entr%s per hash bucket\n",
-	   sum, NO_NAMEBUCKETS, perBucket, perBucket == 1 ? "y" : "ies");
+	   "%d field names in %u hash slots; max. %u probe%s\n",
+	   nfields, namehash_size, maxprobe, maxprobe == 1 ? "" : "s");
 }
 
 
@@ -1325,6 +1703,58 @@ log_error (int rc, const char *s, ...)
 }
 
 
+/* Prepare RD to read from FP.  */
+static void
+reader_open (READER *rd, FILE *fp)
+{
+  rd->fp = fp;
+  rd->block = xmalloc (READER_BLOCKSIZE);
+  rd->buf = rd->block;
+  rd->pos = rd->end = 0;
+  rd->base = 0;
+}
+
+
+/* Prepare RD to read the bytes START to END of BUFFER.  */
+static void
+reader_open_memory (READER *rd, const void *buffer, size_t start, size_t end)
+{
+  rd->fp = NULL;
+  rd->block = NULL;
+  rd->buf = buffer;
+  rd->pos = start;
+  rd->end = end;
+  rd->base = 0;
+}
+
+
+static void
+reader_close (READER *rd)
+{
+  free (rd->block);
+  rd->block = NULL;
+}
+
+
+/* Read the next block and return its first byte or EOF.  This is
+   called by reader_getc if the buffer is exhausted.  */
+static int
+reader_fill (READER *rd)
+{
+  size_t n;
+
+  if (!rd->fp)
+    return EOF;
+  n = fread (rd->block, 1, READER_BLOCKSIZE, rd->fp);
+  if (!n)
+    return EOF;
+  rd->base += rd->end;
+  rd->end = n;
+  rd->pos = 1;
+  return rd->buf[0];
+}
+
+
 static void
 process (const char *filename)
 {
@@ -1346,11 +1776,19 @@ process (const char *filename)
   } state = sINIT;
   FIELD f = NULL;		/* current field */
   DATA d = NULL;		/* current data slot */
-  SORT sort = sortlist;
+  SORT sort;
   int pending_lf = 0;
-  int skip_kludge = 0;
+  READER rd;
+  const unsigned char *p, *q;
+  size_t n;
 
-  if (filename)
+  if (opt.sortmode == 2)
+    {
+      /* The data has already been loaded.  */
+      fp = NULL;
+      filename = filename? filename : "[stdin]";
+    }
+  else if (filename)
     {
       fp = fopen (filename, "r");
       if (!fp)
@@ -1366,36 +1804,50 @@ process (const char *filename)
       filename = "[stdin]";
     }
 
-  if (opt.sortmode == 2)  /* Sorting/uniqing has been done. */
+  if (opt.sortmode == 1)
+    {
+      load_image (fp, filename);
+      reader_open_memory (&rd, image.buffer, 0, image.length);
+    }
+  else if (opt.sortmode == 2)  /* Sorting/uniqing has been done. */
     {
-      if (!sort)
+      if (!sortlist && !runs.n)
 	return;		  /* nothing to sort */
+      reader_open_memory (&rd, image.buffer, 0, 0);
+      rewind_sorted ();
     next_sortrecord:
-      if (!sort)
+      if (!(sort = next_sorted ()))
 	goto ready;
       if (sort->offset == -1)
         {
           /* Skip deleted records.  */
-          sort = sort->next;
           goto next_sortrecord;
         }
-      clearerr (fp);
-      if (fseek (fp, sort->offset, SEEK_SET))
-	{
-	  fprintf (stderr, PGMNAME ": error seeking to %ld\n", sort->offset);
-	  exit (2);
-	}
-      sort = sort->next;
+      if (idxfields.n)
+        {
+          /* Print the previous record before linking the fields a
+             scan would see only after it.  */
+          finish_record ();
+          link_index_fields (sort->offset);
+        }
+      /* Parse just this record from the image.  It will be finished
+         by the first field of the next record or at READY.  */
+      reader_open_memory (&rd, image.buffer,
+                          sort->offset, sort->offset + sort->length);
       state = sINIT;
-      skip_kludge = 1;
+      newline = 1;
+      comment = 0;
+      linewrn = 0;
     }
+  else
+    reader_open (&rd, fp);
 
   /* Read the file byte by byte; do not impose a limit on the
    * line length. Fieldnames are up to FIELDNAMELEN bytes long.
    */
   lineno++;
   newline = 1;
-  while ((c = getc (fp)) != EOF)
+  while ((c = reader_getc (&rd)) != EOF)
     {
       if (c == '\n')
 	{
@@ -1412,20 +1864,19 @@ process (const char *filename)
 	      break;
 	    }
 	  lineno++;
-	  lineoff = ftell (fp) - 1;
-          if (lineoff == -1 && opt.sortmode)
-            {
-	      log_error (2, "%s:%ld: ftell() failed: %s",
-                         filename, lineno, strerror (errno));
-              exit (1);
-            }
+	  lineoff = reader_offset (&rd);
 	  newline = 1;
 	  comment = 0;
 	  linewrn = 0;
 	  continue;
 	}
       else if (comment)
-	continue;
+	{
+	  /* Skip the rest of the line at once.  */
+	  p = memchr (rd.buf + rd.pos, '\n', rd.end - rd.pos);
+	  rd.pos = p? p - rd.buf : rd.end;
+	  continue;
+	}
 
       if (newline)
 	{			/* at first column */
@@ -1499,11 +1950,7 @@ process (const char *filename)
 		    index = 0;	/* must calculate an index */
 		  if (!*fname)
 		    log_error (2, "%s:%lu: empty fieldname", filename, lineno);
-		  new_record_flag = 0;
 		  f = store_field_name (fname, lineoff);
-		  if (opt.sortmode == 2 && new_record_flag && !skip_kludge)
-		    goto next_sortrecord;
-		  skip_kludge = 0;
 		  if (!index)
 		    { /* detect the index */
 		      /* first a shortcut: */
@@ -1569,6 +2016,18 @@ process (const char *filename)
 		    log_error (2, "%s:%ld: fieldname too long",
                                filename, lineno);
 		  fname[fnameidx++] = c;
+		  /* Take the rest of the name at once if the colon is
+		     in the buffer.  */
+		  p = rd.buf + rd.pos;
+		  n = rd.end - rd.pos;
+		  if (n > FIELDNAMELEN - fnameidx + 1)
+		    n = FIELDNAMELEN - fnameidx + 1;
+		  if ((q = memchr (p, ':', n)) && !memchr (p, '\n', q - p))
+		    {
+		      memcpy (fname + fnameidx, p, q - p);
+		      fnameidx += q - p;
+		      rd.pos += q - p;
+		    }
 		}
 	      break;
 	    case sDATABEG:
@@ -1588,11 +2047,22 @@ process (const char *filename)
 	      if (d->used >= d->size)
 		d = expand_data_slot (f, d);
 	      d->d[d->used++] = c;
+	      /* Copy the rest of the line at once.  */
+	      p = rd.buf + rd.pos;
+	      q = memchr (p, '\n', rd.end - rd.pos);
+	      n = q? q - p : rd.end - rd.pos;
+	      while (d->size - d->used < n)
+		d = expand_data_slot (f, d);
+	      memcpy (d->d + d->used, p, n);
+	      d->used += n;
+	      rd.pos += n;
 	      break;
 	    } /* end switch state after first column */
 	}
     }
-  if (ferror (fp))
+  if (opt.sortmode == 2)
+    goto next_sortrecord;
+  if (fp && ferror (fp))
     {
       fprintf (stderr, PGMNAME ":%s:%lu: read error: %s\n",
 	       filename, lineno, strerror (errno));
@@ -1602,102 +2072,647 @@ process (const char *filename)
     {
       log_error (0, "%s: warning: last line not terminated by a LF", filename);
     }
-  if (opt.sortmode == 2)
-    goto next_sortrecord;
 
  ready:
+  end_of_record = reader_offset (&rd);
   finish_record ();
+  if (idxfields.n)
+    link_index_fields (LONG_MAX);
   lineno--;
   if (opt.verbose)
     log_error (0, "%s: %lu line%s processed", filename, lineno,
                lineno == 1 ? "" : "s");
 
-  if (fp != stdin)
+  reader_close (&rd);
+  if (fp && fp != stdin)
     fclose (fp);
 }
 
 
+/* Read the entire input from FP into IMAGE.  A regular file is
+   mapped; other input is copied into an allocated buffer.  */
 static void
-read_and_print_csv (const char *filename)
+load_image (FILE *fp, const char *filename)
 {
-  FILE *fp;
-  int c;
-  unsigned long lineno;
-  int newline, newfield, in_string, any_printed;
-  int fieldidx = 0;
-  OUTFIELD of;
+  char *buffer;
+  size_t size, n;
 
-  if (filename)
-    {
-      fp = fopen (filename, "r");
-      if (!fp)
-	{
-	  fprintf (stderr, PGMNAME ": failed to open `%s': %s\n",
-		   filename, strerror (errno));
-	  exit (1);
-	}
-    }
-  else
-    {
-      fp = stdin;
-      filename = "[stdin]";
-    }
+#ifdef USE_MMAP
+  struct stat st;
 
-  /* Read the file byte by byte; do not impose a limit on the line
-   * length.  Fieldnames are up to FIELDNAMELEN bytes long.  */
-  lineno  = 1;
-  newline = 1;
-  newfield = 0;
-  in_string = 0;
-  any_printed = 0;
-  of = NULL;
-  while ((c = getc (fp)) != EOF)
+  if (!fstat (fileno (fp), &st) && S_ISREG (st.st_mode)
+      && !lseek (fileno (fp), 0, SEEK_CUR))
     {
-      if (c == '\r')
-        continue;
-
-      if (c == '\n')  /* End of line.  */
-	{
-          putchar ('\n');
-          putchar ('\n');
-	  lineno++;
-	  newline = 1;
-          newfield = 0;
-          in_string = 0;
-          fieldidx = 0;
-	  continue;
-	}
-
-      if (newline) /* At a new record.  */
+      image.length = st.st_size;
+      if (!image.length)
         {
-	  newline = 0;
-          newfield = 1;
-          of = opt.outfields? opt.outfields : NULL;
-	}
-
-      if (newfield)
+          image.buffer = "";
+          return;
+        }
+      image.buffer = mmap (NULL, image.length, PROT_READ, MAP_PRIVATE,
+                           fileno (fp), 0);
+      if (image.buffer != MAP_FAILED)
         {
-          if (of)
-            printf ("%s:", of->name);
-          else
-            printf ("Field_%d:", fieldidx);
-          newfield = 0;
-          any_printed = 0;
-          in_string = 0;
+          image.mapped = 1;
+          return;
         }
+    }
+#endif /*USE_MMAP*/
 
-      if (in_string == 1)
+  size = 65536;
+  buffer = xmalloc (size);
+  image.length = 0;
+  while ((n = fread (buffer + image.length, 1, size - image.length, fp)))
+    {
+      image.length += n;
+      if (image.length == size)
         {
-          if (c == '\"')
-            in_string = 2; /* Possible end of string.  */
-          else
+          size *= 2;
+          buffer = realloc (buffer, size);
+          if (!buffer)
             {
-              if (!any_printed)
-                {
+              fprintf (stderr, PGMNAME ": out of memory\n");
+              exit (2);
+            }
+        }
+    }
+  if (ferror (fp))
+    {
+      fprintf (stderr, PGMNAME ":%s: read error: %s\n",
+               filename, strerror (errno));
+      exit (2);
+    }
+  image.buffer = buffer;
+  image.mapped = 0;
+}
+
+
+#ifdef USE_MMAP
+/* Return a malloced string with the name of the index file for the
+   field FIELDNAME of the database FILENAME.  */
+static char *
+index_file_name (const char *filename, const char *fieldname)
+{
+  char *name, *p;
+
+  name = xmalloc (strlen (filename) + 1 + strlen (fieldname) + 4 + 1);
+  sprintf (name, "%s.%s.idx", filename, fieldname);
+  /* Fieldnames are case insensitive.  */
+  for (p = name + strlen (filename); *p; p++)
+    *p = tolower (*(unsigned char *)p);
+  return name;
+}
+
+
+/* Write an index for the field FIELDNAME of the database FILENAME.
+   The index is a text file named FILENAME.FIELDNAME.idx.  It starts
+   with the three lines
+
+     addrutil-index 2 SECONDS NANOSECONDS SIZE
+     FIELD1:FIELD2:...
+     OFFSET1 OFFSET2 ...
+
+   with the modification time and the size of the database, the names
+   of all fields in the database and the offsets of the records where
+   they first appear.  The index is considered stale if the time or
+   the size don't match anymore; the time is written as 0 if the
+   database has been modified within the last second.  Each further
+   line describes one record with the value of the field (escaping
+   '%', TAB and LF in the same way as format 0 does), followed by a
+   TAB, the offset of the record, a TAB and the length of the record.
+   The lines are sorted by the plain value; records without that
+   field are not listed.  Returns 0 on success.  */
+static int
+build_index (const char *filename, const char *fieldname)
+{
+  struct stat st;
+  OUTFIELD sf, saved_sortfields = opt.sortfields;
+  int saved_sortmode = opt.sortmode;
+  size_t saved_sortbuffer = opt.sortbuffer;
+  FIELD f, f2, saved_fieldlist_tail = fieldlist_tail;
+  char *idxname, *tmpname;
+  FILE *fp;
+  SORT s, s2;
+  size_t n;
+  time_t now = time (NULL);
+  unsigned long count = 0;
+  int rc = 0;
+
+  if (stat (filename, &st))
+    {
+      fprintf (stderr, PGMNAME ": can't stat `%s': %s\n",
+               filename, strerror (errno));
+      return -1;
+    }
+  if (!S_ISREG (st.st_mode))
+    {
+      fprintf (stderr, PGMNAME ": can't index `%s': not a regular file\n",
+               filename);
+      return -1;
+    }
+
+  /* The sort machinery collects the values and offsets for us.  */
+  sf = xcalloc (1, sizeof *sf + strlen (fieldname));
+  strcpy (sf->name, fieldname);
+  sf->field = intern_field_name (fieldname);
+  opt.sortfields = sf;
+  opt.sortmode = 1;
+  opt.sortbuffer = 0;
+  sortlist = NULL;
+  sortlist_size = 0;
+  start_of_record = 0;
+  process (filename);
+  do_sort ();
+
+  idxname = index_file_name (filename, fieldname);
+  tmpname = xmalloc (strlen (idxname) + 4 + 1);
+  sprintf (tmpname, "%s.tmp", idxname);
+  fp = fopen (tmpname, "w");
+  if (!fp)
+    {
+      fprintf (stderr, PGMNAME ": failed to create `%s': %s\n",
+               tmpname, strerror (errno));
+      rc = -1;
+    }
+  else
+    {
+      /* The database may be changed again without a change of the
+         time; thus we don't trust a recent time.  */
+      if (st.st_mtime >= now - 1)
+        fprintf (fp, "addrutil-index 2 0 0 %lu\n",
+                 (unsigned long)st.st_size);
+      else
+        fprintf (fp, "addrutil-index 2 %lu %lu %lu\n",
+                 (unsigned long)st.st_mtim.tv_sec,
+                 (unsigned long)st.st_mtim.tv_nsec,
+                 (unsigned long)st.st_size);
+      for (f = fieldlist; f; f = f->nextfield)
+        fprintf (fp, "%s%c", f->name, f->nextfield? ':':'\n');
+      if (!fieldlist)
+        putc ('\n', fp);
+      for (f = fieldlist; f; f = f->nextfield)
+        fprintf (fp, "%ld%c", f->firstoff, f->nextfield? ' ':'\n');
+      if (!fieldlist)
+        putc ('\n', fp);
+    }
+  for (s = sortlist; s; s = s2)
+    {
+      s2 = s->next;
+      if (fp && s->keylen > 1)
+        {
+          for (n = 0; n < s->keylen - 1; n++)
+            {
+              if (s->d[n] == '%')
+                fputs ("%25", fp);
+              else if (s->d[n] == '\t')
+                fputs ("%09", fp);
+              else if (s->d[n] == '\n')
+                fputs ("%0A", fp);
+              else
+                putc (s->d[n], fp);
+            }
+          fprintf (fp, "\t%ld\t%lu\n", s->offset, (unsigned long)s->length);
+          count++;
+        }
+      free (s);
+    }
+  sortlist = NULL;
+  sortlist_size = 0;
+  if (fp)
+    {
+      if (ferror (fp))
+        {
+          fprintf (stderr, PGMNAME ": error writing `%s': %s\n",
+                   tmpname, strerror (errno));
+          fclose (fp);
+          remove (tmpname);
+          rc = -1;
+        }
+      else if (fclose (fp))
+        {
+          fprintf (stderr, PGMNAME ": error writing `%s': %s\n",
+                   tmpname, strerror (errno));
+          remove (tmpname);
+          rc = -1;
+        }
+      else if (rename (tmpname, idxname))
+        {
+          fprintf (stderr, PGMNAME ": error renaming `%s': %s\n",
+                   tmpname, strerror (errno));
+          remove (tmpname);
+          rc = -1;
+        }
+      else if (opt.verbose)
+        log_error (0, "%s: %lu record%s indexed", idxname, count,
+                   count == 1 ? "" : "s");
+    }
+
+  if (image.mapped)
+    munmap ((void *)image.buffer, image.length);
+  image.buffer = NULL;
+  image.length = 0;
+  image.mapped = 0;
+  opt.sortfields = saved_sortfields;
+  opt.sortmode = saved_sortmode;
+  opt.sortbuffer = saved_sortbuffer;
+  /* Forget the fields seen while building the index.  */
+  for (f = saved_fieldlist_tail? saved_fieldlist_tail->nextfield : fieldlist;
+       f; f = f2)
+    {
+      f2 = f->nextfield;
+      f->nextfield = NULL;
+      f->linked = 0;
+    }
+  if (saved_fieldlist_tail)
+    saved_fieldlist_tail->nextfield = NULL;
+  else
+    fieldlist = NULL;
+  fieldlist_tail = saved_fieldlist_tail;
+  free (sf);
+  free (tmpname);
+  free (idxname);
+  return rc;
+}
+
+
+/* Map the index file IDXNAME and check that it is up to date for the
+   database described by ST.  Returns the mapped area at R_BUFFER and
+   R_LENGTH, the offset of the list of fields at R_FIELDS and the
+   offset of the first line after the header at R_LINES.  Returns 0
+   on success.  */
+static int
+map_index (const char *idxname, const struct stat *st,
+           const char **r_buffer, size_t *r_length,
+           size_t *r_fields, size_t *r_lines)
+{
+  FILE *fp;
+  struct stat idxst;
+  const char *buffer, *p;
+  char line[80];
+  unsigned long sec, nsec, size;
+
+  fp = fopen (idxname, "r");
+  if (!fp)
+    return -1;
+  if (fstat (fileno (fp), &idxst) || !idxst.st_size)
+    {
+      fclose (fp);
+      return -1;
+    }
+  buffer = mmap (NULL, idxst.st_size, PROT_READ, MAP_PRIVATE,
+                 fileno (fp), 0);
+  fclose (fp);
+  if (buffer == MAP_FAILED)
+    return -1;
+
+  /* The file must end in a LF so that the parsing of a line never
+     runs off the end.  */
+  p = memchr (buffer, '\n', idxst.st_size);
+  if (!p || p - buffer >= sizeof line || buffer[idxst.st_size - 1] != '\n')
+    goto leave;
+  memcpy (line, buffer, p - buffer);
+  line[p - buffer] = 0;
+  if (sscanf (line, "addrutil-index 2 %lu %lu %lu", &sec, &nsec, &size) != 3
+      || !sec
+      || sec != (unsigned long)st->st_mtim.tv_sec
+      || nsec != (unsigned long)st->st_mtim.tv_nsec
+      || size != (unsigned long)st->st_size)
+    goto leave;
+
+  *r_buffer = buffer;
+  *r_length = idxst.st_size;
+  *r_fields = p + 1 - buffer;
+  p = memchr (p + 1, '\n', buffer + idxst.st_size - (p + 1));
+  if (!p)
+    goto leave;
+  p = memchr (p + 1, '\n', buffer + idxst.st_size - (p + 1));
+  if (!p)
+    goto leave;
+  *r_lines = p + 1 - buffer;
+  return 0;
+
+ leave:
+  munmap ((void *)buffer, idxst.st_size);
+  return -1;
+}
+
+
+/* Compare the escaped value at the start of the index line P with
+   the plain value (VALUE,N).  */
+static int
+compare_index_value (const char *p, const char *value, size_t n)
+{
+#define HEXVAL(c) ((c) <= '9'? (c) - '0' : ((c) & 0xdf) - 'A' + 10)
+  int c;
+
+  for (;; value++, n--)
+    {
+      if (*p == '\t' || *p == '\n')
+        return n? -1 : 0;
+      if (*p == '%' && isxdigit (p[1]) && isxdigit (p[2]))
+        {
+          c = (HEXVAL (p[1]) << 4) | HEXVAL (p[2]);
+          p += 3;
+        }
+      else
+        c = *(const unsigned char *)p++;
+      if (!n)
+        return 1;
+      if (c != *(const unsigned char *)value)
+        return c - *(const unsigned char *)value;
+    }
+#undef HEXVAL
+}
+
+
+static int
+compare_sort_offsets (const void *arg_a, const void *arg_b)
+{
+  SORT a = *(SORT *)arg_a;
+  SORT b = *(SORT *)arg_b;
+
+  return a->offset < b->offset? -1 : a->offset > b->offset;
+}
+
+
+/* Try to use an index to process the database FILENAME.  This is
+   possible if the selection is a plain conjunction with a test for
+   equality on a field which has an index file.  On success the
+   matching records are stored in SORTLIST in file order, the
+   database is loaded and true is returned; the selection is then
+   applied as usual while parsing these records.  A stale index is
+   rebuilt.  An index is not used if the database has been modified
+   within the last second.  */
+static int
+use_index (const char *filename)
+{
+  SELECTINSN *insn;
+  char *idxname = NULL;
+  struct stat st;
+  const char *buffer, *p, *line, *last, *offp;
+  char *endp;
+  char fname[FIELDNAMELEN + 1];
+  FIELD f;
+  size_t length, lo, hi, mid, n, size;
+  SORT s, *array = NULL;
+  long offset;
+  unsigned long reclen;
+  FILE *fp;
+
+  n = size = 0;
+  for (insn = opt.selectprog; insn->op != SELECT_END; insn++)
+    if (insn->op == SELECT_NOT || insn->op == SELECT_JTRUE)
+      return 0;  /* Not a plain conjunction.  */
+  for (insn = opt.selectprog; insn->op != SELECT_END; insn++)
+    if (insn->op == SELECT_SAME)
+      {
+        idxname = index_file_name (filename, insn->field->name);
+        if (!access (idxname, F_OK))
+          break;
+        free (idxname);
+        idxname = NULL;
+      }
+  if (!idxname || stat (filename, &st) || !S_ISREG (st.st_mode))
+    {
+      free (idxname);
+      return 0;
+    }
+  if (st.st_mtime >= time (NULL) - 1)
+    {
+      if (opt.verbose)
+        log_error (0, "%s: recently modified - index not used", filename);
+      free (idxname);
+      return 0;
+    }
+
+  if (map_index (idxname, &st, &buffer, &length, &lo, &hi))
+    {
+      if (opt.verbose)
+        log_error (0, "%s: rebuilding stale index", idxname);
+      if (build_index (filename, insn->field->name)
+          || map_index (idxname, &st, &buffer, &length, &lo, &hi))
+        {
+          free (idxname);
+          return 0;
+        }
+    }
+
+  /* Get the fields of the database so that they can be linked as a
+     scan of the entire file would do.  The output of formats 0 and 4
+     depends on that.  */
+  offp = (const char *)memchr (buffer + lo, '\n', hi - lo) + 1;
+  for (line = buffer + lo; *line != '\n'; line = p + (*p == ':'))
+    {
+      for (p = line; *p != ':' && *p != '\n'; p++)
+        ;
+      if (p == line || p - line > FIELDNAMELEN || !isdigit (*offp))
+        goto corrupt;
+      offset = strtol (offp, &endp, 10);
+      if (*endp != ' ' && *endp != '\n')
+        goto corrupt;
+      offp = endp + (*endp == ' ');
+      memcpy (fname, line, p - line);
+      fname[p - line] = 0;
+      f = intern_field_name (fname);
+      if (idxfields.n == idxfields.size)
+        {
+          idxfields.size += 64;
+          idxfields.item = realloc (idxfields.item, idxfields.size
+                                    * sizeof *idxfields.item);
+          if (!idxfields.item)
+            {
+              fprintf (stderr, PGMNAME ": out of memory\n");
+              exit (2);
+            }
+        }
+      idxfields.item[idxfields.n].field = f;
+      idxfields.item[idxfields.n].offset = offset;
+      strcpy (idxfields.item[idxfields.n].name, fname);
+      idxfields.n++;
+    }
+  if (*offp != '\n')
+    goto corrupt;
+  lo = hi;
+
+  /* Binary search for the first line with a value not less than the
+     one we are looking for.  LO and HI are always at line starts.  */
+  hi = length;
+  while (lo < hi)
+    {
+      mid = lo + (hi - lo) / 2;
+      for (line = buffer + mid; line > buffer + lo && line[-1] != '\n'; line--)
+        ;
+      if (compare_index_value (line, insn->value, insn->valuelen) < 0)
+        lo = (const char *)memchr (line, '\n', buffer + length - line)
+             + 1 - buffer;
+      else
+        hi = line - buffer;
+    }
+
+  for (line = buffer + lo; line < buffer + length; line = last + 1)
+    {
+      last = memchr (line, '\n', buffer + length - line);
+      if (compare_index_value (line, insn->value, insn->valuelen))
+        break;
+      p = memchr (line, '\t', last - line);
+      if (!p)
+        goto corrupt;
+      offset = strtol (p + 1, &endp, 10);
+      if (*endp != '\t')
+        goto corrupt;
+      reclen = strtoul (endp + 1, &endp, 10);
+      if (endp != last || offset < 0 || offset > st.st_size
+          || reclen > st.st_size - offset)
+        goto corrupt;
+      if (n == size)
+        {
+          size += 256;
+          array = realloc (array, size * sizeof *array);
+          if (!array)
+            {
+              fprintf (stderr, PGMNAME ": out of memory\n");
+              exit (2);
+            }
+        }
+      s = xmalloc (sizeof *s);
+      s->offset = offset;
+      s->length = reclen;
+      s->keylen = 0;
+      array[n++] = s;
+    }
+  munmap ((void *)buffer, length);
+  if (opt.verbose)
+    log_error (0, "%s: %lu matching record%s", idxname,
+               (unsigned long)n, n == 1 ? "" : "s");
+  free (idxname);
+
+  /* Output the records in the order of the database.  */
+  qsort (array, n, sizeof *array, compare_sort_offsets);
+  sortlist = NULL;
+  while (n)
+    {
+      s = array[--n];
+      s->next = sortlist;
+      sortlist = s;
+    }
+  free (array);
+
+  fp = fopen (filename, "r");
+  if (!fp)
+    {
+      fprintf (stderr, PGMNAME ": failed to open `%s': %s\n",
+               filename, strerror (errno));
+      exit (1);
+    }
+  load_image (fp, filename);
+  fclose (fp);
+  opt.sortmode = 2;
+  return 1;
+
+ corrupt:
+  log_error (0, "%s: warning: index is corrupt - not used", idxname);
+  idxfields.n = 0;
+  munmap ((void *)buffer, length);
+  while (n)
+    free (array[--n]);
+  free (array);
+  free (idxname);
+  return 0;
+}
+#endif /*USE_MMAP*/
+
+
+static void
+read_and_print_csv (const char *filename)
+{
+  FILE *fp;
+  int c;
+  unsigned long lineno;
+  int newline, newfield, in_string, any_printed;
+  int fieldidx = 0;
+  OUTFIELD of;
+  READER rd;
+  const unsigned char *p, *q;
+
+  if (filename)
+    {
+      fp = fopen (filename, "r");
+      if (!fp)
+	{
+	  fprintf (stderr, PGMNAME ": failed to open `%s': %s\n",
+		   filename, strerror (errno));
+	  exit (1);
+	}
+    }
+  else
+    {
+      fp = stdin;
+      filename = "[stdin]";
+    }
+
+  /* Read the file byte by byte; do not impose a limit on the line
+   * length.  Fieldnames are up to FIELDNAMELEN bytes long.  */
+  lineno  = 1;
+  newline = 1;
+  newfield = 0;
+  in_string = 0;
+  any_printed = 0;
+  of = NULL;
+  reader_open (&rd, fp);
+  while ((c = reader_getc (&rd)) != EOF)
+    {
+      if (c == '\r')
+        continue;
+
+      if (c == '\n')  /* End of line.  */
+	{
+          putchar ('\n');
+          putchar ('\n');
+	  lineno++;
+	  newline = 1;
+          newfield = 0;
+          in_string = 0;
+          fieldidx = 0;
+	  continue;
+	}
+
+      if (newline) /* At a new record.  */
+        {
+	  newline = 0;
+          newfield = 1;
+          of = opt.outfields? opt.outfields : NULL;
+	}
+
+      if (newfield)
+        {
+          if (of)
+            printf ("%s:", of->name);
+          else
+            printf ("Field_%d:", fieldidx);
+          newfield = 0;
+          any_printed = 0;
+          in_string = 0;
+        }
+
+      if (in_string == 1)
+        {
+          if (c == '\"')
+            in_string = 2; /* Possible end of string.  */
+          else
+            {
+              if (!any_printed)
+                {
                   any_printed = 1;
                   putchar (' ');
                 }
               putchar (c);
+              /* Copy the rest of the string at once.  */
+              p = rd.buf + rd.pos;
+              for (q = p; q < rd.buf + rd.end; q++)
+                if (*q == '\"' || *q == '\r' || *q == '\n')
+                  break;
+              fwrite (p, 1, q - p, stdout);
+              rd.pos += q - p;
             }
         }
       else if (in_string == 2)
@@ -1733,8 +2748,16 @@ read_and_print_csv (const char *filename)
               putchar (' ');
             }
           putchar (c);
+          /* Copy the rest of the field at once.  */
+          p = rd.buf + rd.pos;
+          for (q = p; q < rd.buf + rd.end; q++)
+            if (*q == ',' || *q == '\"' || *q == '\r' || *q == '\n')
+              break;
+          fwrite (p, 1, q - p, stdout);
+          rd.pos += q - p;
         }
     }
+  reader_close (&rd);
 
   if (ferror (fp))
     {
@@ -1771,39 +2794,113 @@ read_and_print_csv (const char *filename)
 static FIELD
 store_field_name (const char *fname, long offset)
 {
-  unsigned long hash;
-  NAMEBUCKET buck;
-  FIELD fdes, f2;
-
-  for (buck = namebuckets[hash = hash_name (fname)]; buck; buck = buck->next)
-    if (!strcasecmp (buck->ptr->name, fname))
-      {
-	fdes = buck->ptr;
-	break;
-      }
+  FIELD fdes;
 
-  if (buck && fdes == fieldlist)
+  fdes = intern_field_name (fname);
+  if (fdes == fieldlist)
     new_record (offset);
-  else if (!buck)
-    { /* A new fieldname.  */
-      fdes = xcalloc (1, sizeof *fdes + strlen (fname));
-      strcpy (fdes->name, fname);
-      /* Create a hash entry to speed up field access.  */
-      buck = xcalloc (1, sizeof *buck);
-      buck->ptr = fdes;
-      buck->next = namebuckets[hash];
-      namebuckets[hash] = buck;
-      /* Link the field into the record description.  */
-      if (!fieldlist)
-	fieldlist = fdes;
-      else
-	{
-	  for (f2 = fieldlist; f2->nextfield; f2 = f2->nextfield)
-	    ;
-	  f2->nextfield = fdes;
-	}
+  else if (!fdes->linked)
+    {
+      link_field (fdes, fname); /* A new fieldname.  */
+      fdes->firstoff = start_of_record;
+    }
+  if (!fdes->valid)
+    {
+      fdes->valid = 1; /* This is in the current record.  */
+      valid_ids[nvalid_ids++] = fdes->id;
+    }
+  return fdes;
+}
+
+
+/* Link the field FDES into the record description using the
+   spelling FNAME from the data.  */
+static void
+link_field (FIELD fdes, const char *fname)
+{
+  strcpy (fdes->name, fname);
+  if (!fieldlist)
+    fieldlist = fdes;
+  else
+    fieldlist_tail->nextfield = fdes;
+  fieldlist_tail = fdes;
+  fdes->linked = 1;
+}
+
+
+/* Link the fields from the index which a scan sees up to the record
+   at OFFSET.  */
+static void
+link_index_fields (long offset)
+{
+  for (; idxfields.next < idxfields.n
+         && idxfields.item[idxfields.next].offset <= offset; idxfields.next++)
+    if (!idxfields.item[idxfields.next].field->linked)
+      link_field (idxfields.item[idxfields.next].field,
+                  idxfields.item[idxfields.next].name);
+}
+
+
+/* Return the field with name FNAME or NULL if it has not yet been
+   interned.  */
+static FIELD
+lookup_field_name (const char *fname)
+{
+  unsigned int i;
+
+  if (!namehash_size)
+    return NULL;
+  for (i = hash_name (fname) & (namehash_size - 1); namehash[i];
+       i = (i + 1) & (namehash_size - 1))
+    if (!strcasecmp (fieldtab[namehash[i]-1]->name, fname))
+      return fieldtab[namehash[i]-1];
+  return NULL;
+}
+
+
+/* Return the field with name FNAME and create it if needed.  A new
+   field is not linked into FIELDLIST; this is done by
+   store_field_name when the field is seen in the data.  */
+static FIELD
+intern_field_name (const char *fname)
+{
+  FIELD fdes;
+  unsigned int i;
+  int id;
+
+  if ((fdes = lookup_field_name (fname)))
+    return fdes;
+
+  if (nfields * 2 >= (int)namehash_size)
+    {
+      /* Grow the tables and rehash.  */
+      namehash_size = namehash_size? 2 * namehash_size : 64;
+      free (namehash);
+      namehash = xcalloc (namehash_size, sizeof *namehash);
+      for (id = 0; id < nfields; id++)
+        {
+          for (i = hash_name (fieldtab[id]->name) & (namehash_size - 1);
+               namehash[i]; i = (i + 1) & (namehash_size - 1))
+            ;
+          namehash[i] = id + 1;
+        }
+      fieldtab = realloc (fieldtab, namehash_size / 2 * sizeof *fieldtab);
+      valid_ids = realloc (valid_ids, namehash_size / 2 * sizeof *valid_ids);
+      if (!fieldtab || !valid_ids)
+        {
+          fprintf (stderr, PGMNAME ": out of memory\n");
+          exit (2);
+        }
     }
-  fdes->valid = 1; /* This is in the current record.  */
+
+  fdes = xcalloc (1, sizeof *fdes + strlen (fname));
+  strcpy (fdes->name, fname);
+  fdes->id = nfields;
+  fieldtab[nfields++] = fdes;
+  for (i = hash_name (fname) & (namehash_size - 1); namehash[i];
+       i = (i + 1) & (namehash_size - 1))
+    ;
+  namehash[i] = fdes->id + 1;
   return fdes;
 }
 
@@ -1822,8 +2919,11 @@ expand_data_slot (FIELD field, DATA data)
       break;
   if (!d)
     {
-      d = xmalloc (sizeof *d + data->size + 200);
-      d->size = data->size + 200 + 1;
+      /* Grow by at least 200 bytes but double long values.  */
+      size_t n = data->size > 200? data->size : 200;
+
+      d = xmalloc (sizeof *d + data->size + n);
+      d->size = data->size + n + 1;
     }
   memcpy (d->d, data->d, data->used);
   d->used = data->used;
@@ -1854,9 +2954,9 @@ expand_data_slot (FIELD field, DATA data)
 static void
 new_record (long offset)
 {
+  end_of_record = offset;
   finish_record ();
   start_of_record = offset;
-  new_record_flag = 1;
   tex.rewind_data = 0;
 }
 
@@ -1870,12 +2970,12 @@ get_first_field ()
   if (opt.outfields)
     {
       of = opt.outfields;
-      for (f = fieldlist; f; f = f->nextfield)
-	if (!strcmp (f->name, of->name))
-	  {
-	    next_outfield = of;
-	    return f;
-	  }
+      f = of->field;
+      if (f->linked)
+        {
+          next_outfield = of;
+          return f;
+        }
       next_outfield = NULL;
       return NULL;
     }
@@ -1888,139 +2988,195 @@ get_next_field ()
   FIELD f;
   OUTFIELD of;
 
-  if (opt.outfields)
+  if (opt.outfields)
+    {
+      if (next_outfield && (of = next_outfield->next))
+	{
+          f = of->field;
+          if (f->linked)
+            {
+              next_outfield = of;
+              return f;
+            }
+	}
+      next_outfield = NULL;
+      return NULL;
+    }
+  return next_field ? (next_field = next_field->nextfield) : NULL;
+}
+
+
+/* Return the numeric value of (S,N) like strtol would do.  */
+static long
+parse_long (const char *s, size_t n)
+{
+  unsigned long value = 0;
+  int neg = 0;
+
+  for (; n && isspace (*(const unsigned char*)s); s++, n--)
+    ;
+  if (n && (*s == '-' || *s == '+'))
+    {
+      neg = (*s == '-');
+      s++;
+      n--;
+    }
+  for (; n && *s >= '0' && *s <= '9'; s++, n--)
+    {
+      if (value > ((unsigned long)LONG_MAX + 1 - (*s - '0')) / 10)
+        return neg? LONG_MIN : LONG_MAX;  /* Overflow.  */
+      value = value * 10 + (*s - '0');
+    }
+  if (neg)
+    return value > LONG_MAX? LONG_MIN : -(long)value;
+  return value > LONG_MAX? LONG_MAX : (long)value;
+}
+
+
+/* Evaluate the test INSN for the current record.  Note that the
+   selection currently considers only the first active line of a
+   given field.  */
+static int
+select_test (const SELECTINSN *insn)
+{
+  FIELD f = insn->field;
+  DATA d;
+  const char *value;
+  size_t valuelen;
+
+  if (!f->valid)
+    {
+      /* No such field.  */
+      switch (insn->op)
+        {
+        case SELECT_NOTSAME:
+        case SELECT_NOTSUB:
+        case SELECT_NE:
+        case SELECT_EMPTY:
+          return 1;
+        default:
+          return 0;
+        }
+    }
+
+  for (d = f->data; d; d = d->next)
+    if (d->activ)
+      break;
+  if (!d)
+    {
+      value = "";
+      valuelen = 0;
+    }
+  else
+    {
+      value = d->d;
+      valuelen = d->used;
+    }
+
+  switch (insn->op)
     {
-      if (next_outfield && (of = next_outfield->next))
-	{
-	  for (f = fieldlist; f; f = f->nextfield)
-	    if (!strcmp (f->name, of->name))
-	      {
-		next_outfield = of;
-		return f;
-	      }
-	}
-      next_outfield = NULL;
-      return NULL;
+    case SELECT_SAME:
+      return (valuelen == insn->valuelen
+              && !memcmp (value, insn->value, valuelen));
+    case SELECT_NOTSAME:
+      return !(valuelen == insn->valuelen
+               && !memcmp (value, insn->value, valuelen));
+    case SELECT_SUB:
+      return !!memstr (value, valuelen, insn->value, insn->valuelen);
+    case SELECT_NOTSUB:
+      return !memstr (value, valuelen, insn->value, insn->valuelen);
+    case SELECT_EMPTY:
+      return !valuelen;
+    case SELECT_NOTEMPTY:
+      return !!valuelen;
+    case SELECT_EQ:
+      return parse_long (value, valuelen) == insn->numvalue;
+    case SELECT_NE:
+      return parse_long (value, valuelen) != insn->numvalue;
+    case SELECT_GT:
+      return parse_long (value, valuelen) > insn->numvalue;
+    case SELECT_GE:
+      return parse_long (value, valuelen) >= insn->numvalue;
+    case SELECT_LT:
+      return parse_long (value, valuelen) < insn->numvalue;
+    case SELECT_LE:
+      return parse_long (value, valuelen) <= insn->numvalue;
+    default:
+      abort ();
     }
-  return next_field ? (next_field = next_field->nextfield) : NULL;
 }
 
 
-/* Return true if the record has been selected.  Note that the
-   selection currently considers only the first active line of a given
-   field.  */
+/* Return true if the record has been selected by the compiled
+   selection.  */
 static int
 select_record_p (void)
 {
-  FIELD f;
-  SELECTEXPR se;
-  DATA d;
-  const char *value;
-  size_t selen, valuelen, n;
-  long numvalue;
+  const SELECTINSN *prog = opt.selectprog;
+  int pc = 0;
   int result = 1;
 
-  for (se=opt.selectexpr; se; se = se->next)
+  for (;;)
     {
-      for (f = fieldlist; f; f = f->nextfield)
-        if (!strcmp (f->name, se->name))
-          break;
-      if (!f || !f->valid)
+      switch (prog[pc].op)
         {
-          /* No such field.  */
-          switch (se->op)
-            {
-            case SELECT_NOTSAME:
-            case SELECT_NOTSUB:
-            case SELECT_NE:
-            case SELECT_EMPTY:
-              result = 1;
-              break;
-            default:
-              result = 0;
-              break;
-            }
-        }
-      else
-        {
-          for (d = f->data; d; d = d->next)
-            if (d->activ)
-              break;
-          if (!d)
-            {
-              value = "";
-              valuelen = 0;
-              numvalue = 0;
-            }
-          else
-            {
-              char tmpbuf[25];
-              value = d->d;
-              valuelen = d->used;
-              n = valuelen;
-              if (n > sizeof tmpbuf - 1)
-                n = sizeof tmpbuf -1;
-              memcpy (tmpbuf, value, n);
-              tmpbuf[n] = 0;
-              numvalue = strtol (tmpbuf, NULL, 10);
-            }
-          selen = strlen (se->value);
-
-          switch (se->op)
-            {
-            case SELECT_SAME:
-              result = (valuelen == selen && !memcmp (value, se->value, selen));
-              break;
-            case SELECT_NOTSAME:
-              result = !(valuelen == selen && !memcmp (value, se->value,selen));
-              break;
-            case SELECT_SUB:
-              result = !!memstr (value, valuelen, se->value);
-              break;
-            case SELECT_NOTSUB:
-              result = !memstr (value, valuelen, se->value);
-              break;
-            case SELECT_EMPTY:
-              result = !valuelen;
-              break;
-            case SELECT_NOTEMPTY:
-              result = !!valuelen;
-              break;
-            case SELECT_EQ:
-              result = (numvalue == se->numvalue);
-              break;
-            case SELECT_NE:
-              result = (numvalue != se->numvalue);
-              break;
-            case SELECT_GT:
-              result = (numvalue > se->numvalue);
-              break;
-            case SELECT_GE:
-              result = (numvalue >= se->numvalue);
-              break;
-            case SELECT_LT:
-              result = (numvalue < se->numvalue);
-              break;
-            case SELECT_LE:
-              result = (numvalue <= se->numvalue);
-              break;
-            }
+        case SELECT_END:
+          return result;
+        case SELECT_NOT:
+          result = !result;
+          pc++;
+          break;
+        case SELECT_JTRUE:
+          pc = result? prog[pc].target : pc + 1;
+          break;
+        case SELECT_JFALSE:
+          pc = result? pc + 1 : prog[pc].target;
+          break;
+        default:
+          result = select_test (prog + pc);
+          pc++;
+          break;
         }
-      if (!result)
-        break;
     }
-
-  return result;
 }
 
 
-/* Return the field to be used for sorting.  Note that we currently
-   support only one sort field. */
+/* Return the field to be used for the sort field SF or NULL if it
+   is not in the current record.  */
 static FIELD
-find_sortfield (void)
+find_sortfield (OUTFIELD sf)
+{
+  if (sf->field->valid)
+    return sf->field;
+
+  return NULL; /* No such field.  */
+}
+
+
+/* Build the sort key for the current record.  The key is the
+   concatenation of one part per sort field so that two keys can be
+   compared with memcmp:
+
+   - A string is stored up to the first Nul followed by a Nul.
+   - A number (flag /n) is stored as a big endian 8 byte value which
+     compares like the double value.
+   - For /r all bytes of the part are inverted.
+
+   The parts are self-delimiting and thus no key is a prefix of
+   another one.  Returns a pointer to a static buffer and stores its
+   length at R_KEYLEN.  */
+static const unsigned char *
+make_sort_key (size_t *r_keylen)
 {
+  static unsigned char *buffer;
+  static size_t size;
+  size_t keylen, n, i, needed;
   OUTFIELD sf;
   FIELD f;
+  DATA d;
+  const char *s;
+  unsigned char *p;
+  int flags;
 
   /* If no sortfield has been given use the first one.  */
   if (!opt.sortfields)
@@ -2031,23 +3187,81 @@ find_sortfield (void)
             sf = xmalloc (sizeof *sf + strlen (f->name));
             sf->next = NULL;
             sf->flags = 0;
+            sf->field = f;
             strcpy (sf->name, f->name);
             opt.sortfields = sf;
             break;
           }
     }
 
-  sf = opt.sortfields;
-  if (!sf)
-    return NULL;
+  keylen = 0;
+  for (sf = opt.sortfields; sf; sf = sf->next)
+    {
+      n = 0;
+      s = ""; /* Default to the empty string.  */
+      f = find_sortfield (sf);
+      for (d = f?f->data:NULL; d; d = d->next)
+        {
+          if (d->activ)
+            {
+              n = d->used;
+              s = d->d;
+              break;
+            }
+        }
+      /* Uniq compares the plain strings.  */
+      flags = opt.uniqmode? (sf->flags & ~SORTFLAG_NUMERIC) : sf->flags;
 
-  for (f = fieldlist; f; f = f->nextfield)
-    if (!strcmp (f->name, sf->name))
-      break;
-  if (f && f->valid)
-    return f;
+      needed = keylen + (n > 8? n : 8) + 1;
+      if (needed > size)
+        {
+          size = needed + 256;
+          buffer = realloc (buffer, size);
+          if (!buffer)
+            {
+              fprintf (stderr, PGMNAME ": out of memory\n");
+              exit (2);
+            }
+        }
+      p = buffer + keylen;
 
-  return NULL; /* No such field.  */
+      if ((flags & SORTFLAG_NUMERIC))
+        {
+          char tmpbuf[64];
+          double value;
+          unsigned long long bits;
+
+          if (n > sizeof tmpbuf - 1)
+            n = sizeof tmpbuf - 1;
+          memcpy (tmpbuf, s, n);
+          tmpbuf[n] = 0;
+          value = strtod (tmpbuf, NULL);
+          if (value == 0)
+            value = 0;  /* Map -0 to 0.  */
+          memcpy (&bits, &value, sizeof bits);
+          if ((bits & 0x8000000000000000ULL))
+            bits = ~bits;
+          else
+            bits |= 0x8000000000000000ULL;
+          for (i = 0; i < 8; i++)
+            p[i] = bits >> (56 - 8 * i);
+          n = 8;
+        }
+      else
+        {
+          for (i = 0; i < n && s[i]; i++)
+            p[i] = s[i];
+          p[i] = 0;
+          n = i + 1;
+        }
+      if ((flags & SORTFLAG_REVERSE))
+        for (i = 0; i < n; i++)
+          p[i] = ~p[i];
+      keylen += n;
+    }
+
+  *r_keylen = keylen;
+  return buffer? buffer : (const unsigned char*)"";
 }
 
 
@@ -2070,29 +3284,22 @@ finish_record ()
       if (opt.sortmode == 1)
 	{ /* Store only.  */
 	  SORT sort;
-          const char *s;
-
-          n = 0;
-          s = ""; /* Default to the empty string.  */
-          f = find_sortfield ();
-          for (d = f?f->data:NULL; d; d = d->next)
-            {
-              if (d->activ)
-                {
-                  n = d->used;
-                  s = d->d;
-                  break;
-                }
-            }
+          const unsigned char *key;
 
-	  sort = xcalloc (1, sizeof *sort + n + 1);
+          key = make_sort_key (&n);
+	  sort = xmalloc (sizeof *sort + n);
 	  sort->offset = start_of_record;
-	  memcpy (sort->d, s, n);
-	  sort->d[n] = 0; /* Make sure it is a string.  */
+	  sort->length = end_of_record - start_of_record;
+	  sort->keylen = n;
+	  memcpy (sort->d, key, n);
 	  sort->next = sortlist;
 	  sortlist = sort;
+	  sortlist_size += sizeof *sort + n;
+	  if (opt.sortbuffer && !opt.uniqmode
+	      && sortlist_size >= opt.sortbuffer)
+	    flush_run ();
 	}
-      else if (opt.selectexpr && !select_record_p ())
+      else if (opt.selectprog && !select_record_p ())
         ;
       else if (opt.template)
 	{
@@ -2232,8 +3439,9 @@ finish_record ()
 	}
     }
   output_count++;
-  for (f = fieldlist; f; f = f->nextfield)
+  for (; nvalid_ids; nvalid_ids--)
     {
+      f = fieldtab[valid_ids[nvalid_ids-1]];
       f->valid = 0;
       /* Set the data blocks inactive.  */
       for (d = f->data; d; d = d->next)
@@ -2249,8 +3457,7 @@ print_format2 (int flushit)
   static int pending = 0;
   static int totlines = 0;
   static char *names[] = { "Name", "Street", "City", NULL };
-  NAMEBUCKET buck;
-  FIELD f = NULL;
+  FIELD f;
   DATA d;
   int n, len, lines = 0;
   const char *name;
@@ -2273,12 +3480,7 @@ print_format2 (int flushit)
 
   for (n = 0; !flushit && (name = names[n]); n++)
     {
-      for (buck = namebuckets[hash_name (name)]; buck; buck = buck->next)
-	if (!strcasecmp (buck->ptr->name, name))
-	  {
-	    f = buck->ptr;
-	    break;
-	  }
+      f = lookup_field_name (name);
       if (!f)
 	continue;
 
@@ -2403,7 +3605,6 @@ print_template (int flushit)
 static int
 process_template_op (const char *op)
 {
-  NAMEBUCKET buck;
   FIELD f;
   DATA d;
 
@@ -2460,13 +3661,7 @@ process_template_op (const char *op)
       if (p)
 	*p++ = 0; /* Strip modifier. */
 
-      f = NULL;
-      for (buck = namebuckets[hash_name (op)]; buck; buck = buck->next)
-	if (!strcasecmp (buck->ptr->name, op))
-	  {
-	    f = buck->ptr;
-	    break;
-	  }
+      f = lookup_field_name (op);
       if (f) /* We have an entry with this name.  */
 	{
 	  for (d = f->data; d; d = d->next)
@@ -2495,46 +3690,138 @@ process_template_op (const char *op)
 
 
 
-static int
-do_sort_fnc_num (const void *arg_a, const void *arg_b)
+/* Compare the keys of two SORT items.  */
+static INLINE int
+compare_sort_items (SORT a, SORT b)
 {
-  double aval, bval;
-  SORT a = *(SORT *) arg_a;
-  SORT b = *(SORT *) arg_b;
+  int c;
 
-  aval = strtod (a->d, NULL);
-  bval = strtod (b->d, NULL);
-  return aval < bval? -1 : aval > bval? 1 : 0;
+  c = memcmp (a->d, b->d, a->keylen < b->keylen? a->keylen : b->keylen);
+  if (c)
+    return c;
+  return a->keylen < b->keylen? -1 : a->keylen > b->keylen? 1 : 0;
 }
 
 static int
-do_sort_fnc_numrev (const void *arg_a, const void *arg_b)
+do_sort_fnc (const void *arg_a, const void *arg_b)
 {
-  double aval, bval;
-  SORT a = *(SORT *) arg_a;
-  SORT b = *(SORT *) arg_b;
-
-  aval = strtod (a->d, NULL);
-  bval = strtod (b->d, NULL);
-  return aval < bval? 1 : aval > bval? -1 : 0;
+  return compare_sort_items (*(SORT *) arg_a, *(SORT *) arg_b);
 }
 
-static int
-do_sort_fnc (const void *arg_a, const void *arg_b)
+
+#ifdef USE_THREADS
+/* A part of the array to be sorted or two adjacent parts to be
+   merged by a thread.  */
+struct sort_part_s
 {
-  SORT a = *(SORT *) arg_a;
-  SORT b = *(SORT *) arg_b;
-  return strcmp (a->d, b->d);
+  pthread_t thread;
+  SORT *array;
+  SORT *tmp;
+  size_t n;    /* Length of the first part.  */
+  size_t n2;   /* Length of the second part; 0 for qsort.  */
+};
+
+static void *
+sort_part_thread (void *arg)
+{
+  struct sort_part_s *part = arg;
+  size_t i, j, k;
+
+  if (!part->n2)
+    {
+      qsort (part->array, part->n, sizeof *part->array, do_sort_fnc);
+      return NULL;
+    }
+
+  /* Merge the two parts into TMP and copy back.  */
+  i = 0;
+  j = part->n;
+  k = 0;
+  while (i < part->n && j < part->n + part->n2)
+    {
+      if (compare_sort_items (part->array[j], part->array[i]) < 0)
+        part->tmp[k++] = part->array[j++];
+      else
+        part->tmp[k++] = part->array[i++];
+    }
+  while (i < part->n)
+    part->tmp[k++] = part->array[i++];
+  while (j < part->n + part->n2)
+    part->tmp[k++] = part->array[j++];
+  memcpy (part->array, part->tmp, k * sizeof *part->tmp);
+  return NULL;
 }
+#endif /*USE_THREADS*/
 
-static int
-do_sort_fnc_rev (const void *arg_a, const void *arg_b)
+
+/* Sort the N items of ARRAY.  Large arrays are split into one part
+   per CPU which are sorted and then merged by threads.  */
+static void
+sort_array (SORT *array, size_t n)
 {
-  SORT a = *(SORT *) arg_a;
-  SORT b = *(SORT *) arg_b;
-  return strcmp (b->d, a->d);
+#ifdef USE_THREADS
+  struct sort_part_s parts[16];
+  size_t bounds[16+1];
+  SORT *tmp;
+  long ncpus;
+  int nparts, width, i, nthreads;
+
+  ncpus = sysconf (_SC_NPROCESSORS_ONLN);
+  nparts = ncpus < 1? 1 : ncpus > 16? 16 : ncpus;
+  if (n < 65536 || nparts < 2)
+    {
+      qsort (array, n, sizeof *array, do_sort_fnc);
+      return;
+    }
+
+  for (i = 0; i < nparts; i++)
+    bounds[i] = n / nparts * i;
+  bounds[nparts] = n;
+  tmp = xmalloc (n * sizeof *tmp);
+
+  for (i = 0; i < nparts; i++)
+    {
+      parts[i].array = array + bounds[i];
+      parts[i].n = bounds[i+1] - bounds[i];
+      parts[i].n2 = 0;
+      if (pthread_create (&parts[i].thread, NULL, sort_part_thread, parts+i))
+        {
+          fprintf (stderr, PGMNAME ": error creating thread\n");
+          exit (2);
+        }
+    }
+  for (i = 0; i < nparts; i++)
+    pthread_join (parts[i].thread, NULL);
+
+  /* Merge pairs of adjacent parts until only one is left.  */
+  for (width = 1; width < nparts; width *= 2)
+    {
+      nthreads = 0;
+      for (i = 0; i + width < nparts; i += 2 * width)
+        {
+          struct sort_part_s *part = parts + nthreads++;
+
+          part->array = array + bounds[i];
+          part->tmp = tmp + bounds[i];
+          part->n = bounds[i+width] - bounds[i];
+          part->n2 = (bounds[i + 2*width < nparts? i + 2*width : nparts]
+                      - bounds[i+width]);
+          if (pthread_create (&part->thread, NULL, sort_part_thread, part))
+            {
+              fprintf (stderr, PGMNAME ": error creating thread\n");
+              exit (2);
+            }
+        }
+      for (i = 0; i < nthreads; i++)
+        pthread_join (parts[i].thread, NULL);
+    }
+  free (tmp);
+#else /*!USE_THREADS*/
+  qsort (array, n, sizeof *array, do_sort_fnc);
+#endif /*!USE_THREADS*/
 }
 
+
 /*
  * Sort the sortlist
  */
@@ -2543,8 +3830,14 @@ do_sort ()
 {
   size_t i, n;
   SORT s, *array;
-  int reverse = opt.sortfields? (opt.sortfields->flags & SORTFLAG_REVERSE) : 0;
-  int numeric = opt.sortfields? (opt.sortfields->flags & SORTFLAG_NUMERIC) : 0;
+
+  if (runs.n)
+    {
+      /* External sort: write the last run; the runs are merged while
+         doing the output.  */
+      flush_run ();
+      return;
+    }
 
   for (n = 0, s = sortlist; s; s = s->next)
     n++;
@@ -2554,26 +3847,267 @@ do_sort ()
   for (n = 0, s = sortlist; s; s = s->next)
     array[n++] = s;
   array[n] = NULL;
-  qsort (array, n, sizeof *array,
-         (numeric && reverse)? do_sort_fnc_numrev :
-         (numeric           )? do_sort_fnc_num :
-         (reverse           )? do_sort_fnc_rev :
-         /* */                 do_sort_fnc);
+  sort_array (array, n);
   sortlist = array[0];
   for (i = 0; i < n; i++)
     array[i]->next = array[i + 1];
+  free (array);
+}
+
+
+/* Write a SORT item to the run file FP.  */
+static void
+write_sort_item (FILE *fp, SORT s)
+{
+  size_t n = s->keylen;
+
+  if (fwrite (&s->offset, sizeof s->offset, 1, fp) != 1
+      || fwrite (&s->length, sizeof s->length, 1, fp) != 1
+      || fwrite (&n, sizeof n, 1, fp) != 1
+      || fwrite (s->d, n, 1, fp) != (n? 1:0))
+    {
+      fprintf (stderr, PGMNAME ": error writing temporary file: %s\n",
+               strerror (errno));
+      exit (2);
+    }
+}
+
+
+/* Read the next SORT item of run I into RUNS.ITEM[I].  Returns false
+   at the end of the run.  */
+static int
+read_sort_item (int i)
+{
+  FILE *fp = runs.fp[i];
+  SORT s = runs.item[i];
+  long offset;
+  size_t length, n;
+
+  if (fread (&offset, sizeof offset, 1, fp) != 1)
+    {
+      if (ferror (fp))
+        {
+          fprintf (stderr, PGMNAME ": error reading temporary file: %s\n",
+                   strerror (errno));
+          exit (2);
+        }
+      return 0;
+    }
+  if (fread (&length, sizeof length, 1, fp) != 1
+      || fread (&n, sizeof n, 1, fp) != 1)
+    {
+      fprintf (stderr, PGMNAME ": error reading temporary file\n");
+      exit (2);
+    }
+  if (!s || runs.itemsize[i] < n)
+    {
+      free (s);
+      s = xmalloc (sizeof *s + n + 64);
+      s->next = NULL;
+      runs.item[i] = s;
+      runs.itemsize[i] = n + 64;
+    }
+  if (n && fread (s->d, n, 1, fp) != 1)
+    {
+      fprintf (stderr, PGMNAME ": error reading temporary file\n");
+      exit (2);
+    }
+  s->keylen = n;
+  s->offset = offset;
+  s->length = length;
+  return 1;
+}
+
+
+/* Restore the heap property of RUNS.HEAP starting at index I.  On a
+   tie the earlier run comes first.  */
+static void
+sift_down_run (int i)
+{
+  int child, tmp, c;
+
+  for (;;)
+    {
+      child = 2 * i + 1;
+      if (child >= runs.nheap)
+        break;
+      if (child + 1 < runs.nheap)
+        {
+          c = compare_sort_items (runs.item[runs.heap[child+1]],
+                                  runs.item[runs.heap[child]]);
+          if (c < 0 || (!c && runs.heap[child+1] < runs.heap[child]))
+            child++;
+        }
+      c = compare_sort_items (runs.item[runs.heap[child]],
+                              runs.item[runs.heap[i]]);
+      if (c > 0 || (!c && runs.heap[child] > runs.heap[i]))
+        break;
+      tmp = runs.heap[i];
+      runs.heap[i] = runs.heap[child];
+      runs.heap[child] = tmp;
+      i = child;
+    }
+}
+
+
+/* Start merging all runs.  */
+static void
+start_merge (void)
+{
+  int i;
+
+  runs.nheap = 0;
+  runs.returned = 0;
+  for (i = 0; i < runs.n; i++)
+    {
+      if (fseek (runs.fp[i], 0, SEEK_SET))
+        {
+          fprintf (stderr, PGMNAME ": error seeking temporary file: %s\n",
+                   strerror (errno));
+          exit (2);
+        }
+      if (read_sort_item (i))
+        runs.heap[runs.nheap++] = i;
+    }
+  for (i = runs.nheap / 2 - 1; i >= 0; i--)
+    sift_down_run (i);
+}
+
+
+/* Return the next item of the merged runs or NULL at the end.  The
+   item is valid until the next call.  */
+static SORT
+next_merged (void)
+{
+  if (runs.returned && runs.nheap)
+    {
+      /* Advance the run of the last returned item.  */
+      if (!read_sort_item (runs.heap[0]))
+        runs.heap[0] = runs.heap[--runs.nheap];
+      sift_down_run (0);
+    }
+  runs.returned = 0;
+  if (!runs.nheap)
+    return NULL;
+  runs.returned = 1;
+  return runs.item[runs.heap[0]];
+}
+
+
+/* Sort the sortlist and write it as a new run to a temporary file.
+   If there are too many runs they are first merged into one.  */
+static void
+flush_run (void)
+{
+  size_t i, n;
+  SORT s, *array;
+  FILE *fp;
+
+  if (runs.n == MAX_RUNS)
+    {
+      fp = tmpfile ();
+      if (!fp)
+        {
+          fprintf (stderr, PGMNAME ": can't create temporary file: %s\n",
+                   strerror (errno));
+          exit (2);
+        }
+      start_merge ();
+      while ((s = next_merged ()))
+        write_sort_item (fp, s);
+      for (i = 0; i < runs.n; i++)
+        {
+          fclose (runs.fp[i]);
+          free (runs.item[i]);
+          runs.item[i] = NULL;
+          runs.itemsize[i] = 0;
+        }
+      runs.fp[0] = fp;
+      runs.n = 1;
+    }
+
+  for (n = 0, s = sortlist; s; s = s->next)
+    n++;
+  if (!n)
+    return;
+  array = xmalloc (n * sizeof *array);
+  for (n = 0, s = sortlist; s; s = s->next)
+    array[n++] = s;
+  sort_array (array, n);
+
+  fp = tmpfile ();
+  if (!fp)
+    {
+      fprintf (stderr, PGMNAME ": can't create temporary file: %s\n",
+               strerror (errno));
+      exit (2);
+    }
+  for (i = 0; i < n; i++)
+    {
+      write_sort_item (fp, array[i]);
+      free (array[i]);
+    }
+  free (array);
+  if (opt.verbose)
+    log_error (0, "%s: sort run %d with %lu records written",
+               PGMNAME, runs.n + 1, (unsigned long)n);
+  runs.fp[runs.n++] = fp;
+  sortlist = NULL;
+  sortlist_size = 0;
+}
+
+
+/* Start the output of the sorted records.  */
+static void
+rewind_sorted (void)
+{
+  if (runs.n)
+    start_merge ();
+  else
+    sort_cursor = sortlist;
+}
+
+
+/* Return the next sorted record or NULL.  */
+static SORT
+next_sorted (void)
+{
+  SORT s;
+
+  if (runs.n)
+    return next_merged ();
+  s = sort_cursor;
+  if (s)
+    sort_cursor = s->next;
+  return s;
+}
+
+
+/* Return a hash value for the buffer (S,N).  This is FNV-1a.  */
+static INLINE unsigned long
+hash_buffer (const unsigned char *s, size_t n)
+{
+  unsigned long hashVal = 2166136261UL;
+
+  for (; n; s++, n--)
+    {
+      hashVal ^= *s;
+      hashVal *= 16777619UL;
+    }
+  return hashVal;
 }
 
 
 /*
  * Uniq the sortlist.  Remove all identical records except for the
- * last one (or the first if /r is used).
+ * last one (or the first if /r is used).  The records seen so far
+ * are kept in a hash table so that this works in linear time.
  */
 static void
 do_uniq ()
 {
-  size_t i, n;
-  SORT s, *array;
+  size_t i, n, tablesize;
+  SORT s, *array, *table;
   int reverse = opt.sortfields? (opt.sortfields->flags & SORTFLAG_REVERSE) : 0;
 
   /* Allocate an array large enough to hold all items.  */
@@ -2583,32 +4117,37 @@ do_uniq ()
     return;
   array = xmalloc ((n + 1) * sizeof *array);
 
-  /* Put all items into the array and mark the duplicates.  */
+  /* The hash table uses open addressing and is at most half full.  */
+  for (tablesize = 64; tablesize < 2 * n; tablesize <<= 1)
+    ;
+  table = xcalloc (tablesize, sizeof *table);
+
+  /* Put all items into the array and mark the duplicates.  Note that
+     the sortlist is in reverse order of the records.  */
   for (n = 0, s = sortlist; s; s = s->next)
     {
-      if (reverse)
+      for (i = hash_buffer (s->d, s->keylen) & (tablesize - 1);
+           table[i] && compare_sort_items (table[i], s);
+           i = (i + 1) & (tablesize - 1))
+        ;
+      if (!table[i])
+        table[i] = s;
+      else if (reverse)
         {
-          for (i=0; i < n; i++)
-            if (array[i]->offset != -1 && !strcmp (array[i]->d, s->d))
-              {
-                /* Same item found.  */
-                array[i]->offset = -1; /* Mark that as deleted.  */
-              }
+          /* Same item found.  */
+          table[i]->offset = -1; /* Mark that as deleted.  */
+          table[i] = s;
         }
       else
         {
-          for (i=0; i < n; i++)
-            if (array[i]->offset != -1 && !strcmp (array[i]->d, s->d))
-              {
-                /* We already have such an item.  */
-                s->offset = -1; /* Mark me as deleted.  */
-                break;
-              }
+          /* We already have such an item.  */
+          s->offset = -1; /* Mark me as deleted.  */
         }
 
       array[n++] = s;
     }
   array[n] = NULL;
+  free (table);
 
   /* Rebuild the sortlist.  Reverse it to keep the order of records.  */
   if (!n)
@@ -2620,10 +4159,11 @@ do_uniq ()
         array[i]->next = array[i-1];
       array[0]->next = NULL;
     }
+  free (array);
 }
 
 /*
 Local Variables:
-compile-command: "cc -Wall -O2 -o addrutil addrutil.c"
+compile-command: "cc -Wall -O2 -pthread -o addrutil addrutil.c"
 End:
 */
@@ -1,5 +1,6 @@
-/* undump - Hex undump tool
+/* b64dec - Base64 decode tool
  *	Copyright (C) 2000 Werner Koch (dd9jn)
+ *      Copyright (C) 2026 g10 Code GmbH
  *
  * This program is free software; you can redistribute it and/or modify
  * it under the terms of the GNU General Public License as published by
@@ -18,56 +19,52 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
-#define digitp(p)   ((p) >= '0' && (p) <= '9')
-#define hexdigitp(a) (digitp (a)                     \
-                      || ((a) >= 'A' && (a) <= 'F')  \
-                      || ((a) >= 'a' && (a) <= 'f'))
-#define ascii_isspace(a) ((a)==' ' || (a)=='\n' || (a)=='\r' || (a)=='\t')
-#define xtoi_1(p)   ((p) <= '9'? ((p)- '0'): \
-                     (p) <= 'F'? ((p)-'A'+10):((p)-'a'+10))
-
+#include "base64.h"
 
+#define BUFFER_SIZE 65536
 
 
 int
 main (int argc, char **argv )
 {
-  int c1, c2;
-  unsigned int value;
+  static unsigned char inbuf[BUFFER_SIZE];
+  static unsigned char outbuf[BUFFER_SIZE+3];
+  struct b64state state;
+  size_t n;
 
-  if ( argc > 1 ) 
+  if (argc > 1 && !strcmp (argv[1], "--version"))
+    {
+      printf ("b64dec (%s)\n", b64dec_implementation ());
+      return 0;
+    }
+  if ( argc > 1 )
     {
-      fprintf (stderr, "usage: undump < input\n");
+      fprintf (stderr, "usage: b64dec < input\n");
       return 1;
     }
-    
 
-  while ( (c1=getchar ()) != EOF )
+  b64dec_start (&state);
+  while ( (n = fread (inbuf, 1, sizeof inbuf, stdin)) )
     {
-      if (ascii_isspace (c1))
-        continue;
-      if (!hexdigitp (c1))
-        {
-          fprintf (stderr, "undump: non hex-digit encountered\n");
-          return 1;
-        }
-      if ( (c2=getchar ()) == EOF )
-        {
-          fprintf (stderr, "undump: error reading second nibble\n");
-          return 1;
-        }
-      if (!hexdigitp (c2))
+      n = b64dec_proc (&state, outbuf, inbuf, n);
+      if (n && fwrite (outbuf, n, 1, stdout) != 1)
         {
-          fprintf (stderr, "undump: second nibble is not a hex-digit\n");
+          fprintf (stderr, "b64dec: write error\n");
           return 1;
         }
-      value = xtoi_1 (c1) * 16 + xtoi_1 (c2);
-      putchar (value);
     }
   if (ferror (stdin))
     {
-      fprintf (stderr, "undump: read error\n");
+      fprintf (stderr, "b64dec: read error\n");
+      return 1;
+    }
+  if (state.idx)
+    fprintf (stderr, "b64dec: warning: incomplete input\n");
+  if (fflush (stdout))
+    {
+      fprintf (stderr, "b64dec: write error\n");
       return 1;
     }
 
@@ -76,8 +73,6 @@ main (int argc, char **argv )
 
 /*
 Local Variables:
-compile-command: "cc -Wall -o undump undump.c"
+compile-command: "cc -Wall -O2 -o b64dec b64dec.c base64.c"
 End:
 */
-
-
@@ -0,0 +1,509 @@
+/* base64.c - Streaming Base64 decoder
+ *      Copyright (C) 2026 g10 Code GmbH
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA
+ */
+
+/* This decoder is used by rfc822parse and b64dec.  Invalid
+ * characters, in particular white space and line endings, are
+ * skipped so that it may be fed with arbitrary chunks of an encoded
+ * body.  On x86 we use SSSE3 or AVX2 code for runs of valid
+ * characters; this is selected at runtime.  The vector code follows
+ * the well known approach by Wojciech Muła and Daniel Lemire.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "base64.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+# define USE_X86_SIMD 1
+# include <immintrin.h>
+#endif
+
+
+/* Base64 conversion table.  Invalid characters are marked with 255. */
+static const unsigned char asctobin[256] =
+  {
+    255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+    255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+    255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,  62, 255, 255, 255,  63,
+     52,  53,  54,  55,  56,  57,  58,  59,  60,  61, 255, 255, 255, 255, 255, 255,
+    255,   0,   1,   2,   3,   4,   5,   6,   7,   8,   9,  10,  11,  12,  13,  14,
+     15,  16,  17,  18,  19,  20,  21,  22,  23,  24,  25, 255, 255, 255, 255, 255,
+    255,  26,  27,  28,  29,  30,  31,  32,  33,  34,  35,  36,  37,  38,  39,  40,
+     41,  42,  43,  44,  45,  46,  47,  48,  49,  50,  51, 255, 255, 255, 255, 255,
+    255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+    255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+    255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+    255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+    255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+    255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+    255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+    255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255
+  };
+
+
+/* A block decoder converts as many complete blocks of valid
+   characters from DATA as possible.  It returns the number of bytes
+   stored at BUFFER and stores the number of used characters at
+   R_USED.  */
+typedef size_t (*block_decoder_t) (unsigned char *buffer,
+                                   const unsigned char *data, size_t length,
+                                   size_t *r_used);
+
+static block_decoder_t block_decoder;
+static size_t block_size;
+static const char *implementation = "scalar";
+
+
+#ifdef USE_X86_SIMD
+__attribute__ ((target ("ssse3")))
+static size_t
+decode_blocks_ssse3 (unsigned char *buffer, const unsigned char *data,
+                     size_t length, size_t *r_used)
+{
+  const __m128i lut_lo = _mm_setr_epi8 (0x15, 0x11, 0x11, 0x11,
+                                        0x11, 0x11, 0x11, 0x11,
+                                        0x11, 0x11, 0x13, 0x1a,
+                                        0x1b, 0x1b, 0x1b, 0x1a);
+  const __m128i lut_hi = _mm_setr_epi8 (0x10, 0x10, 0x01, 0x02,
+                                        0x04, 0x08, 0x04, 0x08,
+                                        0x10, 0x10, 0x10, 0x10,
+                                        0x10, 0x10, 0x10, 0x10);
+  const __m128i lut_roll = _mm_setr_epi8 (0, 16, 19, 4, -65, -65, -71, -71,
+                                          0, 0, 0, 0, 0, 0, 0, 0);
+  const __m128i mask_2f = _mm_set1_epi8 (0x2f);
+  const __m128i zero = _mm_setzero_si128 ();
+  const __m128i pack = _mm_setr_epi8 (2, 1, 0, 6, 5, 4, 10, 9, 8,
+                                      14, 13, 12, -1, -1, -1, -1);
+  unsigned char tmp[16];
+  unsigned char *d = buffer;
+  size_t used = 0;
+  __m128i in, hi_nibbles, lo_nibbles, lo, hi, roll, v;
+
+  for (; length - used >= 16; used += 16, d += 12)
+    {
+      in = _mm_loadu_si128 ((const __m128i *)(data + used));
+      hi_nibbles = _mm_and_si128 (_mm_srli_epi32 (in, 4), mask_2f);
+      lo_nibbles = _mm_and_si128 (in, mask_2f);
+      lo = _mm_shuffle_epi8 (lut_lo, lo_nibbles);
+      hi = _mm_shuffle_epi8 (lut_hi, hi_nibbles);
+      if (_mm_movemask_epi8 (_mm_cmpeq_epi8 (_mm_and_si128 (lo, hi), zero))
+          != 0xffff)
+        break;  /* Invalid character.  */
+      roll = _mm_shuffle_epi8 (lut_roll,
+                               _mm_add_epi8 (_mm_cmpeq_epi8 (in, mask_2f),
+                                             hi_nibbles));
+      v = _mm_add_epi8 (in, roll);
+      /* Merge the sextets into 24 bit words and put them in order. */
+      v = _mm_maddubs_epi16 (v, _mm_set1_epi32 (0x01400140));
+      v = _mm_madd_epi16 (v, _mm_set1_epi32 (0x00011000));
+      v = _mm_shuffle_epi8 (v, pack);
+      _mm_storeu_si128 ((__m128i *)tmp, v);
+      memcpy (d, tmp, 12);
+    }
+
+  *r_used = used;
+  return d - buffer;
+}
+
+
+__attribute__ ((target ("avx2")))
+static size_t
+decode_blocks_avx2 (unsigned char *buffer, const unsigned char *data,
+                    size_t length, size_t *r_used)
+{
+  const __m256i lut_lo = _mm256_setr_epi8 (0x15, 0x11, 0x11, 0x11,
+                                           0x11, 0x11, 0x11, 0x11,
+                                           0x11, 0x11, 0x13, 0x1a,
+                                           0x1b, 0x1b, 0x1b, 0x1a,
+                                           0x15, 0x11, 0x11, 0x11,
+                                           0x11, 0x11, 0x11, 0x11,
+                                           0x11, 0x11, 0x13, 0x1a,
+                                           0x1b, 0x1b, 0x1b, 0x1a);
+  const __m256i lut_hi = _mm256_setr_epi8 (0x10, 0x10, 0x01, 0x02,
+                                           0x04, 0x08, 0x04, 0x08,
+                                           0x10, 0x10, 0x10, 0x10,
+                                           0x10, 0x10, 0x10, 0x10,
+                                           0x10, 0x10, 0x01, 0x02,
+                                           0x04, 0x08, 0x04, 0x08,
+                                           0x10, 0x10, 0x10, 0x10,
+                                           0x10, 0x10, 0x10, 0x10);
+  const __m256i lut_roll = _mm256_setr_epi8 (0, 16, 19, 4, -65, -65, -71, -71,
+                                             0, 0, 0, 0, 0, 0, 0, 0,
+                                             0, 16, 19, 4, -65, -65, -71, -71,
+                                             0, 0, 0, 0, 0, 0, 0, 0);
+  const __m256i mask_2f = _mm256_set1_epi8 (0x2f);
+  const __m256i pack = _mm256_setr_epi8 (2, 1, 0, 6, 5, 4, 10, 9, 8,
+                                         14, 13, 12, -1, -1, -1, -1,
+                                         2, 1, 0, 6, 5, 4, 10, 9, 8,
+                                         14, 13, 12, -1, -1, -1, -1);
+  const __m256i perm = _mm256_setr_epi32 (0, 1, 2, 4, 5, 6, 3, 7);
+  unsigned char tmp[32];
+  unsigned char *d = buffer;
+  size_t used = 0;
+  __m256i in, hi_nibbles, lo_nibbles, lo, hi, roll, v;
+
+  for (; length - used >= 32; used += 32, d += 24)
+    {
+      in = _mm256_loadu_si256 ((const __m256i *)(data + used));
+      hi_nibbles = _mm256_and_si256 (_mm256_srli_epi32 (in, 4), mask_2f);
+      lo_nibbles = _mm256_and_si256 (in, mask_2f);
+      lo = _mm256_shuffle_epi8 (lut_lo, lo_nibbles);
+      hi = _mm256_shuffle_epi8 (lut_hi, hi_nibbles);
+      if (!_mm256_testz_si256 (lo, hi))
+        break;  /* Invalid character.  */
+      roll = _mm256_shuffle_epi8 (lut_roll,
+                                  _mm256_add_epi8 (_mm256_cmpeq_epi8
+                                                   (in, mask_2f),
+                                                   hi_nibbles));
+      v = _mm256_add_epi8 (in, roll);
+      v = _mm256_maddubs_epi16 (v, _mm256_set1_epi32 (0x01400140));
+      v = _mm256_madd_epi16 (v, _mm256_set1_epi32 (0x00011000));
+      v = _mm256_shuffle_epi8 (v, pack);
+      v = _mm256_permutevar8x32_epi32 (v, perm);
+      _mm256_storeu_si256 ((__m256i *)tmp, v);
+      memcpy (d, tmp, 24);
+    }
+
+  *r_used = used;
+  return d - buffer;
+}
+
+
+/* Select the block decoder for this CPU.  This is done at startup so
+   that we do not need to care about threads.  */
+__attribute__ ((constructor))
+static void
+select_implementation (void)
+{
+  const char *s = getenv ("B64DEC_IMPLEMENTATION");
+
+  __builtin_cpu_init ();
+  if ((!s || !strcmp (s, "avx2")) && __builtin_cpu_supports ("avx2"))
+    {
+      block_decoder = decode_blocks_avx2;
+      block_size = 32;
+      implementation = "avx2";
+    }
+  else if ((!s || !strcmp (s, "ssse3")) && __builtin_cpu_supports ("ssse3"))
+    {
+      block_decoder = decode_blocks_ssse3;
+      block_size = 16;
+      implementation = "ssse3";
+    }
+}
+#endif /*USE_X86_SIMD*/
+
+
+/* Return the name of the used implementation.  */
+const char *
+b64dec_implementation (void)
+{
+  return implementation;
+}
+
+
+/* Initialize the decoder STATE.  */
+void
+b64dec_start (struct b64state *state)
+{
+  state->idx = 0;
+  state->val = 0;
+}
+
+
+/* Decode LENGTH bytes of Base64 encoded DATA into BUFFER, which must
+   be at least LENGTH+3 bytes long.  Returns the number of bytes
+   stored.  A group of 4 characters may span calls.  Invalid
+   characters are ignored; a padding character flushes the pending
+   bits of the group.  */
+size_t
+b64dec_proc (struct b64state *state, unsigned char *buffer,
+             const unsigned char *data, size_t length)
+{
+  unsigned char *d = buffer;
+  unsigned int idx = state->idx;
+  unsigned int val = state->val;
+  unsigned int c, c0, c1, c2, c3;
+  size_t used;
+
+  while (length)
+    {
+      /* If we are at a group boundary try the vector code first.  */
+      if (!idx && block_decoder && length >= block_size)
+        {
+          d += block_decoder (d, data, length, &used);
+          data += used;
+          length -= used;
+        }
+
+      for (; length; data++, length--)
+        {
+          /* Fast path for a complete group of valid characters.  */
+          if (!idx && length >= 4)
+            {
+              c0 = asctobin[data[0]];
+              c1 = asctobin[data[1]];
+              c2 = asctobin[data[2]];
+              c3 = asctobin[data[3]];
+              if (!((c0 | c1 | c2 | c3) & 0xc0))
+                {
+                  val = (c0 << 18) | (c1 << 12) | (c2 << 6) | c3;
+                  *d++ = val >> 16;
+                  *d++ = val >> 8;
+                  *d++ = val;
+                  val = 0;
+                  data += 3;
+                  length -= 3;
+                  continue;
+                }
+            }
+
+          if ((c = asctobin[*data]) == 255)
+            {
+              /* After skipping a line break or the like we may
+                 return to the vector code.  */
+              if (!idx && block_decoder && *data != '=')
+                {
+                  data++;
+                  length--;
+                  break;
+                }
+              if (*data == '=' && idx > 1)
+                {
+                  /* Padding: flush the remaining octets.  */
+                  val <<= 6 * (4 - idx);
+                  *d++ = val >> 16;
+                  if (idx == 3)
+                    *d++ = val >> 8;
+                  idx = 0;
+                  val = 0;
+                }
+              continue;
+            }
+          val = (val << 6) | c;
+          if (++idx == 4)
+            {
+              *d++ = val >> 16;
+              *d++ = val >> 8;
+              *d++ = val;
+              idx = 0;
+              val = 0;
+            }
+        }
+    }
+
+  state->idx = idx;
+  state->val = val;
+  return d - buffer;
+}
+
+
+
+#ifdef TESTING_BASE64
+#include <sys/time.h>
+
+/* The byte at a time decoder as formerly used by scrutmime.  */
+static size_t
+reference_decode (unsigned char *buffer, const unsigned char *data,
+                  size_t length)
+{
+  int state, c, value=0;
+  unsigned char *d;
+
+  for (state=0, d=buffer; length; data++, length--)
+    {
+      if ((c = asctobin[*data]) == 255 )
+        continue;
+      switch (state)
+        {
+        case 0:
+          value = c << 2;
+          break;
+        case 1:
+          value |= (c>>4)&3;
+          *d++ = value;
+          value = (c<<4)&0xf0;
+          break;
+        case 2:
+          value |= (c>>2)&15;
+          *d++ = value;
+          value = (c<<6)&0xc0;
+          break;
+        case 3:
+          value |= c&0x3f;
+          *d++ = value;
+          break;
+        }
+      state++;
+      state = state & 3;
+    }
+  return d - buffer;
+}
+
+
+static double
+timediff (struct timeval *start)
+{
+  struct timeval stop;
+
+  gettimeofday (&stop, NULL);
+  return ((stop.tv_sec - start->tv_sec)
+          + (stop.tv_usec - start->tv_usec) / 1000000.0);
+}
+
+
+/* Decode ENCODED in chunks of CHUNK bytes with the current
+   implementation.  */
+static size_t
+chunked_decode (unsigned char *buffer, const unsigned char *encoded,
+                size_t length, size_t chunk)
+{
+  struct b64state state;
+  size_t n, total = 0;
+
+  b64dec_start (&state);
+  for (; length; encoded += n, length -= n)
+    {
+      n = length < chunk? length : chunk;
+      total += b64dec_proc (&state, buffer + total, encoded, n);
+    }
+  return total;
+}
+
+
+/* Check that all implementations produce the same output as the
+   reference decoder and print their throughput.  */
+int
+main (int argc, char **argv)
+{
+  static const char bintoasc[] = ("ABCDEFGHIJKLMNOPQRSTUVWXYZ"
+                                  "abcdefghijklmnopqrstuvwxyz"
+                                  "0123456789+/");
+  size_t size = argc > 1? strtoul (argv[1], NULL, 0) : 64;  /* MiB */
+  size_t enclen, declen, n, i, k;
+  unsigned char *raw, *encoded, *ref, *out;
+  struct timeval start;
+  block_decoder_t saved_decoder = block_decoder;
+  size_t saved_size = block_size;
+  const char *saved_impl = implementation;
+  int pass, failed = 0;
+  double secs;
+
+  size *= 1024*1024;
+  raw = malloc (size);
+  encoded = malloc (size / 3 * 4 + size / 57 * 2 + 8);
+  ref = malloc (size + 8);
+  out = malloc (size + 8);
+  if (!raw || !encoded || !ref || !out)
+    abort ();
+  srand (42);
+  for (i=0; i < size; i++)
+    raw[i] = rand ();
+
+  /* Encode with CR,LF after each 76 characters.  */
+  for (i=0, n=0, k=0; i + 3 <= size; i += 3)
+    {
+      encoded[n++] = bintoasc[raw[i] >> 2];
+      encoded[n++] = bintoasc[((raw[i] & 3) << 4) | (raw[i+1] >> 4)];
+      encoded[n++] = bintoasc[((raw[i+1] & 15) << 2) | (raw[i+2] >> 6)];
+      encoded[n++] = bintoasc[raw[i+2] & 63];
+      if (++k == 19)
+        {
+          encoded[n++] = '\r';
+          encoded[n++] = '\n';
+          k = 0;
+        }
+    }
+  enclen = n;
+  size = i;
+
+  gettimeofday (&start, NULL);
+  declen = reference_decode (ref, encoded, enclen);
+  secs = timediff (&start);
+  printf ("%-10s %8.3f GB/s\n", "reference",
+          enclen / secs / (1024.0*1024*1024));
+  if (declen != size || memcmp (ref, raw, size))
+    {
+      printf ("reference decoder failed\n");
+      failed = 1;
+    }
+
+  for (pass=0; pass < 3; pass++)
+    {
+      if (!pass)
+        {
+          block_decoder = NULL;
+          implementation = "scalar";
+        }
+      else if (pass == 1 && saved_size == 32)
+        {
+          /* Also test SSSE3 if we have AVX2.  */
+          block_decoder = decode_blocks_ssse3;
+          block_size = 16;
+          implementation = "ssse3";
+        }
+      else if (pass == 2 && saved_decoder)
+        {
+          block_decoder = saved_decoder;
+          block_size = saved_size;
+          implementation = saved_impl;
+        }
+      else
+        continue;
+
+      gettimeofday (&start, NULL);
+      declen = chunked_decode (out, encoded, enclen, enclen);
+      secs = timediff (&start);
+      printf ("%-10s %8.3f GB/s\n", implementation,
+              enclen / secs / (1024.0*1024*1024));
+      if (declen != size || memcmp (out, raw, size))
+        {
+          printf ("%s decoder failed\n", implementation);
+          failed = 1;
+        }
+
+      /* Feed odd sized chunks to check the group handling.  */
+      declen = chunked_decode (out, encoded, enclen < 100000? enclen:100000, 7);
+      if (declen != reference_decode (ref, encoded,
+                                      enclen < 100000? enclen:100000)
+          || memcmp (out, ref, declen))
+        {
+          printf ("%s decoder failed on chunks\n", implementation);
+          failed = 1;
+        }
+    }
+
+  free (raw);
+  free (encoded);
+  free (ref);
+  free (out);
+  return failed;
+}
+#endif /*TESTING_BASE64*/
+
+/*
+Local Variables:
+compile-command: "gcc -Wall -O2 -g -DTESTING_BASE64 -o base64 base64.c"
+End:
+*/
@@ -0,0 +1,34 @@
+/* base64.h - Streaming Base64 decoder
+ *      Copyright (C) 2026 g10 Code GmbH
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA
+ */
+
+#ifndef BASE64_H
+#define BASE64_H
+
+/* The state of the decoder.  Initialize it with b64dec_start.  */
+struct b64state
+{
+  unsigned int idx;  /* Number of pending sextets in VAL.  */
+  unsigned int val;
+};
+
+void b64dec_start (struct b64state *state);
+size_t b64dec_proc (struct b64state *state, unsigned char *buffer,
+                    const unsigned char *data, size_t length);
+const char *b64dec_implementation (void);
+
+#endif /*BASE64_H*/
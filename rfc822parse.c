@@ -40,8 +40,26 @@
 #include <errno.h>
 #include <stdarg.h>
 #include <assert.h>
+#ifdef TESTING
+#include <sys/time.h>
+#endif
 
 #include "rfc822parse.h"
+#include "base64.h"
+
+#ifdef TESTING
+/* Count the allocations so that the benchmark can report them. */
+static unsigned long n_allocs;
+#define malloc(n)    (n_allocs++, malloc ((n)))
+#define calloc(n,m)  (n_allocs++, calloc ((n),(m)))
+#define realloc(p,n) (n_allocs++, realloc ((p),(n)))
+#endif
+
+#define hexdigitp(a) (((a) >= '0' && (a) <= '9')      \
+                      || ((a) >= 'A' && (a) <= 'F')   \
+                      || ((a) >= 'a' && (a) <= 'f'))
+#define xtoi_1(a)   ((a) <= '9'? ((a)- '0'): \
+                     (a) <= 'F'? ((a)-'A'+10):((a)-'a'+10))
 
 enum token_type
 {
@@ -83,9 +101,24 @@ struct part
   HDR_LINE hdr_lines;       /* Header lines os that part. */
   HDR_LINE *hdr_lines_tail; /* Helper for adding lines. */
   char *boundary;           /* Only used in the first part. */
+  int skipped;              /* The callback asked to skip this part. */
+  char *content_type;       /* Malloced "type/subtype" or NULL. */
+  rfc822parse_off_t header_off; /* Offset of the first header line. */
+  rfc822parse_off_t body_off;   /* Offset of the body. */
+  rfc822parse_off_t body_end;   /* Offset right after the body. */
 };
+
+#define NO_OFFSET ((rfc822parse_off_t)(-1))
 typedef struct part *part_t;
 
+/* The Content-Transfer-Encodings we know how to decode. */
+enum body_encodings
+  {
+    BODY_ENC_IDENTITY = 0,  /* 7bit, 8bit, binary or not given. */
+    BODY_ENC_BASE64,
+    BODY_ENC_QP
+  };
+
 struct rfc822parse_context
 {
   rfc822parse_cb_t callback;
@@ -96,6 +129,22 @@ struct rfc822parse_context
   part_t parts;         /* The tree of parts. */
   part_t current_part;  /* Whom we are processing (points into parts). */
   const char *boundary; /* Current boundary. */
+  int skip_part;        /* Ignore all lines up to the next boundary. */
+  rfc822parse_off_t offset;   /* Offset of the next line.  */
+  rfc822parse_off_t line_off; /* Offset of the current line.  */
+  size_t prev_eol;            /* Length of the previous line ending. */
+
+  /* State for delivering decoded bodies. */
+  rfc822parse_body_cb_t body_cb;
+  void *body_cb_value;
+  int deliver_body;        /* Deliver the body of the current part. */
+  int skip_body;           /* Set by rfc822parse_skip_body.  */
+  int skip_part_req;       /* Set by rfc822parse_skip_part.  */
+  enum body_encodings body_encoding;
+  int body_nl_pending;     /* A line ending needs to be delivered. */
+  struct b64state b64;     /* State of the Base64 decoder.  */
+  unsigned char *body_buf; /* Buffer for one decoded line.  */
+  size_t body_buf_size;
 };
 
 static HDR_LINE find_header (rfc822parse_t msg, const char *name,
@@ -194,28 +243,40 @@ new_part (void)
   if (part)
     {
       part->hdr_lines_tail = &part->hdr_lines;
+      part->header_off = part->body_off = part->body_end = NO_OFFSET;
     }
   return part;
 }
 
 
+static void
+release_hdr_lines (part_t part)
+{
+  HDR_LINE hdr, hdr2;
+
+  for (hdr = part->hdr_lines; hdr; hdr = hdr2)
+    {
+      hdr2 = hdr->next;
+      free (hdr);
+    }
+  part->hdr_lines = NULL;
+  part->hdr_lines_tail = &part->hdr_lines;
+}
+
+
 static void
 release_part (part_t part)
 {
   part_t tmp;
-  HDR_LINE hdr, hdr2;
 
   for (; part; part = tmp)
     {
       tmp = part->right;
       if (part->down)
         release_part (part->down);
-      for (hdr = part->hdr_lines; hdr; hdr = hdr2)
-        {
-          hdr2 = hdr->next;
-          free (hdr);
-        }
+      release_hdr_lines (part);
       free (part->boundary);
+      free (part->content_type);
       free (part);
     }
 }
@@ -228,6 +289,9 @@ release_handle_data (rfc822parse_t msg)
   msg->parts = NULL;
   msg->current_part = NULL;
   msg->boundary = NULL;
+  free (msg->body_buf);
+  msg->body_buf = NULL;
+  msg->body_buf_size = 0;
 }
 
 
@@ -262,6 +326,44 @@ rfc822parse_open (rfc822parse_cb_t cb, void *cb_value)
 }
 
 
+/* Register the callback CB to receive the decoded bodies of all
+   non-multipart parts.  The data is passed in chunks as decoded
+   according to the Content-Transfer-Encoding of the part; line
+   endings are delivered as a single LF.  The callback should return 0
+   or set errno and return -1.  Passing NULL for CB disables the body
+   delivery.  */
+void
+rfc822parse_set_body_cb (rfc822parse_t msg,
+                         rfc822parse_body_cb_t cb, void *cb_value)
+{
+  msg->body_cb = cb;
+  msg->body_cb_value = cb_value;
+}
+
+
+/* Tell the parser that the body of the current part shall not be
+   passed to the body callback.  This may be called from the
+   RFC822PARSE_T2BODY event handler or from the body callback; in the
+   former case the body is not decoded at all.  */
+void
+rfc822parse_skip_body (rfc822parse_t msg)
+{
+  msg->skip_body = 1;
+  msg->deliver_body = 0;
+}
+
+
+/* Tell the parser to ignore the body and all nested parts of the
+   current part.  This may only be called from the RFC822PARSE_T2BODY
+   event handler.  The headers of that part are released and no
+   further events are emitted for it.  */
+void
+rfc822parse_skip_part (rfc822parse_t msg)
+{
+  msg->skip_part_req = 1;
+}
+
+
 void
 rfc822parse_cancel (rfc822parse_t msg)
 {
@@ -331,6 +433,50 @@ set_current_part_to_parent (rfc822parse_t msg)
 
 
 
+/* Prepare the delivery of the decoded body of the current part.  */
+static void
+setup_body_decoding (rfc822parse_t msg)
+{
+  rfc822parse_field_t ctx;
+
+  msg->body_encoding = BODY_ENC_IDENTITY;
+  ctx = rfc822parse_parse_field (msg, "Content-Transfer-Encoding", -1);
+  if (ctx)
+    {
+      if (ctx->type == tATOM)
+        {
+          lowercase_string (ctx->data);
+          if (!strcmp (ctx->data, "base64"))
+            msg->body_encoding = BODY_ENC_BASE64;
+          else if (!strcmp (ctx->data, "quoted-printable"))
+            msg->body_encoding = BODY_ENC_QP;
+        }
+      rfc822parse_release_field (ctx);
+    }
+  msg->body_nl_pending = 0;
+  b64dec_start (&msg->b64);
+  msg->deliver_body = 1;
+}
+
+
+/* Store the media type from the Content-Type field CTX as the
+   content type of PART.  Returns 0 on success or -1 with errno set
+   if we are out of core.  */
+static int
+set_content_type (part_t part, rfc822parse_field_t ctx)
+{
+  const char *s, *s2;
+
+  if (!ctx || !(s = rfc822parse_query_media_type (ctx, &s2)))
+    return 0;
+  part->content_type = malloc (strlen (s) + strlen (s2) + 2);
+  if (!part->content_type)
+    return -1;
+  strcpy (stpcpy (stpcpy (part->content_type, s), "/"), s2);
+  return 0;
+}
+
+
 /****************
  * We have read in all header lines and are about to receive the body
  * part.  The delimiter line has already been processed.
@@ -342,19 +488,36 @@ transition_to_body (rfc822parse_t msg)
 {
   rfc822parse_field_t ctx;
   int rc;
+  int is_multipart = 0;
+  const char *s;
 
+  msg->skip_body = 0;
+  msg->deliver_body = 0;
+  msg->skip_part_req = 0;
   rc = do_callback (msg, RFC822PARSE_T2BODY);
+  if (!rc && msg->skip_part_req)
+    {
+      /* The caller is not interested in this part.  We don't need
+         its headers anymore and won't descend into it.  Keep the
+         content type for rfc822parse_export_tree.  */
+      ctx = rfc822parse_parse_field (msg, "Content-Type", -1);
+      rc = set_content_type (msg->current_part, ctx);
+      rfc822parse_release_field (ctx);
+      release_hdr_lines (msg->current_part);
+      msg->current_part->skipped = 1;
+      msg->skip_part = 1;
+      return rc;
+    }
   if (!rc)
     {
       /* Store the boundary if we have multipart type. */
       ctx = rfc822parse_parse_field (msg, "Content-Type", -1);
       if (ctx)
         {
-          const char *s;
-
           s = rfc822parse_query_media_type (ctx, NULL);
           if (s && !strcmp (s,"multipart"))
             {
+              is_multipart = 1;
               s = rfc822parse_query_parameter (ctx, "boundary", 0);
               if (s)
                 {
@@ -382,8 +545,10 @@ transition_to_body (rfc822parse_t msg)
                     }
                 }
             }
-          rfc822parse_release_field (ctx);
         }
+      if (!is_multipart && msg->body_cb && !msg->skip_body)
+        setup_body_decoding (msg);
+      rfc822parse_release_field (ctx);
     }
 
   return rc;
@@ -415,9 +580,12 @@ insert_header (rfc822parse_t msg, const unsigned char *line, size_t length)
   HDR_LINE hdr;
 
   assert (msg->current_part);
+  if (msg->current_part->header_off == NO_OFFSET)
+    msg->current_part->header_off = msg->line_off;
   if (!length)
     {
       msg->in_body = 1;
+      msg->current_part->body_off = msg->offset;
       return transition_to_body (msg);
     }
 
@@ -433,8 +601,9 @@ insert_header (rfc822parse_t msg, const unsigned char *line, size_t length)
   memcpy (hdr->line, line, length);
   hdr->line[length] = 0; /* Make it a string. */
 
-  /* Transform a field name into canonical format. */
-  if (!hdr->cont && strchr (line, ':'))
+  /* Transform a field name into canonical format.  Note that LINE
+     is not necessary a string. */
+  if (!hdr->cont && strchr (hdr->line, ':'))
      capitalize_header_name (hdr->line);
 
   *msg->current_part->hdr_lines_tail = hdr;
@@ -448,6 +617,126 @@ insert_header (rfc822parse_t msg, const unsigned char *line, size_t length)
 }
 
 
+/* Decode the quoted-printable LINE into BUFFER which must be at least
+   LENGTH bytes long.  Returns the number of bytes stored and sets
+   SOFT_BREAK if the line ended in a soft line break.  */
+static size_t
+decode_qp_line (unsigned char *buffer, const unsigned char *line,
+                size_t length, int *soft_break)
+{
+  unsigned char *d = buffer;
+  const unsigned char *s;
+
+  /* Trailing white space is to be removed (RFC-2045, 6.7 (3)). */
+  length = length_sans_trailing_ws (line, length);
+  *soft_break = (length && line[length-1] == '=');
+  if (*soft_break)
+    length--;
+
+  while (length)
+    {
+      s = memchr (line, '=', length);
+      if (!s)
+        {
+          memcpy (d, line, length);
+          d += length;
+          break;
+        }
+      if (s > line)
+        {
+          memcpy (d, line, s - line);
+          d += s - line;
+          length -= s - line;
+          line = s;
+        }
+      if (length >= 3 && hexdigitp (line[1]) && hexdigitp (line[2]))
+        {
+          *d++ = xtoi_1 (line[1]) * 16 + xtoi_1 (line[2]);
+          line += 3;
+          length -= 3;
+        }
+      else
+        {
+          /* Invalid escape; pass it on literally.  */
+          *d++ = *line++;
+          length--;
+        }
+    }
+
+  return d - buffer;
+}
+
+
+/* Decode LINE according to the transfer encoding of the current part
+   and pass it to the body callback.  The line ending is delivered
+   only with the next line because the line break preceding a
+   boundary belongs to that boundary.  */
+static int
+deliver_body_line (rfc822parse_t msg, const unsigned char *line,
+                   size_t length)
+{
+  unsigned char *d;
+  size_t n;
+  int soft_break = 0;
+
+  /* We need one extra byte for the pending line ending and 3 for
+     the Base64 decoder.  */
+  if (msg->body_buf_size < length + 3)
+    {
+      unsigned char *tmp;
+      size_t newsize = length + 3 < 256? 256 : length + 3;
+
+      tmp = realloc (msg->body_buf, newsize);
+      if (!tmp)
+        return -1;
+      msg->body_buf = tmp;
+      msg->body_buf_size = newsize;
+    }
+  d = msg->body_buf;
+
+  switch (msg->body_encoding)
+    {
+    case BODY_ENC_BASE64:
+      n = b64dec_proc (&msg->b64, d, line, length);
+      break;
+
+    case BODY_ENC_QP:
+      if (msg->body_nl_pending)
+        *d++ = '\n';
+      n = decode_qp_line (d, line, length, &soft_break);
+      n += d - msg->body_buf;
+      msg->body_nl_pending = !soft_break;
+      break;
+
+    default:
+      if (msg->body_nl_pending)
+        *d++ = '\n';
+      memcpy (d, line, length);
+      n = length + (d - msg->body_buf);
+      msg->body_nl_pending = 1;
+      break;
+    }
+
+  if (!n)
+    return 0;
+  return msg->body_cb (msg->body_cb_value, msg, msg->body_buf, n);
+}
+
+
+/* Mark the end of the body of PART which is terminated by a boundary
+   in the current line.  The line break before the boundary belongs
+   to the boundary.  */
+static void
+set_body_end (rfc822parse_t msg, part_t part)
+{
+  if (part->body_end != NO_OFFSET)
+    return;  /* A multipart already ended with its close delimiter. */
+  part->body_end = msg->line_off - msg->prev_eol;
+  if (part->body_off == NO_OFFSET || part->body_end < part->body_off)
+    part->body_end = part->body_off;
+}
+
+
 /****************
  * Note: We handle the body transparent to allow binary zeroes in it.
  */
@@ -463,8 +752,12 @@ insert_body (rfc822parse_t msg, const unsigned char *line, size_t length)
       if (length == blen + 2
           && !memcmp (line+2, msg->boundary, blen))
         {
+          if (!msg->in_preamble)
+            set_body_end (msg, msg->current_part);
           rc = do_callback (msg, RFC822PARSE_BOUNDARY);
           msg->in_body = 0;
+          msg->deliver_body = 0;
+          msg->skip_part = 0;
           if (!rc && !msg->in_preamble)
             rc = transition_to_header (msg);
           msg->in_preamble = 0;
@@ -473,9 +766,16 @@ insert_body (rfc822parse_t msg, const unsigned char *line, size_t length)
           && line[length-2] =='-' && line[length-1] == '-'
           && !memcmp (line+2, msg->boundary, blen))
         {
+          if (!msg->in_preamble)
+            set_body_end (msg, msg->current_part);
           rc = do_callback (msg, RFC822PARSE_LAST_BOUNDARY);
+          msg->deliver_body = 0;
+          msg->skip_part = 0;
           msg->boundary = NULL; /* No current boundary anymore. */
           set_current_part_to_parent (msg);
+          /* The body of the multipart ends with its close delimiter;
+             the epilogue is not part of it. */
+          msg->current_part->body_end = msg->line_off + length;
 
           /* Fixme: The next should acctually be sent right before the
              next boundary, so that we can mark the epilogue. */
@@ -483,20 +783,59 @@ insert_body (rfc822parse_t msg, const unsigned char *line, size_t length)
             rc = do_callback (msg, RFC822PARSE_LEVEL_UP);
         }
     }
+  else if (msg->skip_part)
+    return 0;  /* Fast forward to the next boundary. */
+
   if (msg->in_preamble && !rc)
     rc = do_callback (msg, RFC822PARSE_PREAMBLE);
+  else if (msg->deliver_body && !rc)
+    rc = deliver_body_line (msg, line, length);
 
   return rc;
 }
 
+static int
+insert_line (rfc822parse_t msg, const unsigned char *line, size_t length,
+             size_t eol)
+{
+  int rc;
+
+  msg->line_off = msg->offset;
+  msg->offset += length + eol;
+  rc = (msg->in_body
+        ? insert_body (msg, line, length)
+        : insert_header (msg, line, length));
+  msg->prev_eol = eol;
+  return rc;
+}
+
+
 /* Insert the next line into the parser. Return 0 on success or true
-   on error with errno set appropriately. */
+   on error with errno set appropriately.  The line ending must have
+   been stripped; for the offsets we assume it was a single LF.  */
 int
 rfc822parse_insert (rfc822parse_t msg, const unsigned char *line, size_t length)
 {
-  return (msg->in_body
-          ? insert_body (msg, line, length)
-          : insert_header (msg, line, length));
+  return insert_line (msg, line, length, 1);
+}
+
+
+/* Same as rfc822parse_insert but LINE still includes the line ending
+   which may be a LF, a CR,LF or none at all for the last line.  Use
+   this to get exact offsets for rfc822parse_export_tree.  */
+int
+rfc822parse_insert_raw (rfc822parse_t msg,
+                        const unsigned char *line, size_t length)
+{
+  size_t eol = 0;
+
+  if (length && line[length-1] == '\n')
+    {
+      eol++;
+      if (length > 1 && line[length-2] == '\r')
+        eol++;
+    }
+  return insert_line (msg, line, length - eol, eol);
 }
 
 
@@ -1099,6 +1438,358 @@ rfc822parse_query_media_type (rfc822parse_field_t ctx, const char **subtype)
 
 
 
+
+/* The part tree may be written to a file so that other tools can
+   access the parts of the stored message directly.  The format is:
+
+     "RFC822PT" - magic
+     u8         - version (1)
+     u8[3]      - reserved
+     u32        - number of parts
+
+   followed by one record for each part in pre-order:
+
+     u32        - index of the parent part or 0xffffffff
+     u64        - offset of the header
+     u64        - offset of the body
+     u64        - offset right after the body
+     u16        - length of the content type; followed by it
+     u16        - length of the boundary; followed by it
+
+   All integers are stored big endian; unknown offsets are all ones. */
+#define TREE_MAGIC "RFC822PT"
+#define TREE_VERSION 1
+
+static void
+put_uint (FILE *fp, unsigned long long value, int nbytes)
+{
+  while (nbytes--)
+    putc ((value >> (nbytes*8)) & 0xff, fp);
+}
+
+static void
+put_string (FILE *fp, const char *string)
+{
+  size_t n = string? strlen (string) : 0;
+
+  if (n > 0xffff)
+    n = 0xffff;
+  put_uint (fp, n, 2);
+  if (n)
+    fwrite (string, n, 1, fp);
+}
+
+static unsigned int
+count_parts (part_t part)
+{
+  unsigned int n = 0;
+
+  for (; part; part = part->right)
+    n += 1 + count_parts (part->down);
+  return n;
+}
+
+static int
+write_parts (rfc822parse_t msg, FILE *fp, part_t part,
+             unsigned int parent, unsigned int *idx)
+{
+  rfc822parse_off_t end;
+  rfc822parse_field_t ctx;
+  part_t save_part;
+  int rc;
+
+  for (; part; part = part->right)
+    {
+      if (!part->content_type && part->hdr_lines)
+        {
+          /* The content type is only parsed when needed.  */
+          save_part = msg->current_part;
+          msg->current_part = part;
+          ctx = rfc822parse_parse_field (msg, "Content-Type", -1);
+          msg->current_part = save_part;
+          rc = set_content_type (part, ctx);
+          rfc822parse_release_field (ctx);
+          if (rc)
+            return rc;
+        }
+      end = part->body_end;
+      if (end == NO_OFFSET && part->body_off != NO_OFFSET)
+        end = msg->offset;  /* Not yet terminated. */
+      put_uint (fp, parent, 4);
+      put_uint (fp, part->header_off, 8);
+      put_uint (fp, part->body_off, 8);
+      put_uint (fp, end, 8);
+      put_string (fp, part->content_type);
+      put_string (fp, part->boundary);
+      if (part->down)
+        {
+          unsigned int me = *idx;
+
+          ++*idx;
+          if (write_parts (msg, fp, part->down, me, idx))
+            return -1;
+        }
+      else
+        ++*idx;
+    }
+  return 0;
+}
+
+
+/* Write the structure of the message parsed so far to FP.  Returns 0
+   on success or -1 with errno set on a write error or if we are out
+   of core.  */
+int
+rfc822parse_export_tree (rfc822parse_t msg, FILE *fp)
+{
+  unsigned int idx = 0;
+
+  fwrite (TREE_MAGIC, 8, 1, fp);
+  put_uint (fp, TREE_VERSION, 1);
+  put_uint (fp, 0, 3);
+  put_uint (fp, count_parts (msg->parts), 4);
+  if (write_parts (msg, fp, msg->parts, 0xffffffff, &idx))
+    return -1;
+  if (ferror (fp))
+    return -1;
+  return 0;
+}
+
+
+static int
+get_uint (FILE *fp, unsigned long long *r_value, int nbytes)
+{
+  int c;
+
+  *r_value = 0;
+  while (nbytes--)
+    {
+      if ((c = getc (fp)) == EOF)
+        {
+          if (!ferror (fp))
+            errno = EINVAL;  /* Truncated.  */
+          return -1;
+        }
+      *r_value = (*r_value << 8) | c;
+    }
+  return 0;
+}
+
+static int
+get_string (FILE *fp, char **r_string)
+{
+  unsigned long long n;
+
+  *r_string = NULL;
+  if (get_uint (fp, &n, 2))
+    return -1;
+  if (!n)
+    return 0;
+  *r_string = malloc (n + 1);
+  if (!*r_string)
+    return -1;
+  if (fread (*r_string, n, 1, fp) != 1)
+    {
+      if (!ferror (fp))
+        errno = EINVAL;  /* Truncated.  */
+      return -1;
+    }
+  (*r_string)[n] = 0;
+  return 0;
+}
+
+
+/* Read a part tree as written by rfc822parse_export_tree from FP.  On
+   success 0 is returned and an array with the parts in pre-order is
+   stored at R_PARTS and its length at R_NPARTS.  On error -1 is
+   returned with errno set; EINVAL indicates an invalid file.  */
+int
+rfc822parse_import_tree (FILE *fp, rfc822parse_partinfo_t *r_parts,
+                         size_t *r_nparts)
+{
+  char magic[8];
+  unsigned long long val, n;
+  rfc822parse_partinfo_t parts;
+  size_t i;
+
+  *r_parts = NULL;
+  *r_nparts = 0;
+  if (fread (magic, 8, 1, fp) != 1)
+    {
+      if (!ferror (fp))
+        errno = EINVAL;
+      return -1;
+    }
+  if (memcmp (magic, TREE_MAGIC, 8))
+    goto invalid;
+  if (get_uint (fp, &val, 1))
+    return -1;
+  if (val != TREE_VERSION)
+    goto invalid;
+  if (get_uint (fp, &val, 3) || get_uint (fp, &n, 4))
+    return -1;
+  if (!n || n > 0x100000)
+    goto invalid;
+
+  parts = calloc (n, sizeof *parts);
+  if (!parts)
+    return -1;
+  for (i=0; i < n; i++)
+    {
+      if (get_uint (fp, &val, 4))
+        goto failure;
+      parts[i].parent = val == 0xffffffff? -1 : (int)val;
+      if ((parts[i].parent != -1 && parts[i].parent >= i)
+          || (!i && parts[i].parent != -1))
+        {
+          errno = EINVAL;
+          goto failure;
+        }
+      parts[i].level = parts[i].parent == -1? 0 : parts[parts[i].parent].level+1;
+      if (get_uint (fp, &parts[i].header_off, 8)
+          || get_uint (fp, &parts[i].body_off, 8)
+          || get_uint (fp, &parts[i].body_end, 8)
+          || get_string (fp, &parts[i].content_type)
+          || get_string (fp, &parts[i].boundary))
+        goto failure;
+    }
+
+  *r_parts = parts;
+  *r_nparts = n;
+  return 0;
+
+ failure:
+  {
+    int save_errno = errno;
+    rfc822parse_release_tree (parts, n);
+    errno = save_errno;
+  }
+  return -1;
+
+ invalid:
+  errno = EINVAL;
+  return -1;
+}
+
+
+/* Release an array as returned by rfc822parse_import_tree. */
+void
+rfc822parse_release_tree (rfc822parse_partinfo_t parts, size_t nparts)
+{
+  size_t i;
+
+  if (!parts)
+    return;
+  for (i=0; i < nparts; i++)
+    {
+      free (parts[i].content_type);
+      free (parts[i].boundary);
+    }
+  free (parts);
+}
+
+
+
+#if defined(TESTING) || defined(FUZZING)
+/* Split the LENGTH bytes in BUFFER into lines and insert them into
+   the parser.  Returns the result of the first failed insert or 0. */
+static int
+insert_buffer (rfc822parse_t msg, const unsigned char *buffer, size_t length)
+{
+  const unsigned char *p;
+  size_t n;
+  int rc;
+
+  while (length)
+    {
+      p = memchr (buffer, '\n', length);
+      n = p? (p - buffer + 1) : length;
+      rc = rfc822parse_insert_raw (msg, buffer, n);
+      if (rc)
+        return rc;
+      buffer += n;
+      length -= n;
+    }
+  return 0;
+}
+#endif /*TESTING || FUZZING*/
+
+
+#ifdef FUZZING
+/* Entry point for libFuzzer; build with
+     clang -g -fsanitize=fuzzer,address -DFUZZING rfc822parse.c base64.c
+   For AFL use the TESTING build which reads the message from stdin. */
+
+static int
+fuzz_cb (void *dummy_arg, rfc822parse_event_t event, rfc822parse_t msg)
+{
+  rfc822parse_field_t ctx;
+  const char *s, *type = NULL;
+  void *ectx;
+  char *p;
+  int skip = 0;
+
+  if (event != RFC822PARSE_T2BODY)
+    return 0;
+
+  for (ectx=NULL; rfc822parse_enum_header_lines (msg, &ectx); )
+    ;
+  rfc822parse_enum_header_lines (NULL, &ectx);
+
+  ctx = rfc822parse_parse_field (msg, "Content-Type", -1);
+  if (ctx)
+    {
+      type = rfc822parse_query_media_type (ctx, &s);
+      skip = (type && !strcmp (type, "application"));
+      rfc822parse_query_parameter (ctx, "boundary", 0);
+      rfc822parse_query_parameter (ctx, "charset", 1);
+      rfc822parse_release_field (ctx);
+    }
+  ctx = rfc822parse_parse_field (msg, "Content-Disposition", 1);
+  if (ctx)
+    {
+      rfc822parse_query_parameter (ctx, "filename", 0);
+      rfc822parse_release_field (ctx);
+    }
+  ctx = rfc822parse_parse_field (msg, "Received", 1);
+  rfc822parse_release_field (ctx);
+  p = rfc822parse_get_field (msg, "X-*", -1, NULL);
+  free (p);
+  if (skip)
+    rfc822parse_skip_part (msg);
+  return 0;
+}
+
+static int
+fuzz_body_cb (void *dummy_arg, rfc822parse_t msg,
+              const unsigned char *data, size_t length)
+{
+  /* Touch all data so that the sanitizer may check it.  */
+  volatile unsigned char c = 0;
+
+  while (length--)
+    c ^= *data++;
+  return 0;
+}
+
+int
+LLVMFuzzerTestOneInput (const unsigned char *data, size_t size)
+{
+  rfc822parse_t msg;
+
+  msg = rfc822parse_open (fuzz_cb, NULL);
+  if (!msg)
+    return 0;
+  if (size && (data[0] & 1))
+    rfc822parse_set_body_cb (msg, fuzz_body_cb, NULL);
+  insert_buffer (msg, data, size);
+  rfc822parse_finish (msg);
+  rfc822parse_close (msg);
+  return 0;
+}
+#endif /*FUZZING*/
+
+
 #ifdef TESTING
 
 /* Internal debug function to print the structure of the message. */
@@ -1118,6 +1809,12 @@ dump_structure (rfc822parse_t msg, part_t part, int indent)
                            get part inforation. */
       const char *s;
 
+      if (part->skipped)
+        {
+          printf ("***   %*s [skipped]\n", indent*2, "");
+          continue;
+        }
+
       save_part = msg->current_part;
       msg->current_part = part;
       ctx = rfc822parse_parse_field (msg, "Content-Type", -1);
@@ -1222,30 +1919,212 @@ msg_cb (void *dummy_arg, rfc822parse_event_t event, rfc822parse_t msg)
 
 
 
+static int
+body_cb (void *dummy_arg, rfc822parse_t msg,
+         const unsigned char *data, size_t length)
+{
+  fwrite (data, length, 1, stdout);
+  return 0;
+}
+
+
+static int
+bench_cb (void *dummy_arg, rfc822parse_event_t event, rfc822parse_t msg)
+{
+  rfc822parse_field_t ctx;
+
+  /* Do what a typical user does. */
+  if (event == RFC822PARSE_T2BODY)
+    {
+      ctx = rfc822parse_parse_field (msg, "Content-Type", -1);
+      if (ctx)
+        {
+          rfc822parse_query_media_type (ctx, NULL);
+          rfc822parse_release_field (ctx);
+        }
+    }
+  return 0;
+}
+
+static int
+bench_body_cb (void *dummy_arg, rfc822parse_t msg,
+               const unsigned char *data, size_t length)
+{
+  return 0;
+}
+
+
+/* Print the part tree stored in FNAME.  */
+static void
+show_tree (const char *fname)
+{
+  FILE *fp;
+  rfc822parse_partinfo_t parts;
+  size_t i, nparts;
+
+  fp = fopen (fname, "rb");
+  if (!fp || rfc822parse_import_tree (fp, &parts, &nparts))
+    {
+      fprintf (stderr, "error reading `%s': %s\n", fname, strerror (errno));
+      exit (1);
+    }
+  fclose (fp);
+  for (i=0; i < nparts; i++)
+    printf ("***   %*s %s hdr=%llu body=%llu-%llu%s%s%s\n",
+            parts[i].level*2, "",
+            parts[i].content_type? parts[i].content_type : "[none]",
+            parts[i].header_off, parts[i].body_off, parts[i].body_end,
+            parts[i].boundary? " (boundary=\"" : "",
+            parts[i].boundary? parts[i].boundary : "",
+            parts[i].boundary? "\")" : "");
+  rfc822parse_release_tree (parts, nparts);
+}
+
+
+/* Parse all messages given in FILES REPEAT times and print the
+   throughput.  Each file is expected to hold one message.  */
+static void
+run_benchmark (char **files, int nfiles, int repeat, int with_body)
+{
+  unsigned char **buffers;
+  size_t *lengths;
+  unsigned long nmsgs = 0;
+  unsigned long nbytes = 0;
+  unsigned long allocs;
+  struct timeval start, stop;
+  double elapsed;
+  rfc822parse_t msg;
+  FILE *fp;
+  int i, r;
+
+  buffers = calloc (nfiles, sizeof *buffers);
+  lengths = calloc (nfiles, sizeof *lengths);
+  if (!buffers || !lengths)
+    abort ();
+  for (i=0; i < nfiles; i++)
+    {
+      size_t n;
+
+      fp = fopen (files[i], "rb");
+      if (!fp)
+        {
+          fprintf (stderr, "can't open `%s': %s\n", files[i], strerror (errno));
+          exit (1);
+        }
+      n = 0;
+      do
+        {
+          buffers[i] = realloc (buffers[i], n + 65536);
+          if (!buffers[i])
+            abort ();
+          n += fread (buffers[i] + n, 1, 65536, fp);
+        }
+      while (!feof (fp) && !ferror (fp));
+      fclose (fp);
+      lengths[i] = n;
+    }
+
+  allocs = n_allocs;
+  gettimeofday (&start, NULL);
+  for (r=0; r < repeat; r++)
+    for (i=0; i < nfiles; i++)
+      {
+        msg = rfc822parse_open (bench_cb, NULL);
+        if (!msg)
+          abort ();
+        if (with_body)
+          rfc822parse_set_body_cb (msg, bench_body_cb, NULL);
+        if (insert_buffer (msg, buffers[i], lengths[i]))
+          abort ();
+        rfc822parse_close (msg);
+        nmsgs++;
+        nbytes += lengths[i];
+      }
+  gettimeofday (&stop, NULL);
+  allocs = n_allocs - allocs;
+
+  elapsed = ((stop.tv_sec - start.tv_sec)
+             + (stop.tv_usec - start.tv_usec) / 1000000.0);
+  if (elapsed <= 0)
+    elapsed = 0.000001;
+  printf ("%lu messages, %lu bytes in %.3fs\n", nmsgs, nbytes, elapsed);
+  printf ("%.1f messages/s, %.2f MB/s, %.1f allocations/message\n",
+          nmsgs / elapsed, nbytes / elapsed / (1024.0*1024.0),
+          nmsgs? (double)allocs / nmsgs : 0.0);
+
+  for (i=0; i < nfiles; i++)
+    free (buffers[i]);
+  free (buffers);
+  free (lengths);
+}
+
+
 int
 main (int argc, char **argv)
 {
   char line[5000];
   size_t length;
   rfc822parse_t msg;
+  int with_body = 0;
+  int repeat = 1;
+  const char *exportfile = NULL;
+
+  if (argc)
+    {
+      argc--; argv++;
+    }
+  if (argc && !strcmp (*argv, "--body"))
+    {
+      with_body = 1;
+      argc--; argv++;
+    }
+  if (argc > 1 && !strcmp (*argv, "--repeat"))
+    {
+      repeat = atoi (argv[1]);
+      argc -= 2; argv += 2;
+    }
+  if (argc && !strcmp (*argv, "--bench"))
+    {
+      /* Usage: rfc822parse [--body] [--repeat N] --bench FILES */
+      argc--; argv++;
+      run_benchmark (argv, argc, repeat > 0? repeat : 1, with_body);
+      return 0;
+    }
+  if (argc > 1 && !strcmp (*argv, "--import"))
+    {
+      show_tree (argv[1]);
+      return 0;
+    }
+  if (argc > 1 && !strcmp (*argv, "--export"))
+    exportfile = argv[1];
 
   msg = rfc822parse_open (msg_cb, NULL);
   if (!msg)
     abort ();
+  if (with_body)
+    rfc822parse_set_body_cb (msg, body_cb, NULL);
 
   while (fgets (line, sizeof (line), stdin))
     {
       length = strlen (line);
-      if (length && line[length - 1] == '\n')
-	line[--length] = 0;
-      if (length && line[length - 1] == '\r')
-	line[--length] = 0;
-      if (rfc822parse_insert (msg, line, length))
+      if (rfc822parse_insert_raw (msg, line, length))
 	abort ();
     }
 
   dump_structure (msg, NULL, 0);
 
+  if (exportfile)
+    {
+      FILE *fp = fopen (exportfile, "wb");
+
+      if (!fp || rfc822parse_export_tree (msg, fp) || fclose (fp))
+        {
+          fprintf (stderr, "error writing `%s': %s\n",
+                   exportfile, strerror (errno));
+          exit (1);
+        }
+    }
+
   rfc822parse_close (msg);
   return 0;
 }
@@ -1253,6 +2132,6 @@ main (int argc, char **argv)
 
 /*
 Local Variables:
-compile-command: "gcc -Wall -Wno-pointer-sign -g -DTESTING -o rfc822parse rfc822parse.c"
+compile-command: "gcc -Wall -Wno-pointer-sign -g -DTESTING -o rfc822parse rfc822parse.c base64.c"
 End:
 */
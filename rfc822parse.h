@@ -41,6 +41,22 @@ typedef enum
   } 
 rfc822parse_event_t;
 
+/* Byte offsets into the message.  */
+typedef unsigned long long rfc822parse_off_t;
+
+/* Description of a part as stored by rfc822parse_export_tree. */
+struct rfc822parse_partinfo_s
+{
+  int parent;                   /* Index of the parent or -1. */
+  int level;                    /* Nesting level; 0 for the message. */
+  rfc822parse_off_t header_off; /* Offset of the first header line. */
+  rfc822parse_off_t body_off;   /* Offset of the body. */
+  rfc822parse_off_t body_end;   /* Offset right after the body. */
+  char *content_type;           /* Lowercase "type/subtype" or NULL. */
+  char *boundary;               /* Boundary of multiparts or NULL. */
+};
+typedef struct rfc822parse_partinfo_s *rfc822parse_partinfo_t;
+
 struct rfc822parse_field_context;
 typedef struct rfc822parse_field_context *rfc822parse_field_t;
 
@@ -49,16 +65,28 @@ typedef int (*rfc822parse_cb_t) (void *opaque,
                                  rfc822parse_event_t event,
                                  rfc822parse_t msg);
 
+typedef int (*rfc822parse_body_cb_t) (void *opaque,
+                                      rfc822parse_t msg,
+                                      const unsigned char *data,
+                                      size_t length);
+
 
 rfc822parse_t rfc822parse_open (rfc822parse_cb_t cb, void *opaque_value);
 
 void rfc822parse_close (rfc822parse_t msg);
 
+void rfc822parse_set_body_cb (rfc822parse_t msg,
+                              rfc822parse_body_cb_t cb, void *opaque_value);
+void rfc822parse_skip_body (rfc822parse_t msg);
+void rfc822parse_skip_part (rfc822parse_t msg);
+
 void rfc822parse_cancel (rfc822parse_t msg);
 int rfc822parse_finish (rfc822parse_t msg);
 
 int rfc822parse_insert (rfc822parse_t msg,
                         const unsigned char *line, size_t length);
+int rfc822parse_insert_raw (rfc822parse_t msg,
+                            const unsigned char *line, size_t length);
 
 char *rfc822parse_get_field (rfc822parse_t msg, const char *name, int which,
                              size_t *valueoff);
@@ -77,4 +105,9 @@ const char *rfc822parse_query_parameter (rfc822parse_field_t ctx,
 const char *rfc822parse_query_media_type (rfc822parse_field_t ctx,
                                           const char **subtype);
 
+int rfc822parse_export_tree (rfc822parse_t msg, FILE *fp);
+int rfc822parse_import_tree (FILE *fp, rfc822parse_partinfo_t *r_parts,
+                             size_t *r_nparts);
+void rfc822parse_release_tree (rfc822parse_partinfo_t parts, size_t nparts);
+
 #endif /*RFC822PARSE_H */
@@ -25,12 +25,18 @@
 #include <string.h>
 #include <errno.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <assert.h>
 #include <time.h>
 #include <signal.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/wait.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <pthread.h>
+#include <zlib.h>
 
 #include "rfc822parse.h"
 
@@ -45,8 +51,133 @@ static int debug;
 static int opt_match_zip;
 static int opt_match_exe;
 static int opt_match_html;
+static int opt_batch;     /* 1 = mbox, 2 = list of files. */
+static int opt_jobs;
+static int opt_peek_zip;
+static unsigned long opt_zip_limit = 256*1024;
+static const char *opt_cache;
+static size_t opt_cache_limit = 256*1024;
 
 
+/* The things we may find in a message. */
+#define FOUND_ZIP   1
+#define FOUND_EXE   2
+#define FOUND_HTML  4
+#define FOUND_OTHER 8
+
+
+/* The table of signatures used to identify binary data.  It is
+   compiled from the lines below or from a file given with
+   --signatures.  Each line has the fields
+
+     NAME CLASS OFFSET PATTERN[/MASK] CHECK [DESCRIPTION]
+
+   CLASS is one of "zip", "exe" or "other" and is used for the
+   match options.  PATTERN and MASK are given in hex.  CHECK is the
+   name of an additional validator or "-".  The first matching
+   signature wins; thus more specific ones need to go first. */
+static const char *default_signatures[] =
+  {
+    "JAR   zip   0      504b0304          jar  JAR",
+    "ZIP   zip   0      504b0304          -    ZIP",
+    "EXE   exe   0      4d5a              pe   EXE (Windows PE)",
+    "RAR   other 0      526172211a07      -    RAR",
+    "7Z    other 0      377abcaf271c      -    7z",
+    "OLE   other 0      d0cf11e0a1b11ae1  -    OLE (MS Office)",
+    "CAB   other 0      4d53434600000000  -    CAB",
+    "ISO   other 0x8001 4344303031        -    ISO 9660",
+    "SCRIPT other 0     2321              -    Script",
+    NULL
+  };
+
+#define MAX_SIGNATURES 256
+#define MAX_PATTERN    64
+#define MIN_PROBE_SIZE 1000   /* Sufficient for most signatures.  */
+#define MAX_PROBE_SIZE 65536
+
+struct signature_s
+{
+  char *name;
+  char *desc;
+  unsigned int class;   /* FOUND_ flag. */
+  size_t offset;
+  size_t length;
+  int (*check) (const unsigned char *buffer, size_t buflen);
+  unsigned char pattern[MAX_PATTERN];
+  unsigned char mask[MAX_PATTERN];
+};
+
+static struct signature_s signatures[MAX_SIGNATURES];
+static int nsignatures;
+
+/* Signatures at offset 0 are indexed by their first byte; they are
+   stored at SIGINDEX[SIGJUMP[C] .. SIGJUMP[C+1]-1].  All others are
+   listed in OTHERSIGS.  The lists are sorted by table order.  */
+static unsigned short sigjump[257];
+static unsigned short sigindex[MAX_SIGNATURES];
+static unsigned short othersigs[MAX_SIGNATURES];
+static int nothersigs;
+
+/* The number of bytes we need to decode for the probe. */
+static size_t probe_size = MIN_PROBE_SIZE;
+
+/* Limits for looking into ZIP archives. */
+#define ZIP_MAX_DEPTH    3
+#define ZIP_MAX_MEMBERS  10000
+
+/* The verdict cache maps a keyed hash of the decoded content and the
+   length of an attachment to the signatures found in it.  Only parts
+   of up to OPT_CACHE_LIMIT bytes are cached; they are buffered and
+   only processed if they are not found in the cache.  The cache is a
+   set associative table in a shared memory mapped file; each set is
+   replaced in LRU order.  */
+#define VCACHE_MAGIC        "SCRUTVC1"
+#define VCACHE_SETS         1024
+#define VCACHE_WAYS         8
+#define VCACHE_MAX_REPORTS  4
+#define VCACHE_MEMBER_LEN   46
+
+enum vcache_states
+  {
+    VC_NONE = 0,    /* Not using the cache for this part.  */
+    VC_BUFFERING,   /* Buffering the part.  */
+    VC_KEYED        /* Not in the cache; store it at the end.  */
+  };
+
+struct vcache_report_s
+{
+  unsigned short idx;                 /* Signature index.  */
+  char member[VCACHE_MEMBER_LEN];     /* ZIP member name or empty.  */
+};
+
+struct vcache_entry_s
+{
+  uint64_t key;        /* 0 for an unused slot.  */
+  uint32_t stamp;      /* Time of the last use.  */
+  uint32_t nreports;
+  struct vcache_report_s reports[VCACHE_MAX_REPORTS];
+};
+
+struct vcache_header_s
+{
+  char magic[8];
+  uint32_t nsets;
+  uint32_t ways;
+  uint64_t config;     /* Hash of the options affecting the verdicts. */
+  uint64_t secret[2];  /* Key for the hash function.  */
+  uint32_t clock;      /* Incremented with each use.  */
+  uint32_t reserved;
+};
+
+/* State of a SipHash-2-4 computation.  */
+struct siphash_s
+{
+  uint64_t v0, v1, v2, v3;
+  unsigned char buf[8];
+  unsigned int buflen;
+  uint64_t total;
+};
+
 enum mime_types 
   {
     MT_NONE = 0,
@@ -67,20 +198,41 @@ enum transfer_encodings
 struct parse_info_s {
   enum mime_types mime_type;
   enum transfer_encodings transfer_encoding;
-  int test_base64; /* Set if we should decode and test base64 data. */
-  int got_probe;
+  int probing;    /* Set if we are collecting decoded data to test. */
   int no_mime;    /* Set if this is not a MIME message. */
   int top_seen;
   int wk_seen;
+  int error;          /* Errno of a fatal error or 0.  */
+  unsigned int found; /* FOUND_ flags. */
+  int matched;        /* Set if a match option matched. */
+  unsigned char sigseen[MAX_SIGNATURES/8]; /* Bit vector of signatures. */
+  size_t probelen;
+  size_t probesize;
+  unsigned char *probe; /* The first decoded bytes of a part. */
+  struct zipwalk_s *zipwalk; /* Used to look into a ZIP archive. */
+  enum vcache_states vcstate;
+  unsigned char *vcbuf;      /* Buffer for the part or NULL.  */
+  size_t vclen;              /* Number of bytes buffered.  */
+  uint64_t vckey;
+  unsigned int nreports;     /* Reports of the part for the cache.  */
+  struct vcache_report_s reports[VCACHE_MAX_REPORTS];
 };
 
 
-/* Base64 conversion tables. */
-static unsigned char bintoasc[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
-                                  "abcdefghijklmnopqrstuvwxyz"
-			          "0123456789+/";
-static unsigned char asctobin[256]; /* runtime initialized */
 
+/* In batch mode a worker collects the output for the current job in
+   these streams so that it can be printed in one piece.  Otherwise
+   they are NULL and stdout and stderr are used.  */
+static __thread FILE *job_out;
+static __thread FILE *job_err;
+static __thread const char *job_label;
+
+/* Return the stream for normal and informational output.  */
+static FILE *
+outfp (void)
+{
+  return job_out? job_out : stdout;
+}
 
 
 /* Print diagnostic message and exit with failure. */
@@ -107,6 +259,16 @@ err (const char *format, ...)
 {
   va_list arg_ptr;
 
+  if (job_err)
+    {
+      fprintf (job_err, "%s: %s: ", PGM, job_label);
+      va_start (arg_ptr, format);
+      vfprintf (job_err, format, arg_ptr);
+      va_end (arg_ptr);
+      putc ('\n', job_err);
+      return;
+    }
+
   fflush (stdout);
   fprintf (stderr, "%s: ", PGM);
 
@@ -164,95 +326,1221 @@ err (const char *format, ...)
 /* } */
 
 
-/* Simple but sufficient and locale independend lowercase function. */
+/* Simple but sufficient and locale independend lowercase function. */
+static void
+lowercase_string (unsigned char *string)
+{
+  for (; *string; string++)
+    if (*string >= 'A' && *string <= 'Z')
+      *string = *string - 'A' + 'a';
+}
+
+
+static void vcache_store (struct parse_info_s *info);
+
+
+/* Record that WHAT has been found.  In standard mode we print it
+   right away and exit on a match; in batch mode a verdict is printed
+   after the message has been processed. */
+static void
+report (struct parse_info_s *info, unsigned int what, const char *desc,
+        int match)
+{
+  info->found |= what;
+  if (match)
+    info->matched = 1;
+  if (opt_batch)
+    return;
+  if (!quiet)
+    fprintf (outfp (), "%s\n", desc);
+  if (match)
+    {
+      vcache_store (info);
+      exit (0);
+    }
+}
+
+
+
+
+/* Given a Buffer starting with the magic MZ, check whethere thsi is a
+   Windows PE executable. */
+static int
+is_windows_pe (const unsigned char *buffer, size_t buflen)
+{
+  unsigned long off;
+
+  if ( buflen <= 132 )
+    return 0;
+  /* The offset is little endian. */
+  off = ((buffer[0x3c]) | (buffer[0x3d] << 8)
+         | (buffer[0x3e] << 16) | (buffer[0x3f] << 24));
+  return (off < buflen - 4 && !memcmp (buffer+off, "PE\0", 4));
+}
+
+
+/* Given a buffer with a ZIP local file header, check whether this is
+   a Java archive.  */
+static int
+is_jar (const unsigned char *buffer, size_t buflen)
+{
+  size_t namelen;
+
+  if (buflen < 30)
+    return 0;
+  namelen = buffer[26] | (buffer[27] << 8);
+  return (namelen >= 9 && 30 + namelen <= buflen
+          && !memcmp (buffer+30, "META-INF/", 9));
+}
+
+
+/* The validators which may be used in a signature.  */
+static struct
+{
+  const char *name;
+  int (*check) (const unsigned char *buffer, size_t buflen);
+} validators[] =
+  {
+    { "pe",  is_windows_pe },
+    { "jar", is_jar },
+    { NULL, NULL }
+  };
+
+
+/* Parse a hex string of at most MAXLEN bytes from S into BUFFER.
+   Returns the number of bytes or -1 on error. */
+static int
+parse_hex (const char *s, unsigned char *buffer, int maxlen)
+{
+  int n, c, hi;
+
+  for (n=0; *s; n++)
+    {
+      if (n >= maxlen)
+        return -1;
+      for (hi=1, c=0; hi >= 0; hi--, s++)
+        {
+          if (*s >= '0' && *s <= '9')
+            c |= (*s - '0') << (hi*4);
+          else if (*s >= 'a' && *s <= 'f')
+            c |= (*s - 'a' + 10) << (hi*4);
+          else if (*s >= 'A' && *s <= 'F')
+            c |= (*s - 'A' + 10) << (hi*4);
+          else
+            return -1;
+        }
+      buffer[n] = c;
+    }
+  return n;
+}
+
+
+/* Add the signature described by LINE to the table.  FNAME and
+   LINENO are used for diagnostics. */
+static void
+add_signature (char *line, const char *fname, unsigned int lineno)
+{
+  static const char delim[] = " \t\r\n";
+  struct signature_s *sig;
+  char *name, *class, *offset, *pattern, *check, *desc, *mask, *endp;
+  int i, n;
+
+  name = strtok (line, delim);
+  if (!name || *name == '#')
+    return;  /* Empty or comment line.  */
+  class = strtok (NULL, delim);
+  offset = strtok (NULL, delim);
+  pattern = strtok (NULL, delim);
+  check = strtok (NULL, delim);
+  desc = strtok (NULL, "\r\n");
+  if (!check)
+    die ("%s:%u: missing fields", fname, lineno);
+  if (nsignatures >= MAX_SIGNATURES)
+    die ("%s:%u: too many signatures", fname, lineno);
+  sig = signatures + nsignatures;
+  memset (sig, 0, sizeof *sig);
+
+  if (!strcmp (class, "zip"))
+    sig->class = FOUND_ZIP;
+  else if (!strcmp (class, "exe"))
+    sig->class = FOUND_EXE;
+  else if (!strcmp (class, "other"))
+    sig->class = FOUND_OTHER;
+  else
+    die ("%s:%u: invalid class `%s'", fname, lineno, class);
+
+  sig->offset = strtoul (offset, &endp, 0);
+  if (*endp)
+    die ("%s:%u: invalid offset `%s'", fname, lineno, offset);
+
+  if ((mask = strchr (pattern, '/')))
+    *mask++ = 0;
+  n = parse_hex (pattern, sig->pattern, MAX_PATTERN);
+  if (n < 1)
+    die ("%s:%u: invalid pattern", fname, lineno);
+  sig->length = n;
+  if (!mask)
+    memset (sig->mask, 0xff, n);
+  else if (parse_hex (mask, sig->mask, MAX_PATTERN) != n)
+    die ("%s:%u: invalid mask", fname, lineno);
+  for (i=0; i < n; i++)
+    sig->pattern[i] &= sig->mask[i];
+  if (sig->offset + sig->length > MAX_PROBE_SIZE)
+    die ("%s:%u: offset too large", fname, lineno);
+
+  if (strcmp (check, "-"))
+    {
+      for (i=0; validators[i].name; i++)
+        if (!strcmp (validators[i].name, check))
+          break;
+      if (!validators[i].name)
+        die ("%s:%u: unknown check `%s'", fname, lineno, check);
+      sig->check = validators[i].check;
+    }
+
+  while (desc && (*desc == ' ' || *desc == '\t'))
+    desc++;
+  sig->name = strdup (name);
+  sig->desc = strdup (desc && *desc? desc : name);
+  if (!sig->name || !sig->desc)
+    die ("out of core: %s", strerror (errno));
+  nsignatures++;
+}
+
+
+/* Read the signatures from FNAME or use the default ones if FNAME is
+   NULL.  Then build the lookup tables. */
+static void
+load_signatures (const char *fname)
+{
+  char line[1024];
+  unsigned int lineno = 0;
+  unsigned short count[256];
+  int i, c;
+
+  if (!fname)
+    {
+      for (i=0; default_signatures[i]; i++)
+        {
+          strcpy (line, default_signatures[i]);
+          add_signature (line, "[default]", i+1);
+        }
+    }
+  else
+    {
+      FILE *fp = fopen (fname, "r");
+
+      if (!fp)
+        die ("can't open `%s': %s", fname, strerror (errno));
+      while (fgets (line, sizeof line, fp))
+        add_signature (line, fname, ++lineno);
+      if (ferror (fp))
+        die ("error reading `%s': %s", fname, strerror (errno));
+      fclose (fp);
+    }
+
+  /* Build the first byte jump table using a counting sort.  A
+     signature is only put into it if the first byte is not masked. */
+  memset (count, 0, sizeof count);
+  for (i=0; i < nsignatures; i++)
+    {
+      if (!signatures[i].offset && signatures[i].mask[0] == 0xff)
+        count[signatures[i].pattern[0]]++;
+      else
+        othersigs[nothersigs++] = i;
+      if (signatures[i].offset + signatures[i].length > probe_size)
+        probe_size = signatures[i].offset + signatures[i].length;
+    }
+  sigjump[0] = 0;
+  for (c=0; c < 256; c++)
+    sigjump[c+1] = sigjump[c] + count[c];
+  memset (count, 0, sizeof count);
+  for (i=0; i < nsignatures; i++)
+    if (!signatures[i].offset && signatures[i].mask[0] == 0xff)
+      {
+        c = signatures[i].pattern[0];
+        sigindex[sigjump[c] + count[c]++] = i;
+      }
+}
+
+
+/* Return true if signature SIG matches BUFFER.  */
+static int
+match_signature (const struct signature_s *sig,
+                 const unsigned char *buffer, size_t buflen)
+{
+  const unsigned char *p;
+  size_t i;
+
+  if (sig->offset + sig->length > buflen)
+    return 0;
+  p = buffer + sig->offset;
+  for (i=0; i < sig->length; i++)
+    if ((p[i] & sig->mask[i]) != sig->pattern[i])
+      return 0;
+  return !sig->check || sig->check (buffer, buflen);
+}
+
+
+/* Return the index of the first signature matching BUFFER or -1. */
+static int
+find_signature (const unsigned char *buffer, size_t buflen)
+{
+  int i, j, jend, idx;
+
+  /* Merge the candidates for the first byte with the other
+     signatures so that we test them in table order.  */
+  i = j = jend = 0;
+  if (buflen)
+    {
+      j = sigjump[*buffer];
+      jend = sigjump[*buffer + 1];
+    }
+  while (i < nothersigs || j < jend)
+    {
+      if (j < jend && (i >= nothersigs || sigindex[j] < othersigs[i]))
+        idx = sigindex[j++];
+      else
+        idx = othersigs[i++];
+      if (match_signature (signatures + idx, buffer, buflen))
+        return idx;
+    }
+  return -1;
+}
+
+
+/* Report that signature IDX has been found.  If MEMBER is not NULL
+   it is the name of the ZIP member where it was found.  */
+static void
+report_signature (struct parse_info_s *info, int idx, const char *member)
+{
+  const struct signature_s *sig = signatures + idx;
+  char desc[400];
+
+  info->sigseen[idx/8] |= 1 << (idx % 8);
+  if (info->vcstate != VC_NONE)
+    {
+      /* Record it for the cache.  Parts with too many findings or
+         long member names are not cached.  */
+      if (info->nreports < VCACHE_MAX_REPORTS
+          && (!member || strlen (member) < VCACHE_MEMBER_LEN))
+        {
+          info->reports[info->nreports].idx = idx;
+          strcpy (info->reports[info->nreports].member, member? member:"");
+          info->nreports++;
+        }
+      else
+        info->vcstate = VC_NONE;
+    }
+  if (member)
+    snprintf (desc, sizeof desc, "%s in ZIP member `%s'", sig->desc, member);
+  else
+    snprintf (desc, sizeof desc, "%s", sig->desc);
+  report (info, sig->class, desc,
+          ((sig->class == FOUND_ZIP && opt_match_zip)
+           || (sig->class == FOUND_EXE && opt_match_exe)));
+}
+
+
+/* See whether we can identify the binary data in BUFFER.  Returns
+   the index of the signature or -1.  */
+static int
+identify_binary (struct parse_info_s *info,
+                 const unsigned char *buffer, size_t buflen)
+{
+  int idx;
+
+  idx = find_signature (buffer, buflen);
+  if (idx != -1)
+    report_signature (info, idx, NULL);
+  return idx;
+}
+
+
+
+/* SipHash-2-4 as described by Aumasson and Bernstein.  We use a keyed
+   hash so that nobody can craft a collision with a cached attachment
+   without knowing the secret in the cache file.  */
+#define ROTL64(x,n) (((x) << (n)) | ((x) >> (64 - (n))))
+#define SIPROUND(s)                                                     \
+  do {                                                                  \
+    (s)->v0 += (s)->v1; (s)->v1 = ROTL64 ((s)->v1, 13);                 \
+    (s)->v1 ^= (s)->v0; (s)->v0 = ROTL64 ((s)->v0, 32);                 \
+    (s)->v2 += (s)->v3; (s)->v3 = ROTL64 ((s)->v3, 16);                 \
+    (s)->v3 ^= (s)->v2;                                                 \
+    (s)->v0 += (s)->v3; (s)->v3 = ROTL64 ((s)->v3, 21);                 \
+    (s)->v3 ^= (s)->v0;                                                 \
+    (s)->v2 += (s)->v1; (s)->v1 = ROTL64 ((s)->v1, 17);                 \
+    (s)->v1 ^= (s)->v2; (s)->v2 = ROTL64 ((s)->v2, 32);                 \
+  } while (0)
+
+static uint64_t
+get_le64 (const unsigned char *p)
+{
+  return ((uint64_t)p[0] | ((uint64_t)p[1] << 8) | ((uint64_t)p[2] << 16)
+          | ((uint64_t)p[3] << 24) | ((uint64_t)p[4] << 32)
+          | ((uint64_t)p[5] << 40) | ((uint64_t)p[6] << 48)
+          | ((uint64_t)p[7] << 56));
+}
+
+
+static void
+siphash_init (struct siphash_s *s, const uint64_t *key)
+{
+  s->v0 = key[0] ^ 0x736f6d6570736575ULL;
+  s->v1 = key[1] ^ 0x646f72616e646f6dULL;
+  s->v2 = key[0] ^ 0x6c7967656e657261ULL;
+  s->v3 = key[1] ^ 0x7465646279746573ULL;
+  s->buflen = 0;
+  s->total = 0;
+}
+
+
+static void
+siphash_block (struct siphash_s *s, uint64_t m)
+{
+  s->v3 ^= m;
+  SIPROUND (s);
+  SIPROUND (s);
+  s->v0 ^= m;
+}
+
+
+static void
+siphash_write (struct siphash_s *s, const void *buffer, size_t length)
+{
+  const unsigned char *p = buffer;
+
+  s->total += length;
+  if (s->buflen)
+    {
+      for (; length && s->buflen < 8; length--)
+        s->buf[s->buflen++] = *p++;
+      if (s->buflen < 8)
+        return;
+      siphash_block (s, get_le64 (s->buf));
+      s->buflen = 0;
+    }
+  for (; length >= 8; p += 8, length -= 8)
+    siphash_block (s, get_le64 (p));
+  memcpy (s->buf, p, length);
+  s->buflen = length;
+}
+
+
+static uint64_t
+siphash_final (struct siphash_s *s)
+{
+  uint64_t m = (uint64_t)s->total << 56;
+  unsigned int i;
+
+  for (i=0; i < s->buflen; i++)
+    m |= (uint64_t)s->buf[i] << (8*i);
+  siphash_block (s, m);
+  s->v2 ^= 0xff;
+  SIPROUND (s);
+  SIPROUND (s);
+  SIPROUND (s);
+  SIPROUND (s);
+  return s->v0 ^ s->v1 ^ s->v2 ^ s->v3;
+}
+
+
+/* The verdict cache.  All access to the mapped file is done while
+   holding LOCK and an flock on FD so that several processes may
+   share the file.  */
+static struct
+{
+  pthread_mutex_t lock;
+  int fd;
+  struct vcache_header_s *hdr;  /* NULL if the cache is not used.  */
+  struct vcache_entry_s *entries;
+  size_t mapsize;
+  uint64_t secret[2];
+  unsigned long lookups, hits, stores;
+} vcache = { PTHREAD_MUTEX_INITIALIZER, -1, NULL, NULL, 0, { 0, 0 },
+              0, 0, 0 };
+
+
+/* Return a hash over all settings which have an effect on the
+   verdicts.  A cache file with a different value is reset.  */
+static uint64_t
+vcache_config_id (void)
+{
+  static const uint64_t nullkey[2];
+  struct siphash_s s;
+  unsigned long v[5];
+  int i, j;
+
+  siphash_init (&s, nullkey);
+  for (i=0; i < nsignatures; i++)
+    {
+      const struct signature_s *sig = signatures + i;
+
+      siphash_write (&s, sig->name, strlen (sig->name) + 1);
+      siphash_write (&s, sig->desc, strlen (sig->desc) + 1);
+      v[0] = sig->class;
+      v[1] = sig->offset;
+      v[2] = sig->length;
+      for (j=0; validators[j].name; j++)
+        if (validators[j].check == sig->check)
+          break;
+      v[3] = j;
+      siphash_write (&s, v, 4 * sizeof *v);
+      siphash_write (&s, sig->pattern, sig->length);
+      siphash_write (&s, sig->mask, sig->length);
+    }
+  v[0] = probe_size;
+  v[1] = opt_peek_zip;
+  v[2] = opt_zip_limit;
+  v[3] = opt_cache_limit;
+  v[4] = sizeof (struct vcache_entry_s);
+  siphash_write (&s, v, 5 * sizeof *v);
+  return siphash_final (&s);
+}
+
+
+/* Print the cache statistics.  */
+static void
+vcache_show_stats (void)
+{
+  if (!vcache.hdr)
+    return;
+  pthread_mutex_lock (&vcache.lock);
+  printf ("# cache: %lu lookups, %lu hits (%.1f%%), %lu stores\n",
+          vcache.lookups, vcache.hits,
+          vcache.lookups? 100.0 * vcache.hits / vcache.lookups : 0.0,
+          vcache.stores);
+  pthread_mutex_unlock (&vcache.lock);
+}
+
+
+/* Open or create the cache file FNAME and map it.  */
+static void
+vcache_open (const char *fname)
+{
+  struct vcache_header_s hdr;
+  struct stat st, st2;
+  uint64_t config = vcache_config_id ();
+  size_t size;
+  void *map;
+  char *tmpname;
+  int fd, rfd, tfd;
+
+  size = (sizeof hdr
+          + (size_t)VCACHE_SETS * VCACHE_WAYS * sizeof *vcache.entries);
+  for (;;)
+    {
+      fd = open (fname, O_RDWR|O_CREAT, 0600);
+      if (fd == -1)
+        die ("can't open `%s': %s", fname, strerror (errno));
+      if (flock (fd, LOCK_EX))
+        die ("can't lock `%s': %s", fname, strerror (errno));
+      if (fstat (fd, &st))
+        die ("can't stat `%s': %s", fname, strerror (errno));
+      /* Try again if another process replaced the file while we
+         were waiting for the lock.  */
+      if (!stat (fname, &st2)
+          && st2.st_dev == st.st_dev && st2.st_ino == st.st_ino)
+        break;
+      close (fd);
+    }
+  if (st.st_size != size
+      || pread (fd, &hdr, sizeof hdr, 0) != sizeof hdr
+      || memcmp (hdr.magic, VCACHE_MAGIC, 8)
+      || hdr.nsets != VCACHE_SETS || hdr.ways != VCACHE_WAYS
+      || hdr.config != config)
+    {
+      /* Create a new cache.  Other processes may still have the old
+         file mapped; thus we don't truncate it but replace it.  */
+      if (verbose)
+        printf ("# initializing cache `%s'\n", fname);
+      memset (&hdr, 0, sizeof hdr);
+      memcpy (hdr.magic, VCACHE_MAGIC, 8);
+      hdr.nsets = VCACHE_SETS;
+      hdr.ways = VCACHE_WAYS;
+      hdr.config = config;
+      rfd = open ("/dev/urandom", O_RDONLY);
+      if (rfd == -1
+          || read (rfd, hdr.secret, sizeof hdr.secret) != sizeof hdr.secret)
+        die ("error reading /dev/urandom: %s", strerror (errno));
+      close (rfd);
+      tmpname = malloc (strlen (fname) + 5);
+      if (!tmpname)
+        die ("out of core: %s", strerror (errno));
+      strcpy (stpcpy (tmpname, fname), ".tmp");
+      tfd = open (tmpname, O_RDWR|O_CREAT|O_TRUNC, 0600);
+      if (tfd == -1 || flock (tfd, LOCK_EX) || ftruncate (tfd, size)
+          || pwrite (tfd, &hdr, sizeof hdr, 0) != sizeof hdr
+          || rename (tmpname, fname))
+        die ("error writing `%s': %s", tmpname, strerror (errno));
+      free (tmpname);
+      close (fd);
+      fd = tfd;
+    }
+  map = mmap (NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+  if (map == MAP_FAILED)
+    die ("can't map `%s': %s", fname, strerror (errno));
+  flock (fd, LOCK_UN);
+
+  vcache.fd = fd;
+  vcache.hdr = map;
+  vcache.entries = (struct vcache_entry_s *)(vcache.hdr + 1);
+  vcache.mapsize = size;
+  memcpy (vcache.secret, hdr.secret, sizeof vcache.secret);
+  if (verbose)
+    atexit (vcache_show_stats);
+}
+
+
+/* Start buffering the body of the current part.  */
+static void
+vcache_start (struct parse_info_s *info)
+{
+  info->vcstate = info->vcbuf? VC_BUFFERING : VC_NONE;
+  info->vclen = 0;
+  info->nreports = 0;
+}
+
+
+/* Look up the completely buffered part.  On a hit the cached entry
+   is copied to R_ENTRY and true is returned.  */
+static int
+vcache_lookup (struct parse_info_s *info, struct vcache_entry_s *r_entry)
+{
+  struct vcache_entry_s *e;
+  struct siphash_s hash;
+  uint64_t length = info->vclen;
+  int i, found = 0;
+
+  siphash_init (&hash, vcache.secret);
+  siphash_write (&hash, info->vcbuf, info->vclen);
+  siphash_write (&hash, &length, sizeof length);
+  info->vckey = siphash_final (&hash);
+  if (!info->vckey)
+    info->vckey = 1;
+  info->vcstate = VC_KEYED;
+
+  pthread_mutex_lock (&vcache.lock);
+  flock (vcache.fd, LOCK_EX);
+  e = vcache.entries + (info->vckey % VCACHE_SETS) * VCACHE_WAYS;
+  for (i=0; i < VCACHE_WAYS; i++, e++)
+    if (e->key == info->vckey)
+      {
+        if (e->nreports <= VCACHE_MAX_REPORTS)
+          {
+            e->stamp = ++vcache.hdr->clock;
+            *r_entry = *e;
+            found = 1;
+          }
+        break;
+      }
+  flock (vcache.fd, LOCK_UN);
+  vcache.lookups++;
+  if (found)
+    vcache.hits++;
+  pthread_mutex_unlock (&vcache.lock);
+
+  if (found)
+    info->vcstate = VC_NONE;
+  return found;
+}
+
+
+/* Store the verdict for the current part if it was looked up and not
+   found.  */
+static void
+vcache_store (struct parse_info_s *info)
+{
+  struct vcache_entry_s *e, *slot;
+  int i;
+
+  if (info->vcstate != VC_KEYED)
+    return;
+  info->vcstate = VC_NONE;
+
+  pthread_mutex_lock (&vcache.lock);
+  flock (vcache.fd, LOCK_EX);
+  e = vcache.entries + (info->vckey % VCACHE_SETS) * VCACHE_WAYS;
+  slot = e;
+  for (i=0; i < VCACHE_WAYS; i++, e++)
+    {
+      if (e->key == info->vckey)
+        {
+          slot = e;
+          break;
+        }
+      if (!e->key)
+        {
+          if (slot->key)
+            slot = e;
+        }
+      else if (slot->key && e->stamp < slot->stamp)
+        slot = e;
+    }
+  slot->key = info->vckey;
+  slot->stamp = ++vcache.hdr->clock;
+  slot->nreports = info->nreports;
+  memcpy (slot->reports, info->reports, sizeof slot->reports);
+  flock (vcache.fd, LOCK_UN);
+  vcache.stores++;
+  pthread_mutex_unlock (&vcache.lock);
+}
+
+
+/* Buffer the decoded DATA of the current part.  Returns false if
+   the part is too large for the cache; the caller then needs to
+   process the data buffered so far.  */
+static int
+vcache_feed (struct parse_info_s *info,
+             const unsigned char *data, size_t length)
+{
+  if (length > opt_cache_limit - info->vclen)
+    {
+      info->vcstate = VC_NONE;
+      return 0;
+    }
+  memcpy (info->vcbuf + info->vclen, data, length);
+  info->vclen += length;
+  return 1;
+}
+
+
+
+/* To look into ZIP archives we walk over the local file headers in
+   the decoded stream; the central directory at the end is not used.
+   Only the first bytes of each member are inflated to test them for
+   known signatures; nested archives are handled by a child walker.
+   All walkers of an archive share a limit on the inflated bytes. */
+enum zipwalk_states
+  {
+    ZW_HEADER,      /* Collecting a local file header.  */
+    ZW_NAME,        /* Collecting the file name.  */
+    ZW_EXTRA,       /* Skipping the extra field.  */
+    ZW_DATA,        /* Processing the member data.  */
+    ZW_DESCRIPTOR,  /* Reading the start of a data descriptor.  */
+    ZW_SKIP,        /* Skipping the rest of the data descriptor.  */
+    ZW_DONE
+  };
+
+struct zipwalk_s
+{
+  struct parse_info_s *info;
+  struct zipwalk_s *root;     /* The outermost walker.  */
+  struct zipwalk_s *child;    /* Walker for a nested archive.  */
+  int depth;
+  enum zipwalk_states state;
+  unsigned long inflated;     /* Only used in the root.  */
+  unsigned int nmembers;
+  unsigned char hdr[30];
+  size_t hdrlen;
+  unsigned int flags;
+  unsigned int method;
+  unsigned long compsize;     /* Remaining compressed bytes.  */
+  int size_known;
+  size_t namelen, namewant;
+  char name[256];
+  size_t skip;                /* Bytes to skip of the extra field etc. */
+  int zs_active;
+  z_stream zs;
+  size_t probelen;
+  int probe_done;
+  unsigned char probe[MIN_PROBE_SIZE];
+};
+typedef struct zipwalk_s *zipwalk_t;
+
+static int zipwalk_feed (zipwalk_t zw, const unsigned char *data,
+                         size_t length);
+
+
+static zipwalk_t
+zipwalk_new (struct parse_info_s *info, zipwalk_t parent)
+{
+  zipwalk_t zw;
+
+  zw = calloc (1, sizeof *zw);
+  if (!zw)
+    {
+      info->error = errno;
+      return NULL;
+    }
+  zw->info = info;
+  zw->root = parent? parent->root : zw;
+  zw->depth = parent? parent->depth + 1 : 0;
+  zw->state = ZW_HEADER;
+  return zw;
+}
+
+
+static void
+zipwalk_release (zipwalk_t zw)
+{
+  if (!zw)
+    return;
+  zipwalk_release (zw->child);
+  if (zw->zs_active)
+    inflateEnd (&zw->zs);
+  free (zw);
+}
+
+
+/* Test the collected first bytes of the current member.  */
+static void
+zipwalk_test_member (zipwalk_t zw)
+{
+  int idx;
+
+  zw->probe_done = 1;
+  idx = find_signature (zw->probe, zw->probelen);
+  if (idx == -1)
+    return;
+  report_signature (zw->info, idx, zw->name);
+  if (signatures[idx].class == FOUND_ZIP && zw->depth + 1 < ZIP_MAX_DEPTH)
+    {
+      zw->child = zipwalk_new (zw->info, zw);
+      if (zw->child && zipwalk_feed (zw->child, zw->probe, zw->probelen))
+        {
+          zipwalk_release (zw->child);
+          zw->child = NULL;
+        }
+    }
+}
+
+
+/* Process LENGTH bytes of the uncompressed member DATA.  */
+static void
+zipwalk_member_data (zipwalk_t zw, const unsigned char *data, size_t length)
+{
+  size_t n;
+
+  if (!zw->probe_done)
+    {
+      n = sizeof zw->probe - zw->probelen;
+      if (n > length)
+        n = length;
+      memcpy (zw->probe + zw->probelen, data, n);
+      zw->probelen += n;
+      if (zw->probelen < sizeof zw->probe)
+        return;
+      zipwalk_test_member (zw);
+      data += n;
+      length -= n;
+    }
+  if (zw->child && length && zipwalk_feed (zw->child, data, length))
+    {
+      zipwalk_release (zw->child);
+      zw->child = NULL;
+    }
+}
+
+
+/* Return true if we still need the uncompressed data of the current
+   member.  */
+static int
+zipwalk_want_data (zipwalk_t zw)
+{
+  return !zw->probe_done || zw->child;
+}
+
+
+/* We are done with the uncompressed data of the current member.  */
+static void
+zipwalk_end_data (zipwalk_t zw)
+{
+  if (!zw->probe_done)
+    zipwalk_test_member (zw);
+  zipwalk_release (zw->child);
+  zw->child = NULL;
+  if (zw->zs_active)
+    {
+      inflateEnd (&zw->zs);
+      zw->zs_active = 0;
+    }
+}
+
+
+/* Finish the current member.  */
+static void
+zipwalk_end_member (zipwalk_t zw)
+{
+  zipwalk_end_data (zw);
+  zw->hdrlen = 0;
+  if ((zw->flags & 8))
+    {
+      zw->state = ZW_DESCRIPTOR;
+      zw->skip = 4;
+    }
+  else
+    zw->state = ZW_HEADER;
+}
+
+
+/* Start processing the data of a member.  Returns false if we can't
+   continue to walk the archive.  */
+static int
+zipwalk_start_data (zipwalk_t zw)
+{
+  zw->probelen = 0;
+  zw->probe_done = 0;
+  zw->state = ZW_DATA;
+  if ((zw->flags & 1))
+    zw->probe_done = 1;  /* Encrypted - we can only skip it.  */
+  else if (zw->method == 8)
+    {
+      memset (&zw->zs, 0, sizeof zw->zs);
+      if (inflateInit2 (&zw->zs, -MAX_WBITS) != Z_OK)
+        return 0;
+      zw->zs_active = 1;
+      return 1;
+    }
+  else if (zw->method)
+    zw->probe_done = 1;  /* Unknown method.  */
+
+  /* Without the size we can only find the end of deflated data. */
+  return zw->size_known;
+}
+
+
+/* Inflate up to LENGTH bytes of DATA.  Returns the number of bytes
+   consumed or -1 if we need to stop.  */
+static long
+zipwalk_inflate (zipwalk_t zw, const unsigned char *data, size_t length)
+{
+  unsigned char buffer[4096];
+  zipwalk_t root = zw->root;
+  int rc;
+  size_t n;
+
+  zw->zs.next_in = (unsigned char *)data;
+  zw->zs.avail_in = length;
+  do
+    {
+      if (root->inflated >= opt_zip_limit)
+        {
+          if (verbose)
+            fprintf (outfp (), "# ZIP inflate limit reached\n");
+          return -1;
+        }
+      n = sizeof buffer;
+      if (n > opt_zip_limit - root->inflated)
+        n = opt_zip_limit - root->inflated;
+      zw->zs.next_out = buffer;
+      zw->zs.avail_out = n;
+      rc = inflate (&zw->zs, Z_NO_FLUSH);
+      if (rc != Z_OK && rc != Z_STREAM_END && rc != Z_BUF_ERROR)
+        return -1;
+      n -= zw->zs.avail_out;
+      root->inflated += n;
+      zipwalk_member_data (zw, buffer, n);
+      if (rc == Z_STREAM_END)
+        {
+          /* If we know the size the caller skips any garbage after
+             the deflated data.  */
+          n = length - zw->zs.avail_in;
+          if (zw->size_known)
+            zipwalk_end_data (zw);
+          else
+            zipwalk_end_member (zw);
+          return n;
+        }
+    }
+  while (zw->zs.avail_in
+         && (zipwalk_want_data (zw) || !zw->size_known));
+
+  return length - zw->zs.avail_in;
+}
+
+
+/* Feed LENGTH bytes of the archive in DATA to the walker.  Returns
+   true if we are done with this archive.  */
+static int
+zipwalk_feed (zipwalk_t zw, const unsigned char *data, size_t length)
+{
+  const unsigned char *h = zw->hdr;
+  size_t n;
+  long nread;
+
+  while (length && zw->state != ZW_DONE)
+    {
+      switch (zw->state)
+        {
+        case ZW_HEADER:
+          n = sizeof zw->hdr - zw->hdrlen;
+          if (n > length)
+            n = length;
+          memcpy (zw->hdr + zw->hdrlen, data, n);
+          zw->hdrlen += n;
+          data += n;
+          length -= n;
+          if (zw->hdrlen >= 4 && memcmp (h, "PK\x03\x04", 4))
+            {
+              zw->state = ZW_DONE; /* Central directory or garbage.  */
+              break;
+            }
+          if (zw->hdrlen < sizeof zw->hdr)
+            break;
+          if (++zw->nmembers > ZIP_MAX_MEMBERS)
+            {
+              zw->state = ZW_DONE;
+              break;
+            }
+          zw->flags    = h[6] | (h[7] << 8);
+          zw->method   = h[8] | (h[9] << 8);
+          zw->compsize = (h[18] | (h[19] << 8) | (h[20] << 16)
+                          | ((unsigned long)h[21] << 24));
+          zw->size_known = !(zw->flags & 8) || zw->compsize;
+          zw->namewant = h[26] | (h[27] << 8);
+          zw->skip     = h[28] | (h[29] << 8);
+          zw->namelen  = 0;
+          zw->state = ZW_NAME;
+          if (zw->namewant)
+            break;
+          /* fall through */
+        case ZW_NAME:
+          n = zw->namewant - zw->namelen;
+          if (n > length)
+            n = length;
+          if (zw->namelen < sizeof zw->name - 1)
+            memcpy (zw->name + zw->namelen, data,
+                    (zw->namelen + n < sizeof zw->name - 1
+                     ? n : sizeof zw->name - 1 - zw->namelen));
+          zw->namelen += n;
+          data += n;
+          length -= n;
+          if (zw->namelen < zw->namewant)
+            break;
+          zw->name[zw->namelen < sizeof zw->name - 1
+                   ? zw->namelen : sizeof zw->name - 1] = 0;
+          if (verbose)
+            fprintf (outfp (), "# %*sZIP member: %s\n",
+                     zw->depth*2, "", zw->name);
+          zw->state = ZW_EXTRA;
+          /* fall through */
+        case ZW_EXTRA:
+          n = zw->skip < length? zw->skip : length;
+          zw->skip -= n;
+          data += n;
+          length -= n;
+          if (zw->skip)
+            break;
+          if (!zipwalk_start_data (zw))
+            {
+              zw->state = ZW_DONE;
+              break;
+            }
+          if (zw->size_known && !zw->compsize)
+            {
+              zipwalk_end_member (zw);
+              break;
+            }
+          if (!length)
+            break;
+          /* fall through */
+        case ZW_DATA:
+          n = length;
+          if (zw->size_known && n > zw->compsize)
+            n = zw->compsize;
+          if (zw->zs_active && (zipwalk_want_data (zw) || !zw->size_known))
+            {
+              nread = zipwalk_inflate (zw, data, n);
+              if (nread < 0)
+                {
+                  zw->state = ZW_DONE;
+                  break;
+                }
+              n = nread;
+              if (zw->state != ZW_DATA)
+                {
+                  /* End of the deflated stream.  */
+                  data += n;
+                  length -= n;
+                  break;
+                }
+            }
+          else if (!zw->zs_active && zipwalk_want_data (zw))
+            zipwalk_member_data (zw, data, n);
+          data += n;
+          length -= n;
+          if (zw->size_known)
+            {
+              zw->compsize -= n;
+              if (!zw->compsize)
+                zipwalk_end_member (zw);
+            }
+          break;
+
+        case ZW_DESCRIPTOR:
+          /* The descriptor may or may not start with a signature. */
+          n = zw->skip < length? zw->skip : length;
+          memcpy (zw->hdr + 4 - zw->skip, data, n);
+          zw->skip -= n;
+          data += n;
+          length -= n;
+          if (zw->skip)
+            break;
+          zw->skip = memcmp (h, "PK\x07\x08", 4)? 8 : 12;
+          zw->state = ZW_SKIP;
+          break;
+
+        case ZW_SKIP:
+          n = zw->skip < length? zw->skip : length;
+          zw->skip -= n;
+          data += n;
+          length -= n;
+          if (!zw->skip)
+            {
+              zw->hdrlen = 0;
+              zw->state = ZW_HEADER;
+            }
+          break;
+
+        case ZW_DONE:
+          break;
+        }
+    }
+
+  return zw->state == ZW_DONE;
+}
+
+
+/* Start to look into the ZIP archive whose first bytes are in the
+   probe if signature IDX is a ZIP signature.  */
 static void
-lowercase_string (unsigned char *string)
+start_zip_peek (struct parse_info_s *info, int idx)
 {
-  for (; *string; string++)
-    if (*string >= 'A' && *string <= 'Z')
-      *string = *string - 'A' + 'a';
+  if (!opt_peek_zip || idx == -1 || signatures[idx].class != FOUND_ZIP)
+    return;
+  info->zipwalk = zipwalk_new (info, NULL);
+  if (info->zipwalk
+      && zipwalk_feed (info->zipwalk, info->probe, info->probelen))
+    {
+      zipwalk_release (info->zipwalk);
+      info->zipwalk = NULL;
+    }
 }
 
 
-/* Inplace Base64 decoder. Returns the length of the valid databytes
-   in BUFFER. Note, that BUFFER should initially be a C-string. */
-static size_t
-decode_base64 (unsigned char *buffer)
+/* Identify the collected probe data and stop probing.  */
+static void
+test_probe (struct parse_info_s *info)
 {
-  int state, c, value=0;
-  unsigned char *d, *s;
-  
-  for (state=0, d=s=buffer; *s; s++)
+  size_t i;
+
+  info->probing = 0;
+  if (!info->probelen)
+    return;
+  if (debug)
     {
-      if ((c = asctobin[*s]) == 255 )
-        continue;  /* Simply skip invalid base64 characters. */
-      
-      switch (state)
+      fprintf (outfp (), "# %4d bytes base64:", (int)info->probelen);
+      for (i=0; i < info->probelen && i < MIN_PROBE_SIZE; i++)
         {
-        case 0: 
-          value = c << 2;
-          break;
-        case 1:
-          value |= (c>>4)&3;
-          *d++ = value;
-          value = (c<<4)&0xf0;
-          break; 
-        case 2:
-          value |= (c>>2)&15;
-          *d++ = value;
-          value = (c<<6)&0xc0;
-          break; 
-        case 3:
-          value |= c&0x3f;
-          *d++ = value;
-          break; 
+          if (i && !(i % 16))
+            fprintf (outfp (), "\n#            0x%04X:", (unsigned int)i);
+          fprintf (outfp (), " %02X", info->probe[i]);
         }
-      state++;
-      state = state & 3;
+      putc ('\n', outfp ());
     }
+  start_zip_peek (info, identify_binary (info, info->probe, info->probelen));
+}
+
 
-  return d - buffer;
+/* Stop looking into a ZIP archive.  */
+static void
+end_zip_peek (struct parse_info_s *info)
+{
+  zipwalk_release (info->zipwalk);
+  info->zipwalk = NULL;
 }
 
 
-/* Given a Buffer starting with the magic MZ, check whethere thsi is a
-   Windows PE executable. */
+/* Process the decoded DATA of the current part.  Returns true if the
+   rest of the body is not needed.  */
 static int
-is_windows_pe (const unsigned char *buffer, size_t buflen)
+process_body (struct parse_info_s *info,
+              const unsigned char *data, size_t length)
 {
-  unsigned long off;
+  size_t n;
+  int idx;
 
-  if ( buflen < 0x3c + 4 )
-    return 0;
-  /* The offset is little endian. */
-  off = ((buffer[0x3c]) | (buffer[0x3d] << 8)
-         | (buffer[0x3e] << 16) | (buffer[0x3f] << 24));
-  return (off < buflen - 4 && !memcmp (buffer+off, "PE\0", 4));
+  if (info->probing)
+    {
+      n = info->probesize - info->probelen;
+      if (length < n)
+        n = length;
+      memcpy (info->probe + info->probelen, data, n);
+      if (info->probelen < MIN_PROBE_SIZE
+          && info->probelen + n >= MIN_PROBE_SIZE
+          && info->probesize > MIN_PROBE_SIZE
+          && (idx = identify_binary (info, info->probe,
+                                     info->probelen + n)) != -1)
+        {
+          /* Only a few signatures need a larger probe; don't collect
+             more if we already know what it is.  */
+          info->probing = 0;
+          info->probelen += n;
+          start_zip_peek (info, idx);
+        }
+      else
+        {
+          info->probelen += n;
+          if (info->probelen == info->probesize)
+            test_probe (info);  /* We got enough. */
+        }
+      if (info->probing)
+        return 0;
+      data += n;
+      length -= n;
+    }
+
+  if (!info->zipwalk)
+    return 1;
+  if (length && zipwalk_feed (info->zipwalk, data, length))
+    {
+      end_zip_peek (info);
+      return 1;
+    }
+  return 0;
 }
 
 
-/* See whether we can identify the binary data in BUFFER. */
+/* The current part fits into the cache and has been buffered
+   completely.  Take its verdict from the cache or process it now.  */
 static void
-identify_binary (const unsigned char *buffer, size_t buflen)
+vcache_finish (struct parse_info_s *info)
 {
-  if (buflen > 5 && !memcmp (buffer, "PK\x03\x04", 4))
-    {
-      if (!quiet)
-        fputs ("ZIP\n", stdout);
-      if (opt_match_zip)
-        exit (0);
-    }
-  else if (buflen > 132 && buffer[0] == 'M' && buffer[1] == 'Z' 
-           && is_windows_pe (buffer, buflen))
+  struct vcache_entry_s entry;
+  unsigned int i;
+
+  if (info->vcstate != VC_BUFFERING)
+    return;
+  if (!vcache_lookup (info, &entry))
     {
-      if (!quiet)
-        fputs ("EXE (Windows PE)\n", stdout);
-      if (opt_match_exe)
-        exit (0);
+      process_body (info, info->vcbuf, info->vclen);
+      return;
     }
+
+  if (verbose)
+    fprintf (outfp (), "# verdict taken from cache\n");
+  info->probing = 0;
+  for (i=0; i < entry.nreports; i++)
+    if (entry.reports[i].idx < nsignatures)
+      report_signature (info, entry.reports[i].idx,
+                        *entry.reports[i].member? entry.reports[i].member
+                        /**/                    : NULL);
 }
 
 
+/* Finish the processing of the current part.  */
+static void
+end_part (struct parse_info_s *info)
+{
+  vcache_finish (info);
+  if (info->probing)
+    test_probe (info);
+  end_zip_peek (info);
+  vcache_store (info);
+}
+
 
 /* Print the event received by the parser for debugging as comment
    line. */
@@ -278,7 +1566,7 @@ show_event (rfc822parse_event_t event)
     case RFC822PARSE_EPILOGUE: s= "Epilogue"; break;
     default: s= "[unknown event]"; break;
     }
-  printf ("# *** got RFC822 event %s\n", s);
+  fprintf (outfp (), "# *** got RFC822 event %s\n", s);
 }
 
 /* This function is called by the parser to communicate events.  This
@@ -296,12 +1584,14 @@ message_cb (void *opaque, rfc822parse_event_t event, rfc822parse_t msg)
       rfc822parse_field_t ctx;
       size_t off;
       char *p;
+      int is_multipart = 0;
 
       info->mime_type = MT_NONE;
       info->transfer_encoding = TE_NONE;
-      info->test_base64 = 0;
-      info->got_probe = 0;
+      info->probing = 0;
+      info->probelen = 0;
       info->no_mime = 0;
+      info->vcstate = VC_NONE;
       ctx = rfc822parse_parse_field (msg, "Content-Type", -1);
       if (ctx)
         {
@@ -309,6 +1599,8 @@ message_cb (void *opaque, rfc822parse_event_t event, rfc822parse_t msg)
           s1 = rfc822parse_query_media_type (ctx, &s2);
           if (!s1)
             ;
+          else if (!strcmp (s1, "multipart"))
+            is_multipart = 1;
           else if (!strcmp (s1, "application") 
                    && !strcmp (s2, "octet-stream"))
             info->mime_type = MT_OCTET_STREAM;
@@ -322,11 +1614,12 @@ message_cb (void *opaque, rfc822parse_event_t event, rfc822parse_t msg)
 
           if (verbose)
             {
-              printf ("# Content-Type: %s/%s", s1?s1:"", s2?s2:"");
+              fprintf (outfp (), "# Content-Type: %s/%s",
+                       s1?s1:"", s2?s2:"");
               s1 = rfc822parse_query_parameter (ctx, "charset", 0);
               if (s1)
-                printf ("; charset=%s", s1);
-              putchar ('\n');
+                fprintf (outfp (), "; charset=%s", s1);
+              putc ('\n', outfp ());
             }
 
           rfc822parse_release_field (ctx);
@@ -347,7 +1640,7 @@ message_cb (void *opaque, rfc822parse_event_t event, rfc822parse_t msg)
           p = rfc822parse_get_field (msg, "Content-Disposition", -1, NULL);
           if (p)
             {
-              printf ("# %s\n", p);
+              fprintf (outfp (), "# %s\n", p);
               free (p);
             }
 
@@ -356,7 +1649,8 @@ message_cb (void *opaque, rfc822parse_event_t event, rfc822parse_t msg)
             {
               s1 = rfc822parse_query_parameter (ctx, "filename", 0);
               if (s1)
-                printf ("# Content-Disposition has filename=`%s'\n", s1);
+                fprintf (outfp (),
+                         "# Content-Disposition has filename=`%s'\n", s1);
               rfc822parse_release_field (ctx);
             }
         }
@@ -379,7 +1673,7 @@ message_cb (void *opaque, rfc822parse_event_t event, rfc822parse_t msg)
               if ( strstr (p, "Werner Koch") )
                 {
                   if (verbose)
-                    fputs ("# Found known name in To\n", stdout);
+                    fputs ("# Found known name in To\n", outfp ());
                   info->wk_seen = 1;
                 }
               free (p);
@@ -392,7 +1686,7 @@ message_cb (void *opaque, rfc822parse_event_t event, rfc822parse_t msg)
                   if ( strstr (p, "Werner Koch") )
                     {
                       if (verbose)
-                        fputs ("# Found known name in Cc\n", stdout);
+                        fputs ("# Found known name in Cc\n", outfp ());
                       info->wk_seen = 1;
                     }
                   free (p);
@@ -404,70 +1698,233 @@ message_cb (void *opaque, rfc822parse_event_t event, rfc822parse_t msg)
            || info->mime_type == MT_AUDIO
            || info->mime_type == MT_IMAGE)
           && info->transfer_encoding == TE_BASE64)
-        info->test_base64 = 1;
-      else if (info->mime_type == MT_TEXT_HTML)
         {
-          if (!quiet)
-            fputs ("HTML\n", stdout);
-          if (opt_match_html && !info->wk_seen)
-            exit (0);
+          info->probing = 1;
+          vcache_start (info);
         }
+      else if (info->mime_type == MT_TEXT_HTML)
+        report (info, FOUND_HTML, "HTML", opt_match_html && !info->wk_seen);
 
+      /* Don't let the parser process parts we won't look at. */
+      if (!info->probing && !is_multipart)
+        rfc822parse_skip_part (msg);
     }
   else if (event == RFC822PARSE_PREAMBLE)
     ;
   else if (event == RFC822PARSE_BOUNDARY || event == RFC822PARSE_LAST_BOUNDARY)
+    end_part (info);
+  else if (event == RFC822PARSE_BEGIN_HEADER)
     {
-      if (info->test_base64)
-        info->got_probe = 1;
-      info->test_base64 = 0;
     }
-  else if (event == RFC822PARSE_BEGIN_HEADER)
+
+  return 0;
+}
+
+
+/* This function is called by the parser with the decoded body of a
+   part.  We collect the first bytes and test them as soon as we have
+   enough. */
+static int
+body_cb (void *opaque, rfc822parse_t msg,
+         const unsigned char *data, size_t length)
+{
+  struct parse_info_s *info = opaque;
+
+  if (info->vcstate == VC_BUFFERING)
     {
+      if (vcache_feed (info, data, length))
+        return 0;
+      /* Too large for the cache.  */
+      if (process_body (info, info->vcbuf, info->vclen))
+        {
+          rfc822parse_skip_body (msg);
+          return 0;
+        }
     }
 
+  if (process_body (info, data, length))
+    rfc822parse_skip_body (msg);
+  return 0;
+}
+
+
+/* A buffered line reader.  Unlike fgets it copes with embedded Nuls
+   and lines of any length.  */
+#define LINE_READER_BUFSIZE 65536
+struct line_reader_s
+{
+  FILE *fp;
+  unsigned char *buffer;
+  size_t size;   /* Allocated size of BUFFER.  */
+  size_t start;  /* Start of the next line.  */
+  size_t end;    /* End of the valid data.  */
+  int eof;
+  int error;     /* Set on a read error or if we are out of core.  */
+};
+
+
+/* Prepare LR to read from FP.  Returns 0 on success.  */
+static int
+line_reader_init (struct line_reader_s *lr, FILE *fp)
+{
+  lr->fp = fp;
+  lr->size = LINE_READER_BUFSIZE;
+  lr->buffer = malloc (lr->size);
+  if (!lr->buffer)
+    {
+      err ("out of core: %s", strerror (errno));
+      return -1;
+    }
+  lr->start = lr->end = 0;
+  lr->eof = 0;
+  lr->error = 0;
   return 0;
 }
 
 
-/* Read a message from FP and process it according to the global
-   options. */
 static void
-parse_message (FILE *fp)
+line_reader_release (struct line_reader_s *lr)
 {
-  char line[2000];
-  unsigned char buffer[1000]; 
-  size_t buflen = 0;   
-  size_t length;
+  free (lr->buffer);
+  lr->buffer = NULL;
+}
+
+
+/* Return the next line from LR including its LF and store its length
+   at R_LENGTH.  The last line may lack the LF.  Returns NULL at EOF
+   or on error; the latter sets LR->ERROR.  The line is valid until
+   the next call.  */
+static unsigned char *
+read_line (struct line_reader_s *lr, size_t *r_length)
+{
+  unsigned char *p;
+  size_t scanned = 0;  /* Bytes already scanned for a LF.  */
+  size_t n;
+
+  for (;;)
+    {
+      p = memchr (lr->buffer + lr->start + scanned, '\n',
+                  lr->end - lr->start - scanned);
+      if (p)
+        {
+          p++;
+          break;
+        }
+      scanned = lr->end - lr->start;
+      if (lr->eof)
+        {
+          if (!scanned)
+            return NULL;
+          p = lr->buffer + lr->end;
+          break;
+        }
+
+      /* Need more data.  Move the partial line to the front and
+         enlarge the buffer if it is full.  */
+      if (lr->start)
+        {
+          memmove (lr->buffer, lr->buffer + lr->start, scanned);
+          lr->start = 0;
+          lr->end = scanned;
+        }
+      if (lr->end == lr->size)
+        {
+          unsigned char *tmp = realloc (lr->buffer, 2 * lr->size);
+          if (!tmp)
+            {
+              err ("out of core: %s", strerror (errno));
+              lr->error = 1;
+              return NULL;
+            }
+          lr->buffer = tmp;
+          lr->size *= 2;
+        }
+      n = fread (lr->buffer + lr->end, 1, lr->size - lr->end, lr->fp);
+      if (!n)
+        {
+          if (ferror (lr->fp))
+            {
+              err ("read error: %s", strerror (errno));
+              lr->error = 1;
+              return NULL;
+            }
+          lr->eof = 1;
+        }
+      lr->end += n;
+    }
+
+  *r_length = p - (lr->buffer + lr->start);
+  p = lr->buffer + lr->start;
+  lr->start += *r_length;
+  return p;
+}
+
+
+/* Read a message from FP and process it according to the global
+   options.  The findings are stored at INFO.  Returns true if a match
+   option matched or -1 after printing a diagnostic on error.  */
+static int
+parse_message (FILE *fp, struct parse_info_s *info)
+{
+  struct line_reader_s lr;
+  unsigned char *line;
+  size_t length, rawlength;
   rfc822parse_t msg;
   unsigned int lineno = 0;
   int no_cr_reported = 0;
-  struct parse_info_s info;
+  unsigned char *probe;
+  unsigned char *vcbuf = NULL;
   int body_lines = 0;
   int skip_leading_empty_lines = 0;
+  int rc = 0;
+
+  probe = malloc (probe_size);
+  if (!probe)
+    {
+      err ("out of core: %s", strerror (errno));
+      return -1;
+    }
+  if (vcache.hdr && !(vcbuf = malloc (opt_cache_limit)))
+    {
+      err ("out of core: %s", strerror (errno));
+      free (probe);
+      return -1;
+    }
+  if (line_reader_init (&lr, fp))
+    {
+      free (vcbuf);
+      free (probe);
+      return -1;
+    }
 
  restart:
-  memset (&info, 0, sizeof info);
+  memset (info, 0, sizeof *info);
+  info->probe = probe;
+  info->probesize = probe_size;
+  info->vcbuf = vcbuf;
 
-  msg = rfc822parse_open (message_cb, &info);
+  msg = rfc822parse_open (message_cb, info);
   if (!msg)
-    die ("can't open parser: %s", strerror (errno));
+    {
+      err ("can't open parser: %s", strerror (errno));
+      rc = -1;
+      goto leave;
+    }
+  rfc822parse_set_body_cb (msg, body_cb, info);
 
-  /* Fixme: We should not use fgets because it can't cope with
-     embedded nul characters. */
-  while (fgets (line, sizeof (line), fp))
+  while ((line = read_line (&lr, &rawlength)))
     {
       lineno++;
-      if (lineno == 1 && !strncmp (line, "From ", 5))
+      if (lineno == 1 && rawlength >= 5 && !memcmp (line, "From ", 5))
         continue;  /* We better ignore a leading From line. */
 
-      length = strlen (line);
+      length = rawlength;
       if (length && line[length - 1] == '\n')
-	line[--length] = 0;
+	length--;
       else if (verbose)
-        err ("line number %u too long or last line not terminated", lineno);
+        err ("last line not terminated (line %u)", lineno);
       if (length && line[length - 1] == '\r')
-	line[--length] = 0;
+	length--;
       else if (verbose && !no_cr_reported)
         {
           err ("non canonical ended line detected (line %u)", lineno);
@@ -481,7 +1938,7 @@ parse_message (FILE *fp)
               /* Sometimes additional information follows the
                  indication line indicated by 6 dashes.  Skip them
                  before detecting empty lines. */
-              if (length && !strncmp (line , "------ ", 7))
+              if (length >= 7 && !memcmp (line , "------ ", 7))
                 continue;
               skip_leading_empty_lines++;
             }
@@ -491,14 +1948,25 @@ parse_message (FILE *fp)
           skip_leading_empty_lines = 0;
         }
 
-      if (rfc822parse_insert (msg, line, length))
-	die ("parser failed: %s", strerror (errno));
+      if (rfc822parse_insert_raw (msg, line, rawlength))
+        {
+          err ("parser failed: %s", strerror (errno));
+          rc = -1;
+          goto leave;
+        }
+      if (info->error)
+        {
+          err ("out of core: %s", strerror (info->error));
+          rc = -1;
+          goto leave;
+        }
 
-      if (info.no_mime && body_lines < 50)
+      if (info->no_mime && body_lines < 50)
         {
           body_lines++;
-          if (!strncmp (line, "------ This is a copy of the message, "
-                        "including all the headers.", 64))
+          if (length >= 64
+              && !memcmp (line, "------ This is a copy of the message, "
+                          "including all the headers.", 64))
             {
               /* This may be followed by empty lines, thus we set a
                  flag to skip them. */
@@ -509,56 +1977,343 @@ parse_message (FILE *fp)
             }
         }
 
-      
-      if (info.got_probe && buflen)
+    }
+  if (lr.error)
+    {
+      rc = -1;
+      goto leave;
+    }
+
+  end_part (info);
+  rc = info->matched;
+
+ leave:
+  end_zip_peek (info);
+  rfc822parse_close (msg);
+  line_reader_release (&lr);
+  info->probe = NULL;
+  info->vcbuf = NULL;
+  free (vcbuf);
+  free (probe);
+  return rc;
+}
+
+
+
+/* Batch processing.  The main thread reads the messages or the file
+   names and queues them as jobs for the worker threads.  A worker
+   collects all output of a job; the main thread prints it in the
+   order of the input.  */
+struct job_s
+{
+  struct job_s *next;
+  char *name;           /* File name or a label for mbox messages.  */
+  char *data;           /* The message or NULL to read file NAME.  */
+  size_t datalen;
+  int done;             /* The job has been processed.  */
+  int failed;           /* The job could not be processed.  */
+  int matched;
+  char *out;            /* Output of the job for stdout.  */
+  size_t outlen;
+  char *errtext;        /* Diagnostics of the job for stderr.  */
+  size_t errlen;
+};
+typedef struct job_s *job_t;
+
+static struct
+{
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  job_t head;           /* The oldest job not yet printed.  */
+  job_t *tail;
+  job_t torun;          /* The next job for a worker.  */
+  int count;            /* Number of jobs not yet started.  */
+  int eof;
+  int any_matched;
+  int any_failed;
+} jobqueue = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER,
+               NULL, &jobqueue.head, NULL, 0, 0, 0, 0 };
+
+
+/* Print and release all processed jobs at the head of the queue.  If
+   WAIT is set wait until all queued jobs have been printed.  */
+static void
+collect_jobs (int wait)
+{
+  job_t job;
+
+  pthread_mutex_lock (&jobqueue.lock);
+  while ((job = jobqueue.head) && (job->done || wait))
+    {
+      if (!job->done)
+        {
+          pthread_cond_wait (&jobqueue.cond, &jobqueue.lock);
+          continue;
+        }
+      jobqueue.head = job->next;
+      if (!jobqueue.head)
+        jobqueue.tail = &jobqueue.head;
+      pthread_mutex_unlock (&jobqueue.lock);
+
+      if (job->errlen)
         {
-          info.got_probe = 0;
-          buffer[buflen] = 0;
-          buflen = decode_base64 (buffer);
-          if (debug)
-            {
-              int i;
-              
-              printf ("# %4d bytes base64:", (int)buflen);
-              for (i=0; i < buflen; i++)
-                {
-                  if (i && !(i % 16))
-                    printf ("\n#            0x%04X:", i);
-                  printf (" %02X", buffer[i]);
-                }
-              putchar ('\n'); 
-            }
-          identify_binary (buffer, buflen);
+          fflush (stdout);
+          fwrite (job->errtext, job->errlen, 1, stderr);
+        }
+      else if (job->failed)
+        err ("%s: out of core", job->name);
+      if (job->outlen)
+        fwrite (job->out, job->outlen, 1, stdout);
+      if (job->failed)
+        {
+          printf ("%s: ERROR\n", job->name);
+          jobqueue.any_failed = 1;
         }
+      if (job->matched)
+        jobqueue.any_matched = 1;
+      free (job->name);
+      free (job->out);
+      free (job->errtext);
+      free (job);
+
+      pthread_mutex_lock (&jobqueue.lock);
+    }
+  pthread_mutex_unlock (&jobqueue.lock);
+}
+
+
+static void
+queue_job (char *name, char *data, size_t datalen)
+{
+  job_t job;
+
+  job = calloc (1, sizeof *job);
+  if (!job)
+    die ("out of core: %s", strerror (errno));
+  job->name = name;
+  job->data = data;
+  job->datalen = datalen;
+
+  pthread_mutex_lock (&jobqueue.lock);
+  /* Don't let the reader run too far ahead.  */
+  while (jobqueue.count >= 4 * opt_jobs)
+    pthread_cond_wait (&jobqueue.cond, &jobqueue.lock);
+  *jobqueue.tail = job;
+  jobqueue.tail = &job->next;
+  if (!jobqueue.torun)
+    jobqueue.torun = job;
+  jobqueue.count++;
+  pthread_cond_broadcast (&jobqueue.cond);
+  pthread_mutex_unlock (&jobqueue.lock);
+
+  collect_jobs (0);
+}
+
 
-      if (info.test_base64)
+/* Process one job and store its output and verdict line.  */
+static void
+run_job (job_t job)
+{
+  FILE *fp;
+  struct parse_info_s info;
+  int matched, i;
+
+  job_out = open_memstream (&job->out, &job->outlen);
+  job_err = open_memstream (&job->errtext, &job->errlen);
+  job_label = job->name;
+  if (!job_out || !job_err)
+    {
+      job->failed = 1;
+      goto leave;
+    }
+
+  if (job->data)
+    fp = fmemopen (job->data, job->datalen, "rb");
+  else
+    fp = fopen (job->name, "rb");
+  if (!fp)
+    {
+      err ("can't open: %s", strerror (errno));
+      job->failed = 1;
+      goto leave;
+    }
+  matched = parse_message (fp, &info);
+  fclose (fp);
+  if (matched == -1)
+    {
+      job->failed = 1;
+      goto leave;
+    }
+
+  job->matched = matched;
+  if (!quiet || matched)
+    {
+      fprintf (job_out, "%s:", job->name);
+      for (i=0; i < nsignatures; i++)
+        if ((info.sigseen[i/8] & (1 << (i % 8))))
+          fprintf (job_out, " %s", signatures[i].name);
+      fprintf (job_out, "%s%s%s\n",
+               (info.found & FOUND_HTML)? " HTML":"",
+               info.found? "" : " -",
+               matched? " MATCH":"");
+    }
+
+ leave:
+  if (job_out)
+    fclose (job_out);
+  if (job_err)
+    fclose (job_err);
+  job_out = job_err = NULL;
+  job_label = NULL;
+}
+
+
+static void *
+worker_thread (void *dummy)
+{
+  job_t job;
+
+  for (;;)
+    {
+      pthread_mutex_lock (&jobqueue.lock);
+      while (!jobqueue.torun && !jobqueue.eof)
+        pthread_cond_wait (&jobqueue.cond, &jobqueue.lock);
+      job = jobqueue.torun;
+      if (job)
         {
-          if (info.test_base64 == 1)
-            { 
-              /* This is the empty marker line. */
-              buflen = 0;
-            }
-          else
+          jobqueue.torun = job->next;
+          jobqueue.count--;
+          pthread_cond_broadcast (&jobqueue.cond);
+        }
+      pthread_mutex_unlock (&jobqueue.lock);
+      if (!job)
+        break;
+
+      run_job (job);
+      free (job->data);
+      job->data = NULL;
+
+      pthread_mutex_lock (&jobqueue.lock);
+      job->done = 1;
+      pthread_cond_broadcast (&jobqueue.cond);
+      pthread_mutex_unlock (&jobqueue.lock);
+    }
+  return NULL;
+}
+
+
+/* Split the mbox FP into messages and queue them.  FNAME is used to
+   label the messages.  */
+static void
+read_mbox (FILE *fp, const char *fname)
+{
+  char *line = NULL;
+  size_t linesize = 0;
+  ssize_t n;
+  char *buffer = NULL;
+  size_t buflen = 0, bufsize = 0;
+  unsigned long msgno = 0;
+  int empty_seen = 1;
+  char *name;
+
+  for (;;)
+    {
+      n = getline (&line, &linesize, fp);
+      if (n == -1
+          || (empty_seen && n > 5 && !strncmp (line, "From ", 5)))
+        {
+          if (buflen)
             {
-              if (length > sizeof buffer - 1 - buflen)
-                {
-                  length = sizeof buffer - 1 - buflen;
-                  info.got_probe = 1;  /* We got enough. */
-                }
-              if (length)
-                {
-                  memcpy (buffer+buflen, line, length);
-                  buflen += length;
-                }
+              name = malloc (strlen (fname) + 25);
+              if (!name)
+                die ("out of core: %s", strerror (errno));
+              sprintf (name, "%s:%lu", fname, ++msgno);
+              queue_job (name, buffer, buflen);
+              buffer = NULL;
+              buflen = bufsize = 0;
             }
-          if (info.got_probe)
-            info.test_base64 = 0;
-          else
-            info.test_base64++;
+          if (n == -1)
+            break;
+        }
+      empty_seen = (n == 1 || (n == 2 && *line == '\r'));
+
+      if (buflen + n > bufsize)
+        {
+          bufsize = (buflen + n) * 2 + 4096;
+          buffer = realloc (buffer, bufsize);
+          if (!buffer)
+            die ("out of core: %s", strerror (errno));
         }
+      memcpy (buffer + buflen, line, n);
+      buflen += n;
     }
+  if (ferror (fp))
+    die ("error reading `%s': %s", fname, strerror (errno));
+  free (line);
+}
 
-  rfc822parse_close (msg);
+
+/* Read a list of NUL separated file names from FP and queue them. */
+static void
+read_file_list (FILE *fp, const char *fname)
+{
+  char *line = NULL;
+  size_t linesize = 0;
+  ssize_t n;
+  char *name;
+
+  while ((n = getdelim (&line, &linesize, 0, fp)) != -1)
+    {
+      if (n && !line[n-1])
+        n--;
+      if (!n)
+        continue;
+      name = malloc (n + 1);
+      if (!name)
+        die ("out of core: %s", strerror (errno));
+      memcpy (name, line, n);
+      name[n] = 0;
+      queue_job (name, NULL, 0);
+    }
+  if (ferror (fp))
+    die ("error reading `%s': %s", fname, strerror (errno));
+  free (line);
+}
+
+
+/* Run the batch mode on FP.  Returns true if any message matched;
+   sets *R_FAILED if any message could not be processed.  */
+static int
+run_batch (FILE *fp, const char *fname, int *r_failed)
+{
+  pthread_t *threads;
+  int i, rc;
+
+  if (opt_jobs < 1)
+    opt_jobs = 1;
+  threads = calloc (opt_jobs, sizeof *threads);
+  if (!threads)
+    die ("out of core: %s", strerror (errno));
+  for (i=0; i < opt_jobs; i++)
+    if ((rc = pthread_create (&threads[i], NULL, worker_thread, NULL)))
+      die ("error creating thread: %s", strerror (rc));
+
+  if (opt_batch == 1)
+    read_mbox (fp, fname);
+  else
+    read_file_list (fp, fname);
+
+  pthread_mutex_lock (&jobqueue.lock);
+  jobqueue.eof = 1;
+  pthread_cond_broadcast (&jobqueue.cond);
+  pthread_mutex_unlock (&jobqueue.lock);
+  collect_jobs (1);
+  for (i=0; i < opt_jobs; i++)
+    pthread_join (threads[i], NULL);
+  free (threads);
+
+  *r_failed = jobqueue.any_failed;
+  return jobqueue.any_matched;
 }
 
 
@@ -568,6 +2323,12 @@ main (int argc, char **argv)
 {
   int last_argc = -1;
   int any_match = 0;
+  int matched = 0;
+  FILE *fp;
+  const char *fname;
+  const char *sigfile = NULL;
+  struct parse_info_s info;
+  int failed = 0;
  
   if (argc)
     {
@@ -589,6 +2350,14 @@ main (int argc, char **argv)
                 "  --match-zip  return true if a ZIP body was found\n"
                 "  --match-exe  return true if an EXE body was found\n"
                 "  --match-html return true if a HTML body was found\n"
+                "  --mbox       FILE is an mbox; print a verdict per message\n"
+                "  --files      FILE is a NUL separated list of message files\n"
+                "  --jobs N     use N threads with --mbox and --files\n"
+                "  --signatures FILE  read the binary signatures from FILE\n"
+                "  --peek-zip   look into ZIP archives\n"
+                "  --zip-limit N  inflate at most N bytes per archive\n"
+                "  --cache FILE   cache verdicts for attachments in FILE\n"
+                "  --cache-limit N  cache only parts of up to N bytes\n"
                 "  --verbose    enable extra informational output\n"
                 "  --debug      enable additional debug output\n"
                 "  --help       display this help and exit\n\n"
@@ -638,6 +2407,66 @@ main (int argc, char **argv)
           any_match = 1;
           argc--; argv++;
         }
+      else if (!strcmp (*argv, "--mbox"))
+        {
+          opt_batch = 1;
+          argc--; argv++;
+        }
+      else if (!strcmp (*argv, "--files"))
+        {
+          opt_batch = 2;
+          argc--; argv++;
+        }
+      else if (!strcmp (*argv, "--signatures"))
+        {
+          argc--; argv++;
+          if (argc)
+            {
+              sigfile = *argv;
+              argc--; argv++;
+            }
+        }
+      else if (!strcmp (*argv, "--peek-zip"))
+        {
+          opt_peek_zip = 1;
+          argc--; argv++;
+        }
+      else if (!strcmp (*argv, "--zip-limit"))
+        {
+          argc--; argv++;
+          if (argc)
+            {
+              opt_zip_limit = strtoul (*argv, NULL, 0);
+              argc--; argv++;
+            }
+        }
+      else if (!strcmp (*argv, "--cache"))
+        {
+          argc--; argv++;
+          if (argc)
+            {
+              opt_cache = *argv;
+              argc--; argv++;
+            }
+        }
+      else if (!strcmp (*argv, "--cache-limit"))
+        {
+          argc--; argv++;
+          if (argc)
+            {
+              opt_cache_limit = strtoul (*argv, NULL, 0);
+              argc--; argv++;
+            }
+        }
+      else if (!strcmp (*argv, "--jobs"))
+        {
+          argc--; argv++;
+          if (argc)
+            {
+              opt_jobs = atoi (*argv);
+              argc--; argv++;
+            }
+        }
     }          
  
   if (argc > 1)
@@ -645,37 +2474,51 @@ main (int argc, char **argv)
 
   signal (SIGPIPE, SIG_IGN);
 
-  /* Build the helptable for radix64 to bin conversion. */
-  {
-    int i;
-    unsigned char *s;
+  load_signatures (sigfile);
+  if (opt_cache)
+    vcache_open (opt_cache);
 
-    for (i=0; i < 256; i++ )
-      asctobin[i] = 255; /* Used to detect invalid characters. */
-    for (s=bintoasc, i=0; *s; s++, i++)
-      asctobin[*s] = i;
-  }
+  if (opt_batch && !opt_jobs)
+    {
+      opt_jobs = sysconf (_SC_NPROCESSORS_ONLN);
+      if (opt_jobs < 1)
+        opt_jobs = 1;
+    }
 
   /* Start processing. */
   if (argc && strcmp (*argv, "-"))
     {
-      FILE *fp = fopen (*argv, "rb");
+      fname = *argv;
+      fp = fopen (fname, "rb");
       if (!fp)
-        die ("can't open `%s': %s", *argv, strerror (errno));
-      parse_message (fp);
-      fclose (fp);
+        die ("can't open `%s': %s", fname, strerror (errno));
     }
   else
-    parse_message (stdin);
+    {
+      fname = "[stdin]";
+      fp = stdin;
+    }
+  if (opt_batch)
+    matched = run_batch (fp, fname, &failed);
+  else if (parse_message (fp, &info) == -1)
+    exit (1);
+  if (fp != stdin)
+    fclose (fp);
+
+  /* In batch mode messages which could not be processed have been
+     reported as ERROR.  */
+  if (failed)
+    return 2;
 
   /* If any match option was used and we reach this here we return
-     false.  True is returned immediately on a match. */
-  return any_match? 1:0;
+     false unless we are in batch mode.  True is returned immediately
+     on a match. */
+  return any_match && !matched? 1:0;
 }
 
 
 /*
 Local Variables:
-compile-command: "gcc -Wall -Wno-pointer-sign -g -o scrutmime rfc822parse.c scrutmime.c"
+compile-command: "gcc -Wall -Wno-pointer-sign -g -pthread -o scrutmime rfc822parse.c base64.c scrutmime.c -lz"
 End:
 */
@@ -1,6 +1,6 @@
 /* sha1sum.c - print SHA-1 Message-Digest Algorithm 
  * Copyright (C) 1998, 1999, 2000, 2001 Free Software Foundation, Inc.
- * Copyright (C) 2004, 2009 g10 Code GmbH
+ * Copyright (C) 2004, 2009, 2026 g10 Code GmbH
  *
  * This program is free software; you can redistribute it and/or modify it
  * under the terms of the GNU General Public License as published by the
@@ -19,6 +19,7 @@
 /* 
    To build this tool as md5sum    use -DBUILD_MD5SUM
    To build this tool as sha256sum use -DBUILD_SHA256SUM
+   This only changes the default algorithm; see option -a.
 
    SHA-1 code taken from gnupg 1.3.92. 
    MD-5 and SHA-256 code taken from libgcrypt 1.5.0.
@@ -30,6 +31,15 @@
    2009-10-21 wk  Added -c option.  Switch to GPL-3.  Escape filenames.
    2009-10-22 wk  Support MD5 and SHA256.
    2010-04-16 wk  Add option -0.
+   2026-10-19 g10code  Add SHA-NI transforms, --selftest and --benchmark.
+   2026-10-19 g10code  Add option -j to hash files in parallel.
+   2026-10-19 g10code  Map large files and use a larger read buffer.
+   2026-10-19 g10code  Include all algorithms and add SHA-512.  Add options
+                       -a and -o to compute several digests in one pass.
+   2026-10-19 g10code  Add option -T for chunked tree hashes.
+   2026-10-19 g10code  Add options --cache and --paranoid.
+   2026-10-19 g10code  Hash small files in batches with a multi-buffer MD5.
+                       md5sum.c is now a front-end to this file.
 */
 
 #include <stdio.h>
@@ -37,35 +47,68 @@
 #include <string.h>
 #include <assert.h>
 #include <errno.h>
+#include <time.h>
 #ifdef _WIN32
 # include <fcntl.h>
+#else
+# include <unistd.h>
+# include <fcntl.h>
+# include <pthread.h>
+# include <sys/stat.h>
+# define USE_THREADS 1
+# define USE_MMAP 1
+# define USE_CACHE 1
 #endif
 
 #define VERSION "1.2"
 #if defined(BUILD_MD5SUM)
 # define PGM "md5sum"
-# define DIGEST_LENGTH 16
+# define DEFAULT_ALGO ALGO_MD5
 #elif defined(BUILD_SHA256SUM)
 # define PGM "sha256sum"
-# define DIGEST_LENGTH 32
+# define DEFAULT_ALGO ALGO_SHA256
 #else /* default  */
 # define PGM "sha1sum"
-# define DIGEST_LENGTH 20
+# define DEFAULT_ALGO ALGO_SHA1
 #endif
 
+/* All algorithms are always available; the build only selects the
+   default one.  */
+enum
+  {
+    ALGO_MD5,
+    ALGO_SHA1,
+    ALGO_SHA256,
+    ALGO_SHA512,
+    N_ALGOS
+  };
 
-/* Offset where the name starts in the file.  */
-#define NAME_OFFSET (DIGEST_LENGTH*2+2)
+/* The length of the largest digest.  */
+#define MAX_DIGEST_LENGTH 64
 
 
-/* Figure out a 32 bit unsigned integer type.  */
+/* Figure out 32 and 64 bit unsigned integer types.  */
 #if (defined __STDC_VERSION__ && __STDC_VERSION__ >= 199901L)
 # include <stdint.h>
 typedef uint32_t u32;
+typedef uint64_t u64;
 #else  /* !ISO C-99 */
 typedef unsigned int u32;
+typedef unsigned long long u64;
 #endif /* !ISO C-99 */
 
+/* On x86 we provide faster transform functions for SHA-1 and SHA-256
+   which are selected at runtime.  */
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+# define USE_X86_ACCEL 1
+# include <immintrin.h>
+#endif
+
+/* Batches of small files are hashed with a multi-buffer MD5.  */
+#if defined(USE_X86_ACCEL) && defined(USE_MMAP)
+# define USE_MD5_MB 1
+#endif
+
 /* Set to true if this is a big endian host.  Unfortunately there is
    no portable macro to test for it.  Thus we do a runtime test. */
 static int big_endian_host;
@@ -87,7 +130,6 @@ rol( u32 x, int n)
 #define rol(x,n) ( ((x) << (n)) | ((x) >> (32-(n))) )
 #endif
 
-#ifdef BUILD_SHA256SUM
 #if defined(__GNUC__) && defined(__i386__)
 static inline u32
 ror(u32 x, int n)
@@ -100,55 +142,51 @@ ror(u32 x, int n)
 #else
 #define ror(x,n) ( ((x) >> (n)) | ((x) << (32-(n))) )
 #endif
-#endif /*BUILD_SHA256SUM*/
+
+#define ror64(x,n) ( ((x) >> (n)) | ((x) << (64-(n))) )
 
 
 typedef struct 
 {
-#if defined(BUILD_MD5SUM)
-  u32 A,B,C,D;
-#elif defined(BUILD_SHA256SUM)
-  u32  h0,h1,h2,h3,h4,h5,h6,h7;
-#else /*BUILD_SHA1SUM*/
-  u32  h0,h1,h2,h3,h4;
-#endif
-  u32  nblocks;
-  unsigned char buf[64];
+  int  algo;
+  u32  h[8];      /* The chaining variables; MD5 uses h[0..3] for A..D.  */
+  u64  h64[8];    /* The chaining variables of SHA-512.  */
+  u64  nblocks;
+  unsigned char buf[128];
   int  count;
 } DIGEST_CONTEXT;
 
 
 
 static void
-digest_init (DIGEST_CONTEXT *hd)
+digest_init (DIGEST_CONTEXT *hd, int algo)
 {
-#if defined(BUILD_MD5SUM)
-  hd->A = 0x67452301;
-  hd->B = 0xefcdab89;
-  hd->C = 0x98badcfe;
-  hd->D = 0x10325476;
-#elif defined(BUILD_SHA256SUM)
-  hd->h0 = 0x6a09e667;
-  hd->h1 = 0xbb67ae85;
-  hd->h2 = 0x3c6ef372;
-  hd->h3 = 0xa54ff53a;
-  hd->h4 = 0x510e527f;
-  hd->h5 = 0x9b05688c;
-  hd->h6 = 0x1f83d9ab;
-  hd->h7 = 0x5be0cd19;
-#else /*BUILD_SHA1SUM*/
-  hd->h0 = 0x67452301;
-  hd->h1 = 0xefcdab89;
-  hd->h2 = 0x98badcfe;
-  hd->h3 = 0x10325476;
-  hd->h4 = 0xc3d2e1f0;
-#endif
+  static const u32 md5_iv[4] =
+    { 0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476 };
+  static const u32 sha1_iv[5] =
+    { 0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0 };
+  static const u32 sha256_iv[8] =
+    { 0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+      0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19 };
+  static const u64 sha512_iv[8] =
+    { 0x6a09e667f3bcc908ULL, 0xbb67ae8584caa73bULL,
+      0x3c6ef372fe94f82bULL, 0xa54ff53a5f1d36f1ULL,
+      0x510e527fade682d1ULL, 0x9b05688c2b3e6c1fULL,
+      0x1f83d9abfb41bd6bULL, 0x5be0cd19137e2179ULL };
+
+  hd->algo = algo;
+  switch (algo)
+    {
+    case ALGO_MD5:    memcpy (hd->h, md5_iv, sizeof md5_iv); break;
+    case ALGO_SHA1:   memcpy (hd->h, sha1_iv, sizeof sha1_iv); break;
+    case ALGO_SHA256: memcpy (hd->h, sha256_iv, sizeof sha256_iv); break;
+    case ALGO_SHA512: memcpy (hd->h64, sha512_iv, sizeof sha512_iv); break;
+    }
   hd->nblocks = 0;
   hd->count = 0;
 }
 
 
-#if defined(BUILD_MD5SUM)
 /*
  * MD5 transform the message X which consists of 16 32-bit-words
  */
@@ -161,19 +199,20 @@ digest_init (DIGEST_CONTEXT *hd)
 #define FH(b, c, d) (b ^ c ^ d)
 #define FI(b, c, d) (c ^ (b | ~d))
 static void
-transform (DIGEST_CONTEXT *hd, unsigned char *data )
+transform_md5_block (DIGEST_CONTEXT *hd, const unsigned char *data)
 {
   u32 correct_words[16];
-  u32 A = hd->A;
-  u32 B = hd->B;
-  u32 C = hd->C;
-  u32 D = hd->D;
+  u32 A = hd->h[0];
+  u32 B = hd->h[1];
+  u32 C = hd->h[2];
+  u32 D = hd->h[3];
   u32 *cwp = correct_words;
     
   if (big_endian_host)
     { 
       int i;
-      unsigned char *p2, *p1;
+      const unsigned char *p1;
+      unsigned char *p2;
       for(i=0, p1=data, p2=(unsigned char*)correct_words;
           i < 16; i++, p2 += 4 )
         {
@@ -284,13 +323,12 @@ transform (DIGEST_CONTEXT *hd, unsigned char *data )
   OP (FI, B, C, D, A,  9, 21, 0xeb86d391);
 
   /* Put checksum in context given as argument.  */
-  hd->A += A;
-  hd->B += B;
-  hd->C += C;
-  hd->D += D;
+  hd->h[0] += A;
+  hd->h[1] += B;
+  hd->h[2] += C;
+  hd->h[3] += D;
 }
 
-#elif defined(BUILD_SHA256SUM)
 /*
  * SHA-256 transform the message X which consists of 16 32-bit-words.
  * See FIPS-180-2 for details.
@@ -314,10 +352,7 @@ transform (DIGEST_CONTEXT *hd, unsigned char *data )
             b = a;                                                \
             a = t1 + t2;                                          \
           } while (0)
-static void
-transform (DIGEST_CONTEXT *hd, unsigned char *data)
-{
-  static const u32 K[64] = {
+static const u32 sha256_K[64] = {
     0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
     0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
     0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
@@ -336,19 +371,22 @@ transform (DIGEST_CONTEXT *hd, unsigned char *data)
     0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
   };
 
+static void
+transform_sha256_block (DIGEST_CONTEXT *hd, const unsigned char *data)
+{
   u32 a,b,c,d,e,f,g,h,t1,t2;
   u32 x[16];
   u32 w[64];
   int i;
   
-  a = hd->h0;
-  b = hd->h1;
-  c = hd->h2;
-  d = hd->h3;
-  e = hd->h4;
-  f = hd->h5;
-  g = hd->h6;
-  h = hd->h7;
+  a = hd->h[0];
+  b = hd->h[1];
+  c = hd->h[2];
+  d = hd->h[3];
+  e = hd->h[4];
+  f = hd->h[5];
+  g = hd->h[6];
+  h = hd->h[7];
   
   if (big_endian_host)
     memcpy (x, data, 64);
@@ -371,17 +409,79 @@ transform (DIGEST_CONTEXT *hd, unsigned char *data)
     w[i] = S1(w[i-2]) + w[i-7] + S0(w[i-15]) + w[i-16];
 
   for (i=0; i < 64; i++)
-    R(a,b,c,d,e,f,g,h,K[i],w[i]);
-
-  hd->h0 += a;
-  hd->h1 += b;
-  hd->h2 += c;
-  hd->h3 += d;
-  hd->h4 += e;
-  hd->h5 += f;
-  hd->h6 += g;
-  hd->h7 += h;
+    R(a,b,c,d,e,f,g,h,sha256_K[i],w[i]);
+
+  hd->h[0] += a;
+  hd->h[1] += b;
+  hd->h[2] += c;
+  hd->h[3] += d;
+  hd->h[4] += e;
+  hd->h[5] += f;
+  hd->h[6] += g;
+  hd->h[7] += h;
+}
+
+
+#ifdef USE_X86_ACCEL
+/* SHA-256 using the SHA extensions.  */
+__attribute__ ((target ("sha,ssse3,sse4.1")))
+static void
+transform_sha256_shani (DIGEST_CONTEXT *hd, const unsigned char *data,
+                 size_t nblocks)
+{
+  const __m128i mask = _mm_set_epi64x (0x0c0d0e0f08090a0bULL,
+                                       0x0405060700010203ULL);
+  __m128i state0, state1, save0, save1, msg, tmp;
+  __m128i w[4];
+  int i;
+
+  state0 = _mm_set_epi32 (hd->h[0], hd->h[1], hd->h[4], hd->h[5]); /* ABEF */
+  state1 = _mm_set_epi32 (hd->h[2], hd->h[3], hd->h[6], hd->h[7]); /* CDGH */
+
+  for (; nblocks; nblocks--, data += 64)
+    {
+      save0 = state0;
+      save1 = state1;
+      w[0] = _mm_shuffle_epi8 (_mm_loadu_si128 ((const __m128i *)data), mask);
+      w[1] = _mm_shuffle_epi8 (_mm_loadu_si128
+                               ((const __m128i *)(data+16)), mask);
+      w[2] = _mm_shuffle_epi8 (_mm_loadu_si128
+                               ((const __m128i *)(data+32)), mask);
+      w[3] = _mm_shuffle_epi8 (_mm_loadu_si128
+                               ((const __m128i *)(data+48)), mask);
+
+      for (i=0; i < 16; i++)
+        {
+          msg = _mm_add_epi32 (w[i&3], _mm_loadu_si128
+                               ((const __m128i *)(sha256_K + 4*i)));
+          state1 = _mm_sha256rnds2_epu32 (state1, state0, msg);
+          if (i < 12)
+            {
+              /* Compute the words for the rounds 4*i+16 .. 4*i+19.  */
+              tmp = _mm_sha256msg1_epu32 (w[i&3], w[(i+1)&3]);
+              tmp = _mm_add_epi32 (tmp, _mm_alignr_epi8 (w[(i+3)&3],
+                                                         w[(i+2)&3], 4));
+              w[i&3] = _mm_sha256msg2_epu32 (tmp, w[(i+3)&3]);
+            }
+          msg = _mm_shuffle_epi32 (msg, 0x0e);
+          state0 = _mm_sha256rnds2_epu32 (state0, state1, msg);
+        }
+
+      state0 = _mm_add_epi32 (state0, save0);
+      state1 = _mm_add_epi32 (state1, save1);
+    }
+
+  hd->h[0] = _mm_extract_epi32 (state0, 3);
+  hd->h[1] = _mm_extract_epi32 (state0, 2);
+  hd->h[4] = _mm_extract_epi32 (state0, 1);
+  hd->h[5] = _mm_extract_epi32 (state0, 0);
+  hd->h[2] = _mm_extract_epi32 (state1, 3);
+  hd->h[3] = _mm_extract_epi32 (state1, 2);
+  hd->h[6] = _mm_extract_epi32 (state1, 1);
+  hd->h[7] = _mm_extract_epi32 (state1, 0);
 }
+#endif /*USE_X86_ACCEL*/
+
 # undef Cho
 # undef Maj
 # undef Sum0
@@ -390,22 +490,21 @@ transform (DIGEST_CONTEXT *hd, unsigned char *data)
 # undef S1
 # undef R
 
-#else /*BUILD_SHA1SUM*/
 /*
  * SHA-1 transform the message X which consists of 16 32-bit-words
  */
 static void
-transform (DIGEST_CONTEXT *hd, unsigned char *data )
+transform_sha1_block (DIGEST_CONTEXT *hd, const unsigned char *data)
 {
   u32 a,b,c,d,e,tm;
   u32 x[16];
   
   /* Get values from the chaining vars. */
-  a = hd->h0;
-  b = hd->h1;
-  c = hd->h2;
-  d = hd->h3;
-  e = hd->h4;
+  a = hd->h[0];
+  b = hd->h[1];
+  c = hd->h[2];
+  d = hd->h[3];
+  e = hd->h[4];
 
   if (big_endian_host)
     memcpy (x, data, 64);
@@ -525,25 +624,521 @@ transform (DIGEST_CONTEXT *hd, unsigned char *data )
   R( b, c, d, e, a, F4, K4, M(79) );
 
   /* Update chaining vars.  */
-  hd->h0 += a;
-  hd->h1 += b;
-  hd->h2 += c;
-  hd->h3 += d;
-  hd->h4 += e;
+  hd->h[0] += a;
+  hd->h[1] += b;
+  hd->h[2] += c;
+  hd->h[3] += d;
+  hd->h[4] += e;
+}
+
+#ifdef USE_X86_ACCEL
+/* SHA-1 using the SHA extensions.  Each step does 4 rounds and
+   computes parts of the message schedule for the following steps.  G
+   must be a constant.  */
+# define SHANI_ROUNDS4(g) do {                                          \
+    if (!(g))                                                           \
+      etmp = _mm_add_epi32 (e0, w[0]);                                  \
+    else                                                                \
+      etmp = _mm_sha1nexte_epu32 (e0, w[(g)&3]);                        \
+    e0 = abcd;                                                          \
+    if ((g) >= 3 && (g) <= 18)                                          \
+      w[((g)+1)&3] = _mm_sha1msg2_epu32 (w[((g)+1)&3], w[(g)&3]);       \
+    abcd = _mm_sha1rnds4_epu32 (abcd, etmp, (g)/5);                     \
+    if ((g) >= 1 && (g) <= 16)                                          \
+      w[((g)+3)&3] = _mm_sha1msg1_epu32 (w[((g)+3)&3], w[(g)&3]);       \
+    if ((g) >= 2 && (g) <= 17)                                          \
+      w[((g)+2)&3] = _mm_xor_si128 (w[((g)+2)&3], w[(g)&3]);            \
+  } while (0)
+
+__attribute__ ((target ("sha,ssse3,sse4.1")))
+static void
+transform_sha1_shani (DIGEST_CONTEXT *hd, const unsigned char *data,
+                 size_t nblocks)
+{
+  const __m128i mask = _mm_set_epi64x (0x0001020304050607ULL,
+                                       0x08090a0b0c0d0e0fULL);
+  __m128i abcd, e0, etmp, save_abcd, save_e;
+  __m128i w[4];
+
+  abcd = _mm_set_epi32 (hd->h[0], hd->h[1], hd->h[2], hd->h[3]);
+  e0 = _mm_set_epi32 (hd->h[4], 0, 0, 0);
+
+  for (; nblocks; nblocks--, data += 64)
+    {
+      save_abcd = abcd;
+      save_e = e0;
+      w[0] = _mm_shuffle_epi8 (_mm_loadu_si128 ((const __m128i *)data), mask);
+      w[1] = _mm_shuffle_epi8 (_mm_loadu_si128
+                               ((const __m128i *)(data+16)), mask);
+      w[2] = _mm_shuffle_epi8 (_mm_loadu_si128
+                               ((const __m128i *)(data+32)), mask);
+      w[3] = _mm_shuffle_epi8 (_mm_loadu_si128
+                               ((const __m128i *)(data+48)), mask);
+
+      SHANI_ROUNDS4 (0);  SHANI_ROUNDS4 (1);
+      SHANI_ROUNDS4 (2);  SHANI_ROUNDS4 (3);
+      SHANI_ROUNDS4 (4);  SHANI_ROUNDS4 (5);
+      SHANI_ROUNDS4 (6);  SHANI_ROUNDS4 (7);
+      SHANI_ROUNDS4 (8);  SHANI_ROUNDS4 (9);
+      SHANI_ROUNDS4 (10); SHANI_ROUNDS4 (11);
+      SHANI_ROUNDS4 (12); SHANI_ROUNDS4 (13);
+      SHANI_ROUNDS4 (14); SHANI_ROUNDS4 (15);
+      SHANI_ROUNDS4 (16); SHANI_ROUNDS4 (17);
+      SHANI_ROUNDS4 (18); SHANI_ROUNDS4 (19);
+
+      e0 = _mm_sha1nexte_epu32 (e0, save_e);
+      abcd = _mm_add_epi32 (abcd, save_abcd);
+    }
+
+  hd->h[0] = _mm_extract_epi32 (abcd, 3);
+  hd->h[1] = _mm_extract_epi32 (abcd, 2);
+  hd->h[2] = _mm_extract_epi32 (abcd, 1);
+  hd->h[3] = _mm_extract_epi32 (abcd, 0);
+  hd->h[4] = _mm_extract_epi32 (e0, 3);
+}
+# undef SHANI_ROUNDS4
+#endif /*USE_X86_ACCEL*/
+
+# undef K1
+# undef K2
+# undef K3
+# undef K4
+# undef F1
+# undef F2
+# undef F3
+# undef F4
+# undef M
+# undef R
+
+
+/*
+ * SHA-512 transform the message X which consists of 16 64-bit-words.
+ * See FIPS-180-2 for details.
+ */
+# define Cho(x,y,z) (z ^ (x & (y ^ z)))
+# define Maj(x,y,z) ((x & y) | (z & (x|y)))
+# define Sum0(x) (ror64 ((x), 28) ^ ror64 ((x), 34) ^ ror64 ((x), 39))
+# define Sum1(x) (ror64 ((x), 14) ^ ror64 ((x), 18) ^ ror64 ((x), 41))
+# define S0(x) (ror64 ((x), 1) ^ ror64 ((x), 8) ^ ((x) >> 7))
+# define S1(x) (ror64 ((x), 19) ^ ror64 ((x), 61) ^ ((x) >> 6))
+static const u64 sha512_K[80] = {
+    0x428a2f98d728ae22ULL, 0x7137449123ef65cdULL,
+    0xb5c0fbcfec4d3b2fULL, 0xe9b5dba58189dbbcULL,
+    0x3956c25bf348b538ULL, 0x59f111f1b605d019ULL,
+    0x923f82a4af194f9bULL, 0xab1c5ed5da6d8118ULL,
+    0xd807aa98a3030242ULL, 0x12835b0145706fbeULL,
+    0x243185be4ee4b28cULL, 0x550c7dc3d5ffb4e2ULL,
+    0x72be5d74f27b896fULL, 0x80deb1fe3b1696b1ULL,
+    0x9bdc06a725c71235ULL, 0xc19bf174cf692694ULL,
+    0xe49b69c19ef14ad2ULL, 0xefbe4786384f25e3ULL,
+    0x0fc19dc68b8cd5b5ULL, 0x240ca1cc77ac9c65ULL,
+    0x2de92c6f592b0275ULL, 0x4a7484aa6ea6e483ULL,
+    0x5cb0a9dcbd41fbd4ULL, 0x76f988da831153b5ULL,
+    0x983e5152ee66dfabULL, 0xa831c66d2db43210ULL,
+    0xb00327c898fb213fULL, 0xbf597fc7beef0ee4ULL,
+    0xc6e00bf33da88fc2ULL, 0xd5a79147930aa725ULL,
+    0x06ca6351e003826fULL, 0x142929670a0e6e70ULL,
+    0x27b70a8546d22ffcULL, 0x2e1b21385c26c926ULL,
+    0x4d2c6dfc5ac42aedULL, 0x53380d139d95b3dfULL,
+    0x650a73548baf63deULL, 0x766a0abb3c77b2a8ULL,
+    0x81c2c92e47edaee6ULL, 0x92722c851482353bULL,
+    0xa2bfe8a14cf10364ULL, 0xa81a664bbc423001ULL,
+    0xc24b8b70d0f89791ULL, 0xc76c51a30654be30ULL,
+    0xd192e819d6ef5218ULL, 0xd69906245565a910ULL,
+    0xf40e35855771202aULL, 0x106aa07032bbd1b8ULL,
+    0x19a4c116b8d2d0c8ULL, 0x1e376c085141ab53ULL,
+    0x2748774cdf8eeb99ULL, 0x34b0bcb5e19b48a8ULL,
+    0x391c0cb3c5c95a63ULL, 0x4ed8aa4ae3418acbULL,
+    0x5b9cca4f7763e373ULL, 0x682e6ff3d6b2b8a3ULL,
+    0x748f82ee5defb2fcULL, 0x78a5636f43172f60ULL,
+    0x84c87814a1f0ab72ULL, 0x8cc702081a6439ecULL,
+    0x90befffa23631e28ULL, 0xa4506cebde82bde9ULL,
+    0xbef9a3f7b2c67915ULL, 0xc67178f2e372532bULL,
+    0xca273eceea26619cULL, 0xd186b8c721c0c207ULL,
+    0xeada7dd6cde0eb1eULL, 0xf57d4f7fee6ed178ULL,
+    0x06f067aa72176fbaULL, 0x0a637dc5a2c898a6ULL,
+    0x113f9804bef90daeULL, 0x1b710b35131c471bULL,
+    0x28db77f523047d84ULL, 0x32caab7b40c72493ULL,
+    0x3c9ebe0a15c9bebcULL, 0x431d67c49c100d4cULL,
+    0x4cc5d4becb3e42b6ULL, 0x597f299cfc657e2aULL,
+    0x5fcb6fab3ad6faecULL, 0x6c44198c4a475817ULL
+  };
+
+static void
+transform_sha512_block (DIGEST_CONTEXT *hd, const unsigned char *data)
+{
+  u64 a,b,c,d,e,f,g,h,t1,t2;
+  u64 w[80];
+  int i, k;
+
+  a = hd->h64[0];
+  b = hd->h64[1];
+  c = hd->h64[2];
+  d = hd->h64[3];
+  e = hd->h64[4];
+  f = hd->h64[5];
+  g = hd->h64[6];
+  h = hd->h64[7];
+
+  for (i=0; i < 16; i++)
+    for (w[i]=0, k=0; k < 8; k++)
+      w[i] = (w[i] << 8) | *data++;
+  for (; i < 80; i++)
+    w[i] = S1(w[i-2]) + w[i-7] + S0(w[i-15]) + w[i-16];
+
+  for (i=0; i < 80; i++)
+    {
+      t1 = h + Sum1 (e) + Cho (e, f, g) + sha512_K[i] + w[i];
+      t2 = Sum0 (a) + Maj (a, b, c);
+      h = g;
+      g = f;
+      f = e;
+      e = d + t1;
+      d = c;
+      c = b;
+      b = a;
+      a = t1 + t2;
+    }
+
+  hd->h64[0] += a;
+  hd->h64[1] += b;
+  hd->h64[2] += c;
+  hd->h64[3] += d;
+  hd->h64[4] += e;
+  hd->h64[5] += f;
+  hd->h64[6] += g;
+  hd->h64[7] += h;
+}
+
+# undef Cho
+# undef Maj
+# undef Sum0
+# undef Sum1
+# undef S0
+# undef S1
+
+
+
+/* Define the function transform_NAME to run transform_NAME_block on
+   all NBLOCKS blocks at DATA.  */
+#define DEFINE_TRANSFORM(name,blocksize)                                \
+  static void                                                           \
+  transform_##name (DIGEST_CONTEXT *hd, const unsigned char *data,      \
+                    size_t nblocks)                                     \
+  {                                                                     \
+    for (; nblocks; nblocks--, data += (blocksize))                     \
+      transform_##name##_block (hd, data);                              \
+  }
+DEFINE_TRANSFORM (md5, 64)
+DEFINE_TRANSFORM (sha1, 64)
+DEFINE_TRANSFORM (sha256, 64)
+DEFINE_TRANSFORM (sha512, 128)
+#undef DEFINE_TRANSFORM
+
+
+#ifdef USE_X86_ACCEL
+static int
+have_shani (void)
+{
+  return (__builtin_cpu_supports ("sha") && __builtin_cpu_supports ("ssse3")
+          && __builtin_cpu_supports ("sse4.1"));
+}
+#endif /*USE_X86_ACCEL*/
+
+
+/* The supported algorithms.  TRANSFORM is set by select_transform to
+   the best implementation.  */
+static struct
+{
+  const char *name;      /* The name used with option -a.  */
+  const char *sumsname;  /* The name of the file written by option -o.  */
+  int digestlen;
+  int blocksize;
+  void (*transform) (DIGEST_CONTEXT *hd, const unsigned char *data,
+                     size_t nblocks);
+} algos[N_ALGOS] =
+  {
+    { "md5",    "MD5SUMS",    16,  64, transform_md5 },
+    { "sha1",   "SHA1SUMS",   20,  64, transform_sha1 },
+    { "sha256", "SHA256SUMS", 32,  64, transform_sha256 },
+    { "sha512", "SHA512SUMS", 64, 128, transform_sha512 }
+  };
+
+
+/* The available transform functions; for each algorithm the best
+   first and the generic one last.  */
+static struct
+{
+  int algo;
+  const char *name;
+  void (*fnc) (DIGEST_CONTEXT *hd, const unsigned char *data, size_t nblocks);
+  int (*usable) (void);
+} transforms[] =
+  {
+    { ALGO_MD5,    "generic", transform_md5, NULL },
+#ifdef USE_X86_ACCEL
+    { ALGO_SHA1,   "shani",   transform_sha1_shani, have_shani },
+#endif
+    { ALGO_SHA1,   "generic", transform_sha1, NULL },
+#ifdef USE_X86_ACCEL
+    { ALGO_SHA256, "shani",   transform_sha256_shani, have_shani },
+#endif
+    { ALGO_SHA256, "generic", transform_sha256, NULL },
+    { ALGO_SHA512, "generic", transform_sha512, NULL },
+    { 0, NULL }
+  };
+
+
+/* Multi-buffer MD5.  MD5 can't be computed faster for a single
+   message but we can hash the blocks of 4 or 8 messages at once
+   using SIMD registers; this is used for batches of small files.
+   The state of the messages is kept in STATE with word I of lane J
+   at STATE[I*LANES+J].  */
+#ifdef USE_MD5_MB
+static const u32 md5_T[64] = {
+    0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee,
+    0xf57c0faf, 0x4787c62a, 0xa8304613, 0xfd469501,
+    0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be,
+    0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821,
+    0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa,
+    0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+    0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed,
+    0xa9e3e905, 0xfcefa3f8, 0x676f02d9, 0x8d2a4c8a,
+    0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c,
+    0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70,
+    0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x04881d05,
+    0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+    0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039,
+    0x655b59c3, 0x8f0ccc92, 0xffeff47d, 0x85845dd1,
+    0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1,
+    0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391
+  };
+static const unsigned char md5_idx[64] = {
+    0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15,
+    1, 6, 11, 0, 5, 10, 15, 4, 9, 14, 3, 8, 13, 2, 7, 12,
+    5, 8, 11, 14, 1, 4, 7, 10, 13, 0, 3, 6, 9, 12, 15, 2,
+    0, 7, 14, 5, 12, 3, 10, 1, 8, 15, 6, 13, 4, 11, 2, 9
+  };
+static const unsigned char md5_rot[16] = {
+    7, 12, 17, 22,  5, 9, 14, 20,  4, 11, 16, 23,  6, 10, 15, 21
+  };
+
+# define MB_F(x,y,z) (z ^ (x & (y ^ z)))
+# define MB_G(x,y,z) (y ^ (z & (x ^ y)))
+# define MB_H(x,y,z) (x ^ y ^ z)
+# define MB_I(x,y,z) (y ^ (x | ~z))
+# define MB_ROUND(f,r)                                                  \
+    for (i = 16*(r); i < 16*(r)+16; i++)                                \
+      {                                                                 \
+        t = a + f (b, c, d) + w[md5_idx[i]] + md5_T[i];                 \
+        s = md5_rot[4*(r) + (i & 3)];                                   \
+        t = (t << s) | (t >> (32 - s));                                 \
+        a = d;                                                          \
+        d = c;                                                          \
+        c = b;                                                          \
+        b = b + t;                                                      \
+      }
+
+/* Define the function NAME processing LANES blocks with the vector
+   extension of GCC for the instruction set ISA.  */
+# define DEFINE_MD5_MB(name,isa,lanes)                                  \
+  typedef u32 name##_vec __attribute__ ((vector_size (4*(lanes))));     \
+  __attribute__ ((target (isa)))                                        \
+  static void                                                           \
+  name (u32 *state, const unsigned char **blocks)                       \
+  {                                                                     \
+    name##_vec a, b, c, d, t, w[16];                                    \
+    u32 x;                                                              \
+    int i, j, s;                                                        \
+                                                                        \
+    for (i=0; i < 16; i++)                                              \
+      for (j=0; j < (lanes); j++)                                       \
+        {                                                               \
+          memcpy (&x, blocks[j] + 4*i, 4);  /* x86 is little endian. */ \
+          w[i][j] = x;                                                  \
+        }                                                               \
+    memcpy (&a, state,           sizeof a);                             \
+    memcpy (&b, state + (lanes), sizeof b);                             \
+    memcpy (&c, state + 2*(lanes), sizeof c);                           \
+    memcpy (&d, state + 3*(lanes), sizeof d);                           \
+    MB_ROUND (MB_F, 0);                                                 \
+    MB_ROUND (MB_G, 1);                                                 \
+    MB_ROUND (MB_H, 2);                                                 \
+    MB_ROUND (MB_I, 3);                                                 \
+    for (j=0; j < (lanes); j++)                                         \
+      {                                                                 \
+        state[j]             += a[j];                                   \
+        state[(lanes)+j]     += b[j];                                   \
+        state[2*(lanes)+j]   += c[j];                                   \
+        state[3*(lanes)+j]   += d[j];                                   \
+      }                                                                 \
+  }
+DEFINE_MD5_MB (md5_mb_sse2, "sse2", 4)
+DEFINE_MD5_MB (md5_mb_avx2, "avx2", 8)
+# undef DEFINE_MD5_MB
+# undef MB_ROUND
+# undef MB_F
+# undef MB_G
+# undef MB_H
+# undef MB_I
+
+static int
+have_sse2 (void)
+{
+  return __builtin_cpu_supports ("sse2");
+}
+
+static int
+have_avx2 (void)
+{
+  return __builtin_cpu_supports ("avx2");
+}
+
+/* The multi-buffer implementations; best first.  */
+static struct
+{
+  const char *name;
+  int lanes;
+  void (*fnc) (u32 *state, const unsigned char **blocks);
+  int (*usable) (void);
+} md5_mb_transforms[] =
+  {
+    { "mb-avx2", 8, md5_mb_avx2, have_avx2 },
+    { "mb-sse2", 4, md5_mb_sse2, have_sse2 },
+    { NULL }
+  };
+
+/* The selected implementation; MD5_MB_LANES is 0 if none is usable.  */
+static void (*md5_mb) (u32 *state, const unsigned char **blocks);
+static int md5_mb_lanes;
+
+#define MB_MAXLANES 8
+
+
+/* Compute the MD5 digests of the N messages (DATA[i],LEN[i]) and
+   store them at DIGEST[i].  A lane which finishes its message takes
+   the next one.  */
+static void
+md5_many (int n, const unsigned char **data, const size_t *len,
+          unsigned char **digest)
+{
+  static const unsigned char dummy[64];
+  int lanes = md5_mb_lanes;
+  u32 state[4*MB_MAXLANES];
+  const unsigned char *blocks[MB_MAXLANES];
+  const unsigned char *p[MB_MAXLANES];
+  size_t nfull[MB_MAXLANES];
+  unsigned char tail[MB_MAXLANES][128];
+  int ntail[MB_MAXLANES], tpos[MB_MAXLANES], msg[MB_MAXLANES];
+  int next = 0, active, l, i, k;
+  u64 bits;
+
+  for (l=0; l < lanes; l++)
+    msg[l] = -1;
+  for (;;)
+    {
+      active = 0;
+      for (l=0; l < lanes; l++)
+        {
+          if (msg[l] == -1 && next < n)
+            {
+              /* Start the next message in this lane.  */
+              msg[l] = next++;
+              state[l]           = 0x67452301;
+              state[lanes+l]     = 0xefcdab89;
+              state[2*lanes+l]   = 0x98badcfe;
+              state[3*lanes+l]   = 0x10325476;
+              p[l] = data[msg[l]];
+              nfull[l] = len[msg[l]] / 64;
+              k = len[msg[l]] % 64;
+              memcpy (tail[l], p[l] + 64*nfull[l], k);
+              tail[l][k++] = 0x80;
+              ntail[l] = k > 56? 2 : 1;
+              tpos[l] = 0;
+              memset (tail[l] + k, 0, 64*ntail[l] - k);
+              bits = (u64)len[msg[l]] << 3;
+              for (i=0; i < 8; i++)
+                tail[l][64*ntail[l]-8+i] = bits >> (8*i);
+            }
+          if (msg[l] == -1)
+            blocks[l] = dummy;
+          else
+            {
+              active++;
+              if (nfull[l])
+                blocks[l] = p[l];
+              else
+                blocks[l] = tail[l] + 64*tpos[l];
+            }
+        }
+      if (!active)
+        break;
+
+      md5_mb (state, blocks);
+
+      for (l=0; l < lanes; l++)
+        {
+          if (msg[l] == -1)
+            continue;
+          if (nfull[l])
+            {
+              nfull[l]--;
+              p[l] += 64;
+              continue;
+            }
+          if (++tpos[l] < ntail[l])
+            continue;
+          /* Done.  */
+          for (i=0; i < 4; i++)
+            for (k=0; k < 4; k++)
+              digest[msg[l]][4*i+k] = state[i*lanes+l] >> (8*k);
+          msg[l] = -1;
+        }
+    }
 }
+#endif /*USE_MD5_MB*/
+
+
+/* Select the best transforms usable on this CPU.  */
+static void
+select_transform (void)
+{
+  int done[N_ALGOS] = { 0 };
+  int i;
 
-#endif /*BUILD_SHA1SUM*/
+#ifdef USE_X86_ACCEL
+  __builtin_cpu_init ();
+#endif
+  for (i=0; transforms[i].name; i++)
+    if (!done[transforms[i].algo]
+        && (!transforms[i].usable || transforms[i].usable ()))
+      {
+        algos[transforms[i].algo].transform = transforms[i].fnc;
+        done[transforms[i].algo] = 1;
+      }
+#ifdef USE_MD5_MB
+  md5_mb_lanes = 0;
+  for (i=0; md5_mb_transforms[i].name; i++)
+    if (md5_mb_transforms[i].usable ())
+      {
+        md5_mb = md5_mb_transforms[i].fnc;
+        md5_mb_lanes = md5_mb_transforms[i].lanes;
+        break;
+      }
+#endif
+}
 
 
 /* Update the message digest with the contents of (DATA,DATALEN).  */
 static void
-digest_write (DIGEST_CONTEXT *hd, void *data, size_t datalen)
+digest_write (DIGEST_CONTEXT *hd, const void *data, size_t datalen)
 {
-  unsigned char *inbuf = data;
+  const unsigned char *inbuf = data;
+  int blocksize = algos[hd->algo].blocksize;
 
-  if (hd->count == 64) /* Flush the buffer.  */
+  if (hd->count == blocksize) /* Flush the buffer.  */
     {
-      transform ( hd, hd->buf );
+      algos[hd->algo].transform (hd, hd->buf, 1);
       hd->count = 0;
       hd->nblocks++;
     }
@@ -551,23 +1146,34 @@ digest_write (DIGEST_CONTEXT *hd, void *data, size_t datalen)
     return;
   if ( hd->count ) 
     {
-      for ( ; datalen && hd->count < 64; datalen-- )
-        hd->buf[hd->count++] = *inbuf++;
-      digest_write( hd, NULL, 0 );
+      size_t n = blocksize - hd->count;
+
+      if (n > datalen)
+        n = datalen;
+      memcpy (hd->buf + hd->count, inbuf, n);
+      hd->count += n;
+      inbuf += n;
+      datalen -= n;
       if ( !datalen )
         return;
+      digest_write( hd, NULL, 0 );
     }
   
-  while( datalen >= 64 ) 
+  if (datalen >= blocksize)
     {
-      transform( hd, inbuf );
+      size_t nblocks = datalen / blocksize;
+
+      algos[hd->algo].transform (hd, inbuf, nblocks);
       hd->count = 0;
-      hd->nblocks++;
-      datalen -= 64;
-      inbuf += 64;
+      hd->nblocks += nblocks;
+      datalen -= nblocks * blocksize;
+      inbuf += nblocks * blocksize;
+    }
+  if (datalen)
+    {
+      memcpy (hd->buf, inbuf, datalen);
+      hd->count = datalen;
     }
-  for( ; datalen && hd->count < 64; datalen-- )
-    hd->buf[hd->count++] = *inbuf++;
 }
 
 
@@ -575,99 +1181,344 @@ digest_write (DIGEST_CONTEXT *hd, void *data, size_t datalen)
  * returns the digest.
  * The handle is prepared for a new cycle, but adding bytes to the
  * handle will the destroy the returned buffer.
- * Returns: DIGEST_LENGTH bytes representing the digest.
+ * Returns: The digest in the first DIGESTLEN bytes of HD->BUF.
  */
 
 static void
 digest_final(DIGEST_CONTEXT *hd)
 {
-  u32 t, msb, lsb;
+  int blocksize = algos[hd->algo].blocksize;
+  int lenpos = blocksize == 128? 112 : 56;
+  u64 lsb, msb;
   unsigned char *p;
+  int i, n;
   
   digest_write(hd, NULL, 0); /* Flush */;
-  
-  t = hd->nblocks;
-  /* Multiply by 64 to make a byte count.  */
-  lsb = t << 6;
-  msb = t >> 26;
-  /* Add the count.  */
-  t = lsb;
-  if ( (lsb += hd->count) < t )
-    msb++;
-  /* Multiply by 8 to make a bit count. */
-  t = lsb;
-  lsb <<= 3;
-  msb <<= 3;
-  msb |= t >> 29;
-
-  if ( hd->count < 56 ) /* Enough room is available. */
-    {
-      hd->buf[hd->count++] = 0x80; /* pad */
-      while( hd->count < 56 )
-        hd->buf[hd->count++] = 0;  /* pad */
-    }
-  else /* Need one extra block.  */
-    {
-      hd->buf[hd->count++] = 0x80; /* pad character */
-      while ( hd->count < 64 )
-        hd->buf[hd->count++] = 0;
+
+  /* The bit count.  MSB is only used by SHA-512.  */
+  lsb = (hd->nblocks * blocksize + hd->count) << 3;
+  msb = hd->nblocks >> (blocksize == 128? 54 : 55);
+
+  hd->buf[hd->count++] = 0x80; /* pad */
+  if ( hd->count > lenpos ) /* Need one extra block.  */
+    {
+      memset (hd->buf + hd->count, 0, blocksize - hd->count);
+      hd->count = blocksize;
       digest_write (hd, NULL, 0);  /* Flush */;
-      memset(hd->buf, 0, 56 );     /* Fill next block with zeroes.  */
     }
-  /* Append the 64 bit count. */
-#if defined(BUILD_MD5SUM)
-  hd->buf[56] = lsb;
-  hd->buf[57] = lsb >>  8;
-  hd->buf[58] = lsb >> 16;
-  hd->buf[59] = lsb >> 24;
-  hd->buf[60] = msb;
-  hd->buf[61] = msb >>  8;
-  hd->buf[62] = msb >> 16;
-  hd->buf[63] = msb >> 24;
-#else
-  hd->buf[56] = msb >> 24;
-  hd->buf[57] = msb >> 16;
-  hd->buf[58] = msb >>  8;
-  hd->buf[59] = msb;
-  hd->buf[60] = lsb >> 24;
-  hd->buf[61] = lsb >> 16;
-  hd->buf[62] = lsb >>  8;
-  hd->buf[63] = lsb;
-#endif
+  memset (hd->buf + hd->count, 0, lenpos - hd->count);
+
+  /* Append the count. */
+  if (hd->algo == ALGO_MD5)
+    {
+      for (i=0; i < 8; i++)
+        hd->buf[56+i] = lsb >> (8*i);
+    }
+  else
+    {
+      if (blocksize == 128)
+        for (i=0; i < 8; i++)
+          hd->buf[112+i] = msb >> (56 - 8*i);
+      for (i=0; i < 8; i++)
+        hd->buf[blocksize-8+i] = lsb >> (56 - 8*i);
+    }
 
-  transform( hd, hd->buf );
+  algos[hd->algo].transform (hd, hd->buf, 1);
   p = hd->buf;
-#if defined(BUILD_MD5SUM)
-#define X(a) do { *p++ = hd->a      ; *p++ = hd->a >> 8;      \
-	          *p++ = hd->a >> 16; *p++ = hd->a >> 24; } while(0)
-  X(A);
-  X(B);
-  X(C);
-  X(D);
-#else /* Not MD5 */
-# define X(a) do { *p++ = hd->h##a >> 24; *p++ = hd->h##a >> 16;         \
-		   *p++ = hd->h##a >> 8;  *p++ = hd->h##a; } while(0)
-  X(0);
-  X(1);
-  X(2);
-  X(3);
-  X(4);
-# if defined(BUILD_SHA256SUM) 
-  X(5);
-  X(6);
-  X(7);
-# endif /*BUILD_SHA256SUM*/
-#endif /*BUILD_SHA1SUM*/
-#undef X
+  switch (hd->algo)
+    {
+    case ALGO_MD5:
+      for (i=0; i < 4; i++)
+        {
+          *p++ = hd->h[i];       *p++ = hd->h[i] >> 8;
+          *p++ = hd->h[i] >> 16; *p++ = hd->h[i] >> 24;
+        }
+      break;
+    case ALGO_SHA512:
+      for (i=0; i < 8; i++)
+        for (n=56; n >= 0; n -= 8)
+          *p++ = hd->h64[i] >> n;
+      break;
+    default:
+      for (i=0; i < algos[hd->algo].digestlen/4; i++)
+        {
+          *p++ = hd->h[i] >> 24; *p++ = hd->h[i] >> 16;
+          *p++ = hd->h[i] >> 8;  *p++ = hd->h[i];
+        }
+      break;
+    }
+}
+
+
+/* Known answers for the self-test.  A COUNT larger than 1 repeats
+   the string.  */
+static struct
+{
+  int algo;
+  const char *data;
+  unsigned long count;
+  const char *digest;
+} test_vectors[] =
+  {
+    { ALGO_MD5, "", 1, "d41d8cd98f00b204e9800998ecf8427e" },
+    { ALGO_MD5, "abc", 1, "900150983cd24fb0d6963f7d28e17f72" },
+    { ALGO_MD5, "message digest", 1, "f96b697d7cb7938d525a2f31aaf161d0" },
+    { ALGO_MD5, "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq", 1,
+      "8215ef0796a20bcaaae116d3876c664a" },
+    { ALGO_MD5, "a", 1000000, "7707d6ae4e027c70eea2a935c2296f21" },
+    { ALGO_SHA1, "", 1, "da39a3ee5e6b4b0d3255bfef95601890afd80709" },
+    { ALGO_SHA1, "abc", 1, "a9993e364706816aba3e25717850c26c9cd0d89d" },
+    { ALGO_SHA1, "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq", 1,
+      "84983e441c3bd26ebaae4aa1f95129e5e54670f1" },
+    { ALGO_SHA1, "a", 1000000, "34aa973cd4c4daa4f61eeb2bdbad27316534016f" },
+    { ALGO_SHA256, "", 1,
+      "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855" },
+    { ALGO_SHA256, "abc", 1,
+      "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad" },
+    { ALGO_SHA256,
+      "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq", 1,
+      "248d6a61d20638b8e5c026930c3e6039a33ce45964ff2167f6ecedd419db06c1" },
+    { ALGO_SHA256, "a", 1000000,
+      "cdc76e5c9914fb9281a1c7e284d73e67f1809a48a497200e046d39ccc7112cd0" },
+    { ALGO_SHA512, "", 1,
+      "cf83e1357eefb8bdf1542850d66d8007d620e4050b5715dc83f4a921d36ce9ce"
+      "47d0d13c5d85f2b0ff8318d2877eec2f63b931bd47417a81a538327af927da3e" },
+    { ALGO_SHA512, "abc", 1,
+      "ddaf35a193617abacc417349ae20413112e6fa4e89a97ea20a9eeee64b55d39a"
+      "2192992a274fc1a836ba3c23a3feebbd454d4423643ce80e2a9ac94fa54ca49f" },
+    { ALGO_SHA512, "abcdefghbcdefghicdefghijdefghijkefghijklfghijklmghijklmn"
+      "hijklmnoijklmnopjklmnopqklmnopqrlmnopqrsmnopqrstnopqrstu", 1,
+      "8e959b75dae313da8cf4f72814fc143f8f7779c6eb9f7fa17299aeadb6889018"
+      "501d289e4900f7e4331b99dec4b5433ac7d329eeb6dd26545e96e55b874be909" },
+    { ALGO_SHA512, "a", 1000000,
+      "e718483d0ce769644e2e42c7bc15b4638e1f98b13b2044285632a803afa973eb"
+      "de0ff244877ea60a4cb0432ce577c31beb009c5c2c49aa2e4eadb217ad8cc09b" },
+    { 0, NULL }
+  };
+
+
+/* Check all usable transforms against the known answers and against
+   the generic one on data of all lengths.  Returns the number of
+   failures.  */
+static int
+selftest (void)
+{
+  static unsigned char data[1000];
+  DIGEST_CONTEXT ctx;
+  unsigned char expected[MAX_DIGEST_LENGTH];
+  char hexbuf[2*MAX_DIGEST_LENGTH+1];
+  unsigned long n;
+  size_t j, k;
+  int i, g, t, a, dlen, failed = 0, thisfailed;
+
+  for (j=0; j < sizeof data; j++)
+    data[j] = j * 7 + (j >> 3);
+
+  for (i=0; transforms[i].name; i++)
+    {
+      a = transforms[i].algo;
+      dlen = algos[a].digestlen;
+      if (transforms[i].usable && !transforms[i].usable ())
+        {
+          printf ("%-6s %-8s skipped\n", algos[a].name, transforms[i].name);
+          continue;
+        }
+      thisfailed = 0;
+
+      for (t=0; test_vectors[t].data; t++)
+        {
+          if (test_vectors[t].algo != a)
+            continue;
+          algos[a].transform = transforms[i].fnc;
+          digest_init (&ctx, a);
+          for (n=0; n < test_vectors[t].count; n++)
+            digest_write (&ctx, test_vectors[t].data,
+                          strlen (test_vectors[t].data));
+          digest_final (&ctx);
+          for (k=0; k < dlen; k++)
+            sprintf (hexbuf+2*k, "%02x", ctx.buf[k]);
+          if (strcmp (hexbuf, test_vectors[t].digest))
+            {
+              printf ("%-6s %-8s test %d failed\n",
+                      algos[a].name, transforms[i].name, t+1);
+              thisfailed = 1;
+            }
+        }
+
+      /* Compare with the generic implementation using differently
+         sized writes.  */
+      for (g=i; transforms[g].usable; g++)
+        ;
+      for (j=0; j < sizeof data && !thisfailed; j++)
+        {
+          algos[a].transform = transforms[g].fnc;
+          digest_init (&ctx, a);
+          digest_write (&ctx, data, j);
+          digest_final (&ctx);
+          memcpy (expected, ctx.buf, dlen);
+
+          algos[a].transform = transforms[i].fnc;
+          digest_init (&ctx, a);
+          digest_write (&ctx, data, j/3);
+          digest_write (&ctx, data + j/3, j - j/3);
+          digest_final (&ctx);
+          if (memcmp (expected, ctx.buf, dlen))
+            {
+              printf ("%-6s %-8s length %u failed\n", algos[a].name,
+                      transforms[i].name, (unsigned int)j);
+              thisfailed = 1;
+            }
+        }
+      printf ("%-6s %-8s %s\n", algos[a].name, transforms[i].name,
+              thisfailed? "FAILED":"ok");
+      failed += thisfailed;
+    }
+
+#ifdef USE_MD5_MB
+  /* Compare the multi-buffer MD5 with the generic one using
+     messages of different lengths.  */
+  for (i=0; md5_mb_transforms[i].name; i++)
+    {
+      const unsigned char *msgs[50];
+      size_t lens[50];
+      unsigned char digests[50][16];
+      unsigned char *dptrs[50];
+
+      if (!md5_mb_transforms[i].usable ())
+        {
+          printf ("%-6s %-8s skipped\n", "md5", md5_mb_transforms[i].name);
+          continue;
+        }
+      md5_mb = md5_mb_transforms[i].fnc;
+      md5_mb_lanes = md5_mb_transforms[i].lanes;
+      for (t=0; t < 50; t++)
+        {
+          lens[t] = (t * 97) % 300;
+          msgs[t] = data + t;
+          dptrs[t] = digests[t];
+        }
+      md5_many (50, msgs, lens, dptrs);
+      algos[ALGO_MD5].transform = transform_md5;
+      thisfailed = 0;
+      for (t=0; t < 50; t++)
+        {
+          digest_init (&ctx, ALGO_MD5);
+          digest_write (&ctx, msgs[t], lens[t]);
+          digest_final (&ctx);
+          if (memcmp (ctx.buf, digests[t], 16))
+            {
+              printf ("%-6s %-8s length %u failed\n", "md5",
+                      md5_mb_transforms[i].name, (unsigned int)lens[t]);
+              thisfailed = 1;
+            }
+        }
+      printf ("%-6s %-8s %s\n", "md5", md5_mb_transforms[i].name,
+              thisfailed? "FAILED":"ok");
+      failed += thisfailed;
+    }
+#endif /*USE_MD5_MB*/
+
+  select_transform ();
+  return failed;
+}
+
+
+/* Print the throughput of all usable transforms.  */
+static void
+benchmark (void)
+{
+  static unsigned char data[65536];
+  DIGEST_CONTEXT ctx;
+  unsigned long n, total;
+  clock_t start, elapsed;
+  int i, a;
+
+  for (n=0; n < sizeof data; n++)
+    data[n] = n;
+  for (i=0; transforms[i].name; i++)
+    {
+      if (transforms[i].usable && !transforms[i].usable ())
+        continue;
+      a = transforms[i].algo;
+      algos[a].transform = transforms[i].fnc;
+      digest_init (&ctx, a);
+      start = clock ();
+      total = 0;
+      do
+        {
+          for (n=0; n < 64; n++)
+            digest_write (&ctx, data, sizeof data);
+          total += 64 * sizeof data;
+          elapsed = clock () - start;
+        }
+      while (elapsed < CLOCKS_PER_SEC / 2);
+      digest_final (&ctx);
+      printf ("%-6s %-8s %8.1f MB/s\n", algos[a].name, transforms[i].name,
+              (double)total / (1024*1024)
+              / ((double)elapsed / CLOCKS_PER_SEC));
+    }
+
+#ifdef USE_MD5_MB
+  /* The multi-buffer MD5 on 16 messages of 4k each.  */
+  for (i=0; md5_mb_transforms[i].name; i++)
+    {
+      const unsigned char *msgs[16];
+      size_t lens[16];
+      unsigned char digests[16][16];
+      unsigned char *dptrs[16];
+
+      if (!md5_mb_transforms[i].usable ())
+        continue;
+      md5_mb = md5_mb_transforms[i].fnc;
+      md5_mb_lanes = md5_mb_transforms[i].lanes;
+      for (a=0; a < 16; a++)
+        {
+          msgs[a] = data + 4096 * a;
+          lens[a] = 4096;
+          dptrs[a] = digests[a];
+        }
+      start = clock ();
+      total = 0;
+      do
+        {
+          for (n=0; n < 64; n++)
+            md5_many (16, msgs, lens, dptrs);
+          total += 64 * 16 * 4096;
+          elapsed = clock () - start;
+        }
+      while (elapsed < CLOCKS_PER_SEC / 2);
+      printf ("%-6s %-8s %8.1f MB/s\n", "md5", md5_mb_transforms[i].name,
+              (double)total / (1024*1024)
+              / ((double)elapsed / CLOCKS_PER_SEC));
+    }
+#endif /*USE_MD5_MB*/
+  select_transform ();
 }
 
-
+
 /* Stats for the check fucntion.  */
 static unsigned int filecount;
 static unsigned int readerrors;
 static unsigned int checkcount;
 static unsigned int matcherrors;
 
+/* The size of the read buffer.  */
+#define IOBUFSIZE (256*1024)
+
+/* Number of files to hash in parallel (option -j).  */
+static int opt_jobs = 1;
+
+/* The chunk size for option -T and the number of threads used to
+   hash the chunks.  */
+static u64 opt_tree;
+static int tree_threads;
+
+/* The algorithms to compute (option -a), their number and the
+   streams for their results.  */
+static int opt_algos[N_ALGOS];
+static int nalgos;
+static FILE *sumsfp[N_ALGOS];
+
 /* We need to escape the fname so that included linefeeds etc don't
    mess up the the output file.  On windows we also turn backslashes
    into slashes so that we don't get into conflicts with the escape
@@ -769,74 +1620,1261 @@ unescapefname (char *fname)
 
 
 
-static int
-hash_file (const char *fname, const char *expected)
+/* A file to be hashed.  In parallel mode these are kept in a ring
+   buffer so that the results can be printed in input order.  */
+typedef struct
 {
-  FILE *fp;
-  char buffer[4096];
-  size_t n;
-  DIGEST_CONTEXT ctx;
-  int i;
-  char *fnamebuf;
-  int escaped;
+  char *fname;
+  char *expected;       /* The expected digest in check mode or NULL.  */
+  int state;            /* One of the JOB_ constants.  */
+  int failure;          /* 0, FAIL_OPEN or FAIL_READ.  */
+  int err;              /* The errno value for a failure.  */
+  unsigned char digest[N_ALGOS][MAX_DIGEST_LENGTH];
+} JOB;
+
+#define JOB_QUEUED  0
+#define JOB_RUNNING 1
+#define JOB_DONE    2
+
+#define FAIL_OPEN   1
+#define FAIL_READ   2
+
+
+/* Allocate a page aligned buffer of IOBUFSIZE bytes.  */
+static unsigned char *
+alloc_iobuf (void)
+{
+  void *p;
 
-  filecount++;
-  if (!expected && *fname == '-' && !fname[1])
-    {
-      /* Not in check mode and asked to read from stdin.  */
-      fp = stdin;
 #ifdef _WIN32
-      setmode (fileno (fp), O_BINARY);
+  p = malloc (IOBUFSIZE);
+#else
+  if (posix_memalign (&p, 4096, IOBUFSIZE))
+    p = NULL;
 #endif
+  if (!p)
+    {
+      fprintf (stderr, PGM": can't allocate buffer: %s\n", strerror (errno));
+      exit (2);
     }
-  else
-    fp = fopen (fname, "rb");
+  return p;
+}
+
+
+#ifdef USE_THREADS
+/* A part of the work for hash_data.  */
+struct hash_part_s
+{
+  DIGEST_CONTEXT *ctx;
+  const void *data;
+  size_t len;
+};
+
+static void *
+hash_part_thread (void *arg)
+{
+  struct hash_part_s *part = arg;
+
+  digest_write (part->ctx, part->data, part->len);
+  return NULL;
+}
+#endif /*USE_THREADS*/
+
+
+/* Hash (DATA,LEN) with all selected algorithms using the contexts in
+   the array CTX.  If several algorithms are requested and we are not
+   already hashing files in parallel, large chunks are hashed with
+   one thread per algorithm.  */
+static void
+hash_data (DIGEST_CONTEXT *ctx, const void *data, size_t len)
+{
+  int a;
+#ifdef USE_THREADS
+  struct hash_part_s parts[N_ALGOS];
+  pthread_t tids[N_ALGOS];
+  int started[N_ALGOS];
+  int first = -1;
+
+  if (nalgos > 1 && opt_jobs < 2 && len >= 4*IOBUFSIZE)
+    {
+      for (a=0; a < N_ALGOS; a++)
+        {
+          started[a] = 0;
+          if (!opt_algos[a])
+            continue;
+          if (first == -1)
+            {
+              first = a;  /* We do this one ourself.  */
+              continue;
+            }
+          parts[a].ctx = ctx + a;
+          parts[a].data = data;
+          parts[a].len = len;
+          if (!pthread_create (tids + a, NULL, hash_part_thread, parts + a))
+            started[a] = 1;
+          else
+            digest_write (ctx + a, data, len);
+        }
+      digest_write (ctx + first, data, len);
+      for (a=0; a < N_ALGOS; a++)
+        if (started[a])
+          pthread_join (tids[a], NULL);
+      return;
+    }
+#endif /*USE_THREADS*/
+
+  for (a=0; a < N_ALGOS; a++)
+    if (opt_algos[a])
+      digest_write (ctx + a, data, len);
+}
+
+
+static void
+bin2hex (const unsigned char *data, size_t len, char *buffer)
+{
+  size_t i;
+
+  for (i=0; i < len; i++)
+    sprintf (buffer+2*i, "%02x", data[i]);
+}
+
+
+/* With option --cache FILE the digests of regular files are
+   remembered together with the device, inode, size, mtime and ctime
+   of the file.  As long as these do not change the file is not read
+   again.  The file is a text file with one entry per line; it is
+   read into a hash table at startup and written back at exit.  */
+#ifdef USE_CACHE
+typedef struct
+{
+  int algo;             /* -1 for an empty slot.  */
+  unsigned long long dev, ino, size, mtime, ctime;  /* Times in ns.  */
+  unsigned char digest[MAX_DIGEST_LENGTH];
+} CACHE_ENTRY;
+
+static struct
+{
+  const char *fname;
+  pthread_mutex_t lock;
+  CACHE_ENTRY *table;
+  size_t size;          /* The number of slots; a power of 2.  */
+  size_t used;
+  int dirty;
+} cache = { NULL, PTHREAD_MUTEX_INITIALIZER };
+
+/* Option --paranoid: Do not take digests from the cache.  */
+static int opt_paranoid;
+
+
+/* Fill the key fields of ENTRY from ST.  */
+static void
+cache_key (const struct stat *st, int algo, CACHE_ENTRY *entry)
+{
+  entry->algo = algo;
+  entry->dev = st->st_dev;
+  entry->ino = st->st_ino;
+  entry->size = st->st_size;
+  entry->mtime = (st->st_mtim.tv_sec * 1000000000ULL + st->st_mtim.tv_nsec);
+  entry->ctime = (st->st_ctim.tv_sec * 1000000000ULL + st->st_ctim.tv_nsec);
+}
+
+
+/* Return the slot for the file and algorithm of KEY.  This is either
+   the slot with that file or an empty one.  */
+static CACHE_ENTRY *
+cache_slot (const CACHE_ENTRY *key)
+{
+  CACHE_ENTRY *slot;
+  size_t idx;
+
+  idx = ((key->ino * 0x9e3779b97f4a7c15ULL) ^ (key->dev * 0xff51afd7ed558ccdULL)
+         ^ key->algo);
+  for (;;)
+    {
+      slot = cache.table + (idx & (cache.size - 1));
+      if (slot->algo == -1
+          || (slot->algo == key->algo && slot->dev == key->dev
+              && slot->ino == key->ino))
+        return slot;
+      idx++;
+    }
+}
+
+
+/* Insert or replace the entry KEY.  */
+static void
+cache_put (const CACHE_ENTRY *key)
+{
+  CACHE_ENTRY *slot, *old;
+  size_t i, oldsize;
+
+  if (2 * (cache.used + 1) > cache.size)
+    {
+      old = cache.table;
+      oldsize = cache.size;
+      cache.size = oldsize? 2 * oldsize : 1024;
+      cache.table = malloc (cache.size * sizeof *cache.table);
+      if (!cache.table)
+        {
+          fprintf (stderr, PGM": can't allocate buffer: %s\n",
+                   strerror (errno));
+          exit (2);
+        }
+      for (i=0; i < cache.size; i++)
+        cache.table[i].algo = -1;
+      for (i=0; i < oldsize; i++)
+        if (old[i].algo != -1)
+          *cache_slot (old + i) = old[i];
+      free (old);
+    }
+  slot = cache_slot (key);
+  if (slot->algo == -1)
+    cache.used++;
+  *slot = *key;
+  cache.dirty = 1;
+}
+
+
+static void
+cache_load (const char *fname)
+{
+  FILE *fp;
+  char line[256];
+  char algoname[20], hexbuf[2*MAX_DIGEST_LENGTH+1];
+  CACHE_ENTRY entry;
+  int a, i, c;
+
+  cache.fname = fname;
+  fp = fopen (fname, "r");
   if (!fp)
     {
-      fprintf (stderr, PGM": can't open `%s': %s\n",
-               fname, strerror (errno));
-      if (expected)
-        printf ("%s: FAILED open\n", fname);
-      readerrors++;
+      if (errno != ENOENT)
+        fprintf (stderr, PGM": can't open `%s': %s\n",
+                 fname, strerror (errno));
+      return;
+    }
+  while (fgets (line, sizeof line, fp))
+    {
+      if (sscanf (line, "%19s %llu %llu %llu %llu %llu %128s", algoname,
+                  &entry.dev, &entry.ino, &entry.size,
+                  &entry.mtime, &entry.ctime, hexbuf) != 7)
+        continue;
+      for (a=0; a < N_ALGOS && strcmp (algoname, algos[a].name); a++)
+        ;
+      if (a == N_ALGOS || strlen (hexbuf) != 2*algos[a].digestlen)
+        continue;
+      for (i=0; i < algos[a].digestlen; i++)
+        {
+          if (sscanf (hexbuf+2*i, "%2x", &c) != 1)
+            break;
+          entry.digest[i] = c;
+        }
+      if (i < algos[a].digestlen)
+        continue;
+      entry.algo = a;
+      cache_put (&entry);
+    }
+  fclose (fp);
+  cache.dirty = 0;
+}
+
+
+/* Write the cache back if it has been changed.  A new file is
+   written and then renamed so that an interrupted run does not
+   destroy the cache.  */
+static int
+cache_save (void)
+{
+  FILE *fp;
+  char *tmpname;
+  char hexbuf[2*MAX_DIGEST_LENGTH+1];
+  CACHE_ENTRY *e;
+  size_t i;
+  int failed;
+
+  if (!cache.fname || !cache.dirty)
+    return 0;
+  tmpname = malloc (strlen (cache.fname) + 5);
+  if (!tmpname)
+    {
+      fprintf (stderr, PGM": can't allocate buffer: %s\n", strerror (errno));
+      exit (2);
+    }
+  strcpy (tmpname, cache.fname);
+  strcat (tmpname, ".tmp");
+  fp = fopen (tmpname, "w");
+  if (!fp)
+    {
+      fprintf (stderr, PGM": can't create `%s': %s\n",
+               tmpname, strerror (errno));
+      free (tmpname);
+      return -1;
+    }
+  for (i=0; i < cache.size; i++)
+    {
+      e = cache.table + i;
+      if (e->algo == -1)
+        continue;
+      bin2hex (e->digest, algos[e->algo].digestlen, hexbuf);
+      fprintf (fp, "%s %llu %llu %llu %llu %llu %s\n", algos[e->algo].name,
+               e->dev, e->ino, e->size, e->mtime, e->ctime, hexbuf);
+    }
+  failed = ferror (fp);
+  if (fclose (fp))
+    failed = 1;
+  if (failed || rename (tmpname, cache.fname))
+    {
+      fprintf (stderr, PGM": error writing `%s': %s\n",
+               tmpname, strerror (errno));
+      remove (tmpname);
+      free (tmpname);
       return -1;
     }
-  digest_init (&ctx);
-  while ( (n = fread (buffer, 1, sizeof buffer, fp)))
-    digest_write (&ctx, buffer, n);
+  free (tmpname);
+  return 0;
+}
+
+
+/* Copy the cached digest of the file described by ST to DIGEST.
+   Returns true on success.  */
+static int
+cache_lookup (const struct stat *st, int algo, unsigned char *digest)
+{
+  CACHE_ENTRY key, *slot;
+  int found = 0;
+
+  cache_key (st, algo, &key);
+  pthread_mutex_lock (&cache.lock);
+  if (cache.size)
+    {
+      slot = cache_slot (&key);
+      if (slot->algo != -1 && slot->size == key.size
+          && slot->mtime == key.mtime && slot->ctime == key.ctime)
+        {
+          memcpy (digest, slot->digest, algos[algo].digestlen);
+          found = 1;
+        }
+    }
+  pthread_mutex_unlock (&cache.lock);
+  return found;
+}
+
+
+/* Remember DIGEST for the file described by ST which we started to
+   read at STARTTIME.  A file changed in the same second as we read
+   it may be changed again without a visible change of its times;
+   such a file is not stored.  */
+static void
+cache_store (const struct stat *st, time_t starttime, int algo,
+             const unsigned char *digest)
+{
+  CACHE_ENTRY key;
+
+  if (st->st_mtime >= starttime - 1 || st->st_ctime >= starttime - 1)
+    return;
+  cache_key (st, algo, &key);
+  memcpy (key.digest, digest, algos[algo].digestlen);
+  pthread_mutex_lock (&cache.lock);
+  cache_put (&key);
+  pthread_mutex_unlock (&cache.lock);
+}
+#endif /*USE_CACHE*/
+
+
+#ifdef USE_MD5_MB
+/* Files up to MB_SMALLFILE bytes are read into memory and then
+   hashed in batches of up to MB_BATCH files with md5_many.  */
+#define MB_SMALLFILE 65536
+#define MB_BATCH     32
+
+/* Set if batches are used; i.e. only MD5 is requested.  */
+static int mb_enabled;
+
+struct mb_batch_s
+{
+  int n;
+  JOB *jobs[MB_BATCH];
+  const unsigned char *data[MB_BATCH];
+  size_t len[MB_BATCH];
+  unsigned char *buffer;  /* MB_BATCH * MB_SMALLFILE bytes.  */
+#ifdef USE_CACHE
+  struct stat st[MB_BATCH];
+  time_t starttime[MB_BATCH];
+#endif
+};
+
+
+static void
+mb_batch_init (struct mb_batch_s *batch)
+{
+  memset (batch, 0, sizeof *batch);
+  batch->buffer = malloc (MB_BATCH * MB_SMALLFILE);
+  if (!batch->buffer)
+    {
+      fprintf (stderr, PGM": can't allocate buffer: %s\n", strerror (errno));
+      exit (2);
+    }
+}
+
+
+/* Compute the digests of all files in BATCH.  */
+static void
+mb_finish (struct mb_batch_s *batch)
+{
+  unsigned char *digests[MB_BATCH];
+  int i;
+
+  if (!batch->n)
+    return;
+  for (i=0; i < batch->n; i++)
+    digests[i] = batch->jobs[i]->digest[ALGO_MD5];
+  md5_many (batch->n, batch->data, batch->len, digests);
+#ifdef USE_CACHE
+  for (i=0; i < batch->n; i++)
+    if (batch->starttime[i])
+      cache_store (batch->st + i, batch->starttime[i], ALGO_MD5, digests[i]);
+#endif
+  batch->n = 0;
+}
+#else /*!USE_MD5_MB*/
+struct mb_batch_s;
+# define MB_BATCH 1
+# define mb_enabled 0
+#endif /*!USE_MD5_MB*/
+
+
+/* Compute the digest for JOB.  This may run in a worker thread and
+   thus must not print anything.  */
+static void
+compute_digest (JOB *job, unsigned char *buffer, struct mb_batch_s *batch)
+{
+  FILE *fp;
+  size_t n;
+  DIGEST_CONTEXT ctx[N_ALGOS];
+  int a;
+#ifdef USE_MMAP
+  struct stat st;
+  int isreg;
+#endif
+#ifdef USE_CACHE
+  time_t starttime = 0;
+#endif
+
+  if (!job->expected && *job->fname == '-' && !job->fname[1])
+    {
+      /* Not in check mode and asked to read from stdin.  */
+      fp = stdin;
+#ifdef _WIN32
+      setmode (fileno (fp), O_BINARY);
+#endif
+    }
+  else
+    fp = fopen (job->fname, "rb");
+  if (!fp)
+    {
+      job->failure = FAIL_OPEN;
+      job->err = errno;
+      return;
+    }
+#ifdef USE_MMAP
+  isreg = !fstat (fileno (fp), &st) && S_ISREG (st.st_mode);
+#endif
+#ifdef USE_CACHE
+  if (cache.fname && isreg)
+    {
+      for (a=0; a < N_ALGOS; a++)
+        if (opt_algos[a]
+            && (opt_paranoid || !cache_lookup (&st, a, job->digest[a])))
+          break;
+      if (a == N_ALGOS)
+        {
+          if (fp != stdin)
+            fclose (fp);
+          return;
+        }
+      starttime = time (NULL);
+    }
+#endif /*USE_CACHE*/
+
+#ifdef USE_MD5_MB
+  /* Read a small file into the batch.  The digest is computed later
+     by mb_finish.  */
+  if (batch && isreg && fp != stdin && st.st_size <= MB_SMALLFILE)
+    {
+      unsigned char *p = batch->buffer + batch->n * MB_SMALLFILE;
+
+      setvbuf (fp, NULL, _IONBF, 0);
+      n = fread (p, 1, MB_SMALLFILE, fp);
+      if (ferror (fp))
+        {
+          job->failure = FAIL_READ;
+          job->err = errno;
+          fclose (fp);
+          return;
+        }
+      if (n < MB_SMALLFILE || getc (fp) == EOF)
+        {
+          batch->jobs[batch->n] = job;
+          batch->data[batch->n] = p;
+          batch->len[batch->n] = n;
+# ifdef USE_CACHE
+          batch->st[batch->n] = st;
+          batch->starttime[batch->n] = starttime;
+# endif
+          batch->n++;
+          fclose (fp);
+          return;
+        }
+      rewind (fp);  /* The file has grown; hash it the usual way.  */
+    }
+#else
+  (void)batch;
+#endif /*USE_MD5_MB*/
+
+  for (a=0; a < N_ALGOS; a++)
+    if (opt_algos[a])
+      digest_init (ctx + a, a);
+
+  /* We read into our own large buffer; the buffering of stdio would
+     only add another copy.  */
+  setvbuf (fp, NULL, _IONBF, 0);
+#ifdef USE_MMAP
+  posix_fadvise (fileno (fp), 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+  while ( (n = fread (buffer, 1, IOBUFSIZE, fp)))
+    hash_data (ctx, buffer, n);
   if (ferror (fp))
     {
-      fprintf (stderr, PGM": error reading `%s': %s\n",
-               fname, strerror (errno));
+      job->failure = FAIL_READ;
+      job->err = errno;
       if (fp != stdin)
         fclose (fp);
+      return;
+    }
+
+  if (fp != stdin)
+    fclose (fp);
+  for (a=0; a < N_ALGOS; a++)
+    if (opt_algos[a])
+      {
+        digest_final (ctx + a);
+        memcpy (job->digest[a], ctx[a].buf, algos[a].digestlen);
+#ifdef USE_CACHE
+        if (starttime)
+          cache_store (&st, starttime, a, job->digest[a]);
+#endif
+      }
+}
+
+
+/* Print the result of JOB and update the stats.  */
+static int
+report_digest (JOB *job)
+{
+  const char *fname = job->fname;
+  const char *expected = job->expected;
+  char buffer[2*MAX_DIGEST_LENGTH+1];
+  int i, a;
+  char *fnamebuf;
+  int escaped;
+
+  filecount++;
+  if (job->failure)
+    {
+      fprintf (stderr, PGM": %s `%s': %s\n",
+               job->failure == FAIL_OPEN? "can't open":"error reading",
+               fname, strerror (job->err));
       if (expected)
-        printf ("%s: FAILED read\n", fname);
+        printf ("%s: FAILED %s\n", fname,
+                job->failure == FAIL_OPEN? "open":"read");
       readerrors++;
       return -1;
     }
-  digest_final (&ctx);
-  if (fp != stdin)
-    fclose (fp);
   
   fnamebuf = escapefname (fname, &escaped);
   fname = fnamebuf;
 
   checkcount++;
-  for (i=0; i < DIGEST_LENGTH; i++)
-    snprintf (buffer+2*i, 10, "%02x", ctx.buf[i]);
+  for (a=0; a < N_ALGOS; a++)
+    {
+      if (!opt_algos[a])
+        continue;
+      for (i=0; i < algos[a].digestlen; i++)
+        snprintf (buffer+2*i, 3, "%02x", job->digest[a][i]);
+      if (expected)  /* Note that -c allows only one algorithm.  */
+        {
+          if (strcmp (buffer, expected))
+            {
+              printf ("%s: FAILED\n", fname);
+              matcherrors++;
+              free (fnamebuf);
+              return -1;
+            }
+          printf ("%s: OK\n", fname);
+        }
+      else
+        fprintf (sumsfp[a], "%s%s  %s\n", escaped? "\\":"", buffer, fname);
+    }
+  free (fnamebuf);
+  return 0;
+}
+
+
+static int
+hash_file (const char *fname, const char *expected)
+{
+  static unsigned char *iobuf;
+  JOB job;
+
+  if (!iobuf)
+    iobuf = alloc_iobuf ();
+  memset (&job, 0, sizeof job);
+  job.fname = (char*)fname;
+  job.expected = (char*)expected;
+  compute_digest (&job, iobuf, NULL);
+  return report_digest (&job);
+}
+
+
+
+/* With option -T a file is split into chunks of a fixed size which
+   are hashed in parallel.  The result is the Merkle tree hash over
+   the chunk digests as defined by RFC-6962: a leaf is H(0x00||chunk)
+   and an inner node is H(0x01||left||right).  The chunk digests are
+   also written to a sidecar file FNAME.ALGO.CHUNKSIZE.chunks so that
+   -c is able to tell which chunk is corrupt.  */
+#ifdef USE_THREADS
+struct tree_s
+{
+  int fd;
+  int algo;
+  u64 size;
+  u64 chunksize;
+  u64 nchunks;
+  unsigned char *leaves;  /* NCHUNKS digests.  */
+  u64 next;               /* The next chunk to hash.  */
+  int err;                /* The errno of the first read error.  */
+  pthread_mutex_t lock;
+};
+
+
+static void *
+tree_worker (void *arg)
+{
+  struct tree_s *tree = arg;
+  int dlen = algos[tree->algo].digestlen;
+  unsigned char *iobuf = alloc_iobuf ();
+  DIGEST_CONTEXT ctx;
+  u64 idx, off, end;
+  size_t want;
+  ssize_t n;
+
+  for (;;)
+    {
+      pthread_mutex_lock (&tree->lock);
+      idx = tree->err? tree->nchunks : tree->next++;
+      pthread_mutex_unlock (&tree->lock);
+      if (idx >= tree->nchunks)
+        break;
+
+      digest_init (&ctx, tree->algo);
+      digest_write (&ctx, "\x00", 1);
+      off = idx * tree->chunksize;
+      end = off + tree->chunksize;
+      if (end > tree->size)
+        end = tree->size;
+      while (off < end)
+        {
+          want = (end - off > IOBUFSIZE)? IOBUFSIZE : end - off;
+          n = pread (tree->fd, iobuf, want, off);
+          if (n <= 0)
+            {
+              pthread_mutex_lock (&tree->lock);
+              if (!tree->err)
+                tree->err = n? errno : EIO;  /* EIO for a shrunk file.  */
+              pthread_mutex_unlock (&tree->lock);
+              goto leave;
+            }
+          digest_write (&ctx, iobuf, n);
+          off += n;
+        }
+      digest_final (&ctx);
+      memcpy (tree->leaves + idx * dlen, ctx.buf, dlen);
+    }
+
+ leave:
+  free (iobuf);
+  return NULL;
+}
+
+
+/* Store the Merkle tree hash of the N digests at LEAVES in ROOT.  */
+static void
+tree_root (int algo, const unsigned char *leaves, u64 n, unsigned char *root)
+{
+  int dlen = algos[algo].digestlen;
+  unsigned char left[MAX_DIGEST_LENGTH], right[MAX_DIGEST_LENGTH];
+  DIGEST_CONTEXT ctx;
+  u64 k;
+
+  if (n == 1)
+    {
+      memcpy (root, leaves, dlen);
+      return;
+    }
+  digest_init (&ctx, algo);
+  if (n)
+    {
+      /* The left subtree takes the largest power of 2 less than N.  */
+      for (k=1; 2*k < n; k *= 2)
+        ;
+      tree_root (algo, leaves, k, left);
+      tree_root (algo, leaves + k * dlen, n - k, right);
+      digest_write (&ctx, "\x01", 1);
+      digest_write (&ctx, left, dlen);
+      digest_write (&ctx, right, dlen);
+    }
+  digest_final (&ctx);
+  memcpy (root, ctx.buf, dlen);
+}
+
+
+/* Return a malloced string with the name of the chunk list of FNAME
+   for the algorithm and the chunk size of TREE.  */
+static char *
+chunk_list_name (const char *fname, struct tree_s *tree)
+{
+  char *listname;
+
+  listname = malloc (strlen (fname) + 1 + strlen (algos[tree->algo].name)
+                     + 1 + 20 + 7 + 1);
+  if (!listname)
+    {
+      fprintf (stderr, PGM": can't allocate buffer: %s\n", strerror (errno));
+      exit (2);
+    }
+  sprintf (listname, "%s.%s.%llu.chunks", fname, algos[tree->algo].name,
+           (unsigned long long)tree->chunksize);
+  return listname;
+}
+
+
+/* Write the chunk list of TREE for FNAME.  The first line gives the
+   algorithm, the chunk size and the file size; then one digest per
+   line follows.  The list is only an aid for -c; thus errors are
+   printed as warnings.  */
+static void
+write_chunk_list (const char *fname, struct tree_s *tree)
+{
+  int dlen = algos[tree->algo].digestlen;
+  char hexbuf[2*MAX_DIGEST_LENGTH+1];
+  char *listname;
+  FILE *fp;
+  u64 idx;
+
+  listname = chunk_list_name (fname, tree);
+  fp = fopen (listname, "w");
+  if (!fp)
+    {
+      fprintf (stderr, PGM": warning: can't create `%s': %s\n",
+               listname, strerror (errno));
+      free (listname);
+      return;
+    }
+  fprintf (fp, "tree %s %llu %llu\n", algos[tree->algo].name,
+           (unsigned long long)tree->chunksize,
+           (unsigned long long)tree->size);
+  for (idx=0; idx < tree->nchunks; idx++)
+    {
+      bin2hex (tree->leaves + idx * dlen, dlen, hexbuf);
+      fprintf (fp, "%s\n", hexbuf);
+    }
+  if (ferror (fp))
+    {
+      fprintf (stderr, PGM": warning: error writing `%s': %s\n",
+               listname, strerror (errno));
+      fclose (fp);
+      remove (listname);
+    }
+  else if (fclose (fp))
+    {
+      fprintf (stderr, PGM": warning: error writing `%s': %s\n",
+               listname, strerror (errno));
+      remove (listname);
+    }
+  free (listname);
+}
+
+
+/* Read the chunk list of FNAME.  Returns the digests or NULL if the
+   list is not available or does not fit to TREE.  The number of
+   digests and the file size are stored at R_N and R_SIZE.  */
+static unsigned char *
+read_chunk_list (const char *fname, struct tree_s *tree,
+                 u64 *r_n, u64 *r_size)
+{
+  int dlen = algos[tree->algo].digestlen;
+  char line[2*MAX_DIGEST_LENGTH+3];
+  char algoname[20];
+  unsigned long long chunksize, size;
+  unsigned char *leaves = NULL;
+  u64 n = 0, nalloced = 0;
+  char *listname;
+  FILE *fp;
+  int i, c;
+
+  listname = chunk_list_name (fname, tree);
+  fp = fopen (listname, "r");
+  free (listname);
+  if (!fp)
+    return NULL;
+  if (fscanf (fp, "tree %19s %llu %llu\n", algoname, &chunksize, &size) != 3
+      || strcmp (algoname, algos[tree->algo].name)
+      || chunksize != tree->chunksize)
+    goto leave;
+  while (fgets (line, sizeof line, fp))
+    {
+      if (strlen (line) != 2*dlen+1 || line[2*dlen] != '\n')
+        goto leave;
+      if (n == nalloced)
+        {
+          unsigned char *tmp;
+
+          nalloced = nalloced? 2*nalloced : 64;
+          tmp = realloc (leaves, nalloced * dlen);
+          if (!tmp)
+            goto leave;
+          leaves = tmp;
+        }
+      for (i=0; i < dlen; i++)
+        {
+          if (sscanf (line+2*i, "%2x", &c) != 1)
+            goto leave;
+          leaves[n*dlen+i] = c;
+        }
+      n++;
+    }
+  if (ferror (fp))
+    goto leave;
+  fclose (fp);
+  *r_n = n;
+  *r_size = size;
+  return leaves;
+
+ leave:
+  fclose (fp);
+  free (leaves);
+  return NULL;
+}
+
+
+/* Tell which chunks of FNAME do not match the chunk list.  EXPECTED
+   is the root from the checksum file which is used to check the
+   list.  PRINTNAME is the escaped FNAME.  Returns true if the list
+   was usable.  */
+static int
+report_bad_chunks (const char *fname, const char *printname,
+                   const char *expected, struct tree_s *tree)
+{
+  int dlen = algos[tree->algo].digestlen;
+  unsigned char root[MAX_DIGEST_LENGTH];
+  char hexbuf[2*MAX_DIGEST_LENGTH+1];
+  unsigned char *leaves;
+  u64 n, size, idx;
+
+  leaves = read_chunk_list (fname, tree, &n, &size);
+  if (!leaves)
+    return 0;
+  tree_root (tree->algo, leaves, n, root);
+  bin2hex (root, dlen, hexbuf);
+  if (strcmp (hexbuf, expected))
+    {
+      fprintf (stderr, PGM": chunk list for `%s' does not match\n", fname);
+      free (leaves);
+      return 0;
+    }
+  if (size != tree->size)
+    printf ("%s: size changed from %llu to %llu\n", printname,
+            (unsigned long long)size, (unsigned long long)tree->size);
+  for (idx=0; idx < n && idx < tree->nchunks; idx++)
+    if (memcmp (leaves + idx * dlen, tree->leaves + idx * dlen, dlen))
+      printf ("%s: chunk %llu at offset %llu is corrupt\n", printname,
+              (unsigned long long)idx,
+              (unsigned long long)(idx * tree->chunksize));
+  free (leaves);
+  return 1;
+}
+
+
+/* Hash FNAME in chunks of CHUNKSIZE and print the tree hash or, if
+   EXPECTED is not NULL, compare it against EXPECTED.  */
+static int
+tree_file (const char *fname, const char *expected, u64 chunksize)
+{
+  struct tree_s tree;
+  pthread_t *tids;
+  unsigned char root[MAX_DIGEST_LENGTH];
+  char hexbuf[2*MAX_DIGEST_LENGTH+1];
+  off_t size;
+  char *fnamebuf;
+  int escaped;
+  int i, n, rc = 0;
+
+  memset (&tree, 0, sizeof tree);
+  for (tree.algo=0; !opt_algos[tree.algo]; tree.algo++)
+    ;
+  tree.chunksize = chunksize;
+
+  filecount++;
+  if (!expected && *fname == '-' && !fname[1])
+    tree.fd = 0;
+  else
+    tree.fd = open (fname, O_RDONLY);
+  if (tree.fd == -1)
+    {
+      fprintf (stderr, PGM": can't open `%s': %s\n", fname, strerror (errno));
+      if (expected)
+        printf ("%s: FAILED open\n", fname);
+      readerrors++;
+      return -1;
+    }
+  /* Seeking also works for block devices and fails for pipes.  */
+  size = lseek (tree.fd, 0, SEEK_END);
+  if (size == (off_t)(-1))
+    {
+      if (errno == ESPIPE)
+        fprintf (stderr, PGM": can't use option -T with `%s': %s\n",
+                 fname, "not a seekable file");
+      else
+        fprintf (stderr, PGM": error reading `%s': %s\n",
+                 fname, strerror (errno));
+      if (expected)
+        printf ("%s: FAILED read\n", fname);
+      readerrors++;
+      if (tree.fd)
+        close (tree.fd);
+      return -1;
+    }
+  tree.size = size;
+  tree.nchunks = (tree.size + chunksize - 1) / chunksize;
+  tree.leaves = malloc (tree.nchunks * algos[tree.algo].digestlen + 1);
+  tids = calloc (tree_threads, sizeof *tids);
+  if (!tree.leaves || !tids)
+    {
+      fprintf (stderr, PGM": can't allocate buffer: %s\n", strerror (errno));
+      exit (2);
+    }
+  pthread_mutex_init (&tree.lock, NULL);
+
+  for (n=0; n < tree_threads && n < tree.nchunks; n++)
+    if (pthread_create (tids + n, NULL, tree_worker, &tree))
+      break;
+  if (!n && tree.nchunks)
+    tree_worker (&tree);
+  for (i=0; i < n; i++)
+    pthread_join (tids[i], NULL);
+  free (tids);
+  pthread_mutex_destroy (&tree.lock);
+  if (tree.fd)
+    close (tree.fd);
+
+  if (tree.err)
+    {
+      fprintf (stderr, PGM": error reading `%s': %s\n",
+               fname, strerror (tree.err));
+      if (expected)
+        printf ("%s: FAILED read\n", fname);
+      readerrors++;
+      free (tree.leaves);
+      return -1;
+    }
+
+  checkcount++;
+  tree_root (tree.algo, tree.leaves, tree.nchunks, root);
+  bin2hex (root, algos[tree.algo].digestlen, hexbuf);
+  fnamebuf = escapefname (fname, &escaped);
   if (expected)
     {
-      if (strcmp (buffer, expected))
+      if (strcmp (hexbuf, expected))
         {
-          printf ("%s: FAILED\n", fname);
+          printf ("%s: FAILED\n", fnamebuf);
           matcherrors++;
-          return -1;
+          report_bad_chunks (fname, fnamebuf, expected, &tree);
+          rc = -1;
         }
-      printf ("%s: OK\n", fname);
+      else
+        printf ("%s: OK\n", fnamebuf);
     }
   else
-    printf ("%s%s  %s\n", escaped? "\\":"", buffer, fname);
+    {
+      printf ("%s%s %llu  %s\n", escaped? "\\":"", hexbuf,
+              (unsigned long long)chunksize, fnamebuf);
+      if (tree.fd)
+        write_chunk_list (fname, &tree);
+    }
   free (fnamebuf);
+  free (tree.leaves);
+  return rc;
+}
+#endif /*USE_THREADS*/
+
+
+/* With option -j the files are hashed by a pool of worker threads.
+   The main thread queues the files and prints the results in input
+   order.  */
+#ifdef USE_THREADS
+static struct
+{
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  JOB *ring;
+  unsigned int size;
+  unsigned int head;    /* The oldest job not yet reported.  */
+  unsigned int next;    /* The next job to start.  */
+  unsigned int tail;    /* The next free slot.  */
+  int eof;
+  pthread_t *threads;
+  int nthreads;
+} pool = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER };
+
+
+static void *
+worker_thread (void *dummy)
+{
+  JOB *jobs[MB_BATCH];
+  int i, n;
+  unsigned char *iobuf = alloc_iobuf ();
+#ifdef USE_MD5_MB
+  struct mb_batch_s batch;
+
+  if (mb_enabled)
+    mb_batch_init (&batch);
+#endif
+
+  (void)dummy;
+  pthread_mutex_lock (&pool.lock);
+  for (;;)
+    {
+      while (pool.next == pool.tail && !pool.eof)
+        pthread_cond_wait (&pool.cond, &pool.lock);
+      if (pool.next == pool.tail)
+        break;
+      /* With multi-buffer MD5 take all pending jobs up to a batch.  */
+      for (n=0; pool.next != pool.tail && n < (mb_enabled? MB_BATCH:1); n++)
+        {
+          jobs[n] = pool.ring + (pool.next++ % pool.size);
+          jobs[n]->state = JOB_RUNNING;
+        }
+      pthread_mutex_unlock (&pool.lock);
+
+#ifdef USE_MD5_MB
+      for (i=0; i < n; i++)
+        compute_digest (jobs[i], iobuf, mb_enabled? &batch : NULL);
+      if (mb_enabled)
+        mb_finish (&batch);
+#else
+      for (i=0; i < n; i++)
+        compute_digest (jobs[i], iobuf, NULL);
+#endif
+
+      pthread_mutex_lock (&pool.lock);
+      for (i=0; i < n; i++)
+        jobs[i]->state = JOB_DONE;
+      pthread_cond_broadcast (&pool.cond);
+    }
+  pthread_mutex_unlock (&pool.lock);
+#ifdef USE_MD5_MB
+  if (mb_enabled)
+    free (batch.buffer);
+#endif
+  free (iobuf);
+  return NULL;
+}
+
+
+static void
+start_workers (void)
+{
+  int i, err;
+
+  pool.size = 4 * opt_jobs * (mb_enabled? MB_BATCH : 1);
+  pool.ring = calloc (pool.size, sizeof *pool.ring);
+  pool.threads = calloc (opt_jobs, sizeof *pool.threads);
+  if (!pool.ring || !pool.threads)
+    {
+      fprintf (stderr, PGM": can't allocate buffer: %s\n", strerror (errno));
+      exit (2);
+    }
+  for (i=0; i < opt_jobs; i++)
+    {
+      err = pthread_create (&pool.threads[i], NULL, worker_thread, NULL);
+      if (err)
+        {
+          fprintf (stderr, PGM": error creating thread: %s\n",
+                   strerror (err));
+          exit (2);
+        }
+      pool.nthreads++;
+    }
+}
+
+
+static void
+stop_workers (void)
+{
+  int i;
+
+  if (!pool.nthreads)
+    return;
+  pthread_mutex_lock (&pool.lock);
+  pool.eof = 1;
+  pthread_cond_broadcast (&pool.cond);
+  pthread_mutex_unlock (&pool.lock);
+  for (i=0; i < pool.nthreads; i++)
+    pthread_join (pool.threads[i], NULL);
+  pool.nthreads = 0;
+}
+
+
+/* Report the finished jobs at the head of the ring.  If WAIT_FOR is
+   not zero, wait until at most that many jobs are pending.  Returns
+   -1 if any reported job failed.  */
+static int
+flush_jobs (unsigned int wait_for)
+{
+  JOB *job;
+  int rc = 0;
+
+  pthread_mutex_lock (&pool.lock);
+  while (pool.head != pool.tail)
+    {
+      job = pool.ring + (pool.head % pool.size);
+      if (job->state != JOB_DONE)
+        {
+          if (pool.tail - pool.head < wait_for)
+            break;
+          pthread_cond_broadcast (&pool.cond);  /* For a partial batch.  */
+          pthread_cond_wait (&pool.cond, &pool.lock);
+          continue;
+        }
+      pthread_mutex_unlock (&pool.lock);
+      if (report_digest (job))
+        rc = -1;
+      free (job->fname);
+      free (job->expected);
+      pthread_mutex_lock (&pool.lock);
+      pool.head++;
+    }
+  pthread_mutex_unlock (&pool.lock);
+  return rc;
+}
+#endif /*USE_THREADS*/
+
+
+#ifdef USE_MD5_MB
+/* Without option -j small files are collected here and hashed in
+   one batch.  */
+static struct
+{
+  int n;
+  JOB jobs[MB_BATCH];
+} seqbatch;
+
+
+/* Hash and report all files in SEQBATCH.  */
+static int
+flush_seqbatch (void)
+{
+  static unsigned char *iobuf;
+  static struct mb_batch_s batch;
+  int i, rc = 0;
+
+  if (!iobuf)
+    {
+      iobuf = alloc_iobuf ();
+      mb_batch_init (&batch);
+    }
+  for (i=0; i < seqbatch.n; i++)
+    compute_digest (seqbatch.jobs + i, iobuf, &batch);
+  mb_finish (&batch);
+  for (i=0; i < seqbatch.n; i++)
+    {
+      if (report_digest (seqbatch.jobs + i))
+        rc = -1;
+      free (seqbatch.jobs[i].fname);
+      free (seqbatch.jobs[i].expected);
+    }
+  seqbatch.n = 0;
+  return rc;
+}
+#endif /*USE_MD5_MB*/
+
+
+/* Hash the file FNAME and compare it against EXPECTED if that is not
+   NULL.  In parallel mode the result may be reported later; the
+   return value then tells whether an earlier file failed.  */
+static int
+queue_file (const char *fname, const char *expected)
+{
+#ifdef USE_THREADS
+  JOB *job;
+  int rc;
+
+  if (opt_tree)
+    return tree_file (fname, expected, opt_tree);
+  if (opt_jobs < 2 && !mb_enabled)
+    return hash_file (fname, expected);
+
+#ifdef USE_MD5_MB
+  if (opt_jobs < 2)
+    {
+      rc = 0;
+      if (seqbatch.n == MB_BATCH)
+        rc = flush_seqbatch ();
+      job = seqbatch.jobs + seqbatch.n++;
+    }
+  else
+#endif
+    {
+      if (!pool.nthreads)
+        start_workers ();
+      rc = flush_jobs (pool.size);
+      job = pool.ring + (pool.tail % pool.size);
+    }
+  memset (job, 0, sizeof *job);
+  job->fname = strdup (fname);
+  job->expected = expected? strdup (expected) : NULL;
+  if (!job->fname || (expected && !job->expected))
+    {
+      fprintf (stderr, PGM": can't allocate buffer: %s\n", strerror (errno));
+      exit (2);
+    }
+  if (opt_jobs < 2)
+    return rc;
+  pthread_mutex_lock (&pool.lock);
+  pool.tail++;
+  if (!mb_enabled || pool.tail - pool.next >= MB_BATCH)
+    pthread_cond_broadcast (&pool.cond);
+  pthread_mutex_unlock (&pool.lock);
+  return rc;
+#else
+  return hash_file (fname, expected);
+#endif
+}
+
+
+/* Wait for all queued files and report them.  */
+static int
+flush_queue (void)
+{
+#ifdef USE_MD5_MB
+  if (seqbatch.n)
+    return flush_seqbatch ();
+#endif
+#ifdef USE_THREADS
+  if (pool.nthreads)
+    return flush_jobs (1);
+#endif
   return 0;
 }
 
@@ -851,6 +2889,17 @@ check_file (const char *fname)
   size_t n;
   int rc = 0;
   int escaped;
+  int algo;
+  size_t nameoff;
+  char *name;
+#ifdef USE_THREADS
+  u64 chunksize;
+#endif
+
+  for (algo=0; !opt_algos[algo]; algo++)
+    ;
+  /* Offset where the name starts in the file.  */
+  nameoff = 2 * algos[algo].digestlen + 2;
       
   if (*fname == '-' && !fname[1])
     fp = stdin;
@@ -880,13 +2929,30 @@ check_file (const char *fname)
         line[--n] = 0;
       if (!*line)
         continue;  /* Ignore empty lines.  */
-      if (n < NAME_OFFSET || line[NAME_OFFSET-2] != ' ')
+      if (n < nameoff || line[nameoff-2] != ' ')
         {
           fprintf (stderr, PGM": error parsing `%s': %s\n", fname,
                    "invalid line");
           rc = -1;
           continue;
         }
+      name = line + nameoff;
+#ifdef USE_THREADS
+      chunksize = 0;
+      if (line[nameoff-1] >= '0' && line[nameoff-1] <= '9')
+        {
+          /* A line written with option -T.  */
+          chunksize = strtoull (line+nameoff-1, &p, 10);
+          if (!chunksize || p[0] != ' ' || p[1] != ' ')
+            {
+              fprintf (stderr, PGM": error parsing `%s': %s\n", fname,
+                       "invalid line");
+              rc = -1;
+              continue;
+            }
+          name = p + 2;
+        }
+#endif /*USE_THREADS*/
       
       /* Note that we ignore the binary flag ('*') used by GNU
          versions of this tool: It does not make sense to compute a
@@ -898,17 +2964,31 @@ check_file (const char *fname)
          the checksums will differ.  */
 
       /* Lowercase the checksum.  */
-      line[NAME_OFFSET-2] = 0;
+      line[nameoff-2] = 0;
       for (p=line; *p; p++)
         if (*p >= 'A' && *p <= 'Z')
           *p |= 0x20;
       /* Unescape the fname.  */
       if (escaped)
-        unescapefname (line+NAME_OFFSET);
+        unescapefname (name);
       /* Hash the file.  */
-      if (hash_file (line+NAME_OFFSET, line))
+#ifdef USE_THREADS
+      if (chunksize)
+        {
+          /* Finish the queued files first to keep the output in
+             order.  */
+          if (flush_queue ())
+            rc = -1;
+          if (tree_file (name, line, chunksize))
+            rc = -1;
+        }
+      else
+#endif
+      if (queue_file (name, line))
         rc = -1;
     }
+  if (flush_queue ())
+    rc = -1;
 
   if (ferror (fp))
     {
@@ -964,13 +3044,15 @@ hash_list (void)
       off++;
       if (!c)
         {
-          if (*namebuf && hash_file (namebuf, NULL))
+          if (*namebuf && queue_file (namebuf, NULL))
             rc = -1;
           n = 0;
           lastoff = off;
         }
     }
   while (!ready);
+  if (flush_queue ())
+    rc = -1;
   
   return rc;
 }
@@ -979,7 +3061,12 @@ hash_list (void)
 static void
 usage (void)
 {
-  fprintf (stderr, "usage: sha1sum [-c|-0] [--] FILENAMES|-\n");
+  fprintf (stderr, "usage: "PGM" [-c|-0] [-j N] [-a ALGOS] [-o DIR] [-T SIZE]"
+                   "\n"
+                   "       [--cache FILE [--paranoid]] [--] FILENAMES|-\n"
+                   "       "PGM" --selftest|--benchmark\n"
+                   "ALGOS is a comma separated list of md5, sha1, sha256"
+                   " and sha512\n");
   exit (1);
 }
 
@@ -989,6 +3076,9 @@ main (int argc, char **argv)
   int check = 0;
   int filelist = 0;
   int rc = 0;
+  const char *outdir = NULL;
+  char *fnamebuf, *p;
+  int a;
 
   assert (sizeof (u32) == 4);
   {
@@ -996,6 +3086,7 @@ main (int argc, char **argv)
     foo.u = 32;
     big_endian_host = !foo.b[0];
   }
+  select_transform ();
 
   if (argc)
     {
@@ -1014,12 +3105,77 @@ main (int argc, char **argv)
              stdout);
       exit (0);
     }
+  if (argc && !strcmp (*argv, "--selftest"))
+    exit (selftest ()? 1 : 0);
+  if (argc && !strcmp (*argv, "--benchmark"))
+    {
+      benchmark ();
+      exit (0);
+    }
   while (argc && argv[0][0] == '-' && argv[0][1])
     {
       if (!strcmp (*argv, "-c"))
         check = 1;
       else if (argc && !strcmp (*argv, "-0"))
         filelist = 1;
+      else if (!strcmp (*argv, "-j") && argc > 1)
+        {
+          argc--; argv++;
+          opt_jobs = atoi (*argv);
+#ifdef USE_THREADS
+          if (opt_jobs < 1)
+            opt_jobs = sysconf (_SC_NPROCESSORS_ONLN);
+          tree_threads = opt_jobs;
+#else
+          opt_jobs = 1;
+#endif
+        }
+      else if (!strcmp (*argv, "-a") && argc > 1)
+        {
+          argc--; argv++;
+          for (p = strtok (*argv, ","); p; p = strtok (NULL, ","))
+            {
+              for (a=0; a < N_ALGOS && strcmp (p, algos[a].name); a++)
+                ;
+              if (a == N_ALGOS)
+                {
+                  fprintf (stderr, PGM": unknown algorithm `%s'\n", p);
+                  exit (1);
+                }
+              if (!opt_algos[a])
+                nalgos++;
+              opt_algos[a] = 1;
+            }
+        }
+#ifdef USE_THREADS
+      else if (!strcmp (*argv, "-T") && argc > 1)
+        {
+          argc--; argv++;
+          opt_tree = strtoull (*argv, &p, 10);
+          if (*p == 'k' || *p == 'K')
+            opt_tree <<= 10, p++;
+          else if (*p == 'm' || *p == 'M')
+            opt_tree <<= 20, p++;
+          else if (*p == 'g' || *p == 'G')
+            opt_tree <<= 30, p++;
+          if (!opt_tree || *p)
+            usage ();
+        }
+#endif
+#ifdef USE_CACHE
+      else if (!strcmp (*argv, "--cache") && argc > 1)
+        {
+          argc--; argv++;
+          cache_load (*argv);
+        }
+      else if (!strcmp (*argv, "--paranoid"))
+        opt_paranoid = 1;
+#endif
+      else if (!strcmp (*argv, "-o") && argc > 1)
+        {
+          argc--; argv++;
+          outdir = *argv;
+        }
       else if (!strcmp (*argv, "--"))
         {
           argc--; argv++;
@@ -1035,6 +3191,59 @@ main (int argc, char **argv)
   if (!argc)
     usage ();
 
+  if (!nalgos)
+    {
+      opt_algos[DEFAULT_ALGO] = 1;
+      nalgos = 1;
+    }
+  if (check && (nalgos > 1 || outdir || opt_tree))
+    usage ();
+  if (opt_tree && (nalgos > 1 || outdir))
+    usage ();
+#ifdef USE_THREADS
+  /* Without -j the chunks are hashed using all CPUs but the files
+     one after the other.  */
+  if (!tree_threads)
+    tree_threads = sysconf (_SC_NPROCESSORS_ONLN);
+  if (tree_threads < 1)
+    tree_threads = 1;
+  if (opt_tree)
+    opt_jobs = 1;
+#endif
+#ifdef USE_MD5_MB
+  mb_enabled = md5_mb_lanes && nalgos == 1 && opt_algos[ALGO_MD5] && !opt_tree;
+#endif
+  if (nalgos > 1 && !outdir)
+    usage ();
+  for (a=0; a < N_ALGOS; a++)
+    {
+      if (!opt_algos[a])
+        continue;
+      if (!outdir)
+        {
+          sumsfp[a] = stdout;
+          continue;
+        }
+      fnamebuf = malloc (strlen (outdir) + 1 + strlen (algos[a].sumsname) + 1);
+      if (!fnamebuf)
+        {
+          fprintf (stderr, PGM": can't allocate buffer: %s\n",
+                   strerror (errno));
+          exit (2);
+        }
+      strcpy (fnamebuf, outdir);
+      strcat (fnamebuf, "/");
+      strcat (fnamebuf, algos[a].sumsname);
+      sumsfp[a] = fopen (fnamebuf, "w");
+      if (!sumsfp[a])
+        {
+          fprintf (stderr, PGM": can't create `%s': %s\n",
+                   fnamebuf, strerror (errno));
+          exit (2);
+        }
+      free (fnamebuf);
+    }
+
   if (filelist)
     {
       /* With option -0 a dash must be given as filename.  */
@@ -1054,11 +3263,28 @@ main (int argc, char **argv)
             }
           else
             {
-              if (hash_file (*argv, NULL))
+              if (queue_file (*argv, NULL))
                 rc = 1;
             }
         }
+      if (flush_queue ())
+        rc = 1;
     }
+#ifdef USE_THREADS
+  stop_workers ();
+#endif
+#ifdef USE_CACHE
+  if (cache_save ())
+    rc = 1;
+#endif
+  if (outdir)
+    for (a=0; a < N_ALGOS; a++)
+      if (opt_algos[a] && (ferror (sumsfp[a]) || fclose (sumsfp[a])))
+        {
+          fprintf (stderr, PGM": error writing `%s/%s': %s\n",
+                   outdir, algos[a].sumsname, strerror (errno));
+          rc = 1;
+        }
 
   if (check && readerrors)
     fprintf (stderr, PGM": WARNING: %u of %u listed files "
@@ -1072,6 +3298,6 @@ main (int argc, char **argv)
 
 /*
 Local Variables:
-compile-command: "cc -Wall -g -o sha1sum sha1sum.c"
+compile-command: "cc -Wall -g -pthread -o sha1sum sha1sum.c"
 End:
 */